@@ -0,0 +1,382 @@
+// Sweeps mmlog over writer threads, writer processes, record sizes and chunk geometries, and writes a CSV row per
+// configuration.  Every row starts with a label (say, the commit being measured), so runs from different builds can be
+// concatenated and compared.
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mmlog.h"
+
+#define MAX_VALUES 16          // Most values any one parameter can sweep over
+#define CALIBRATION_MS 20      // Length of each cycle counter calibration sample
+#define CALIBRATION_SAMPLES 5  // Median of this many
+
+typedef struct {
+    uint64_t values[MAX_VALUES];
+    int count;
+} sweep_t;
+
+typedef struct {
+    const char* dir;       // Where the benchmark log goes
+    const char* label;     // First column of every row
+    uint64_t budget;       // Bytes written per configuration, across every writer
+    uint64_t max_records;  // Cap on records per writer, for the small sizes
+    sweep_t threads;       // Writer threads per process
+    sweep_t processes;     // Writer processes
+    sweep_t record_sizes;  // Payload bytes per record
+    sweep_t chunk_sizes;   // Chunk size of the log
+    sweep_t max_chunks;    // Ring capacity of the log
+} options_t;
+
+// One point of the sweep
+typedef struct {
+    uint64_t threads;
+    uint64_t processes;
+    uint64_t record_size;
+    uint64_t chunk_size;
+    uint64_t max_chunks;
+    uint64_t records;  // Per writer
+} config_t;
+
+typedef struct {
+    _Atomic int64_t start_ns;
+    _Atomic int64_t end_ns;
+    _Atomic uint64_t failures;
+} writer_result_t;
+
+// Lives in memory shared with the writer processes; the latency samples follow, `records` per writer
+typedef struct {
+    _Atomic uint32_t ready;  // Writers which are set up (or gave up) and waiting to start
+    _Atomic bool go;         // Starts every writer at once
+    writer_result_t writers[];
+} shared_t;
+
+typedef struct {
+    pthread_t thread;
+    const config_t* config;
+    log_handle_t* handle;
+    shared_t* shared;
+    uint64_t* samples;  // This writer's
+    uint32_t writer;
+} writer_args_t;
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int compare_u64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+// Same approach as tsc_time's CycleCounter: the counter is frequency-normalized, so the median over a few wall-clock
+// intervals is good enough
+static double calibrate_cycles_per_ns(void)
+{
+    uint64_t samples[CALIBRATION_SAMPLES];
+    for (int i = 0; i < CALIBRATION_SAMPLES; i++) {
+        int64_t start_ns = now_ns();
+        uint64_t start_cycles = mmlog_cycles();
+        int64_t end_ns;
+        while ((end_ns = now_ns()) - start_ns < CALIBRATION_MS * 1000000) {
+        }
+        samples[i] = (mmlog_cycles() - start_cycles) * 1000 / (uint64_t)(end_ns - start_ns);  // Cycles per us
+    }
+    qsort(samples, CALIBRATION_SAMPLES, sizeof(samples[0]), compare_u64);
+    return samples[CALIBRATION_SAMPLES / 2] / 1000.0;
+}
+
+static void* writer_routine(void* arg)
+{
+    writer_args_t* args = (writer_args_t*)arg;
+    const config_t* config = args->config;
+    writer_result_t* result = &args->shared->writers[args->writer];
+
+    char* record = (char*)malloc(config->record_size);
+    atomic_fetch_add(&args->shared->ready, 1);
+    if (!record) {
+        atomic_store(&result->failures, config->records);
+        return NULL;
+    }
+    memset(record, 'a' + args->writer % 26, config->record_size);
+    while (!atomic_load(&args->shared->go)) {
+        mmlog_cpu_relax();
+    }
+
+    uint64_t failures = 0;
+    atomic_store(&result->start_ns, now_ns());
+    for (uint64_t i = 0; i < config->records; i++) {
+        uint64_t start = mmlog_cycles();
+        failures += !mmlog_insert(args->handle, record, config->record_size);
+        args->samples[i] = mmlog_cycles() - start;
+    }
+    atomic_store(&result->end_ns, now_ns());
+    atomic_store(&result->failures, failures);
+    free(record);
+    return NULL;
+}
+
+// Body of each writer process.  Writers which can't be started still check in (as failures), so nobody waits on them.
+static int writer_process(const char* filename, const config_t* config, shared_t* shared, uint64_t* samples,
+                          uint32_t process)
+{
+    writer_args_t* args = (writer_args_t*)calloc(config->threads, sizeof(writer_args_t));
+    log_handle_t* handle = args ? mmlog_open(filename, config->chunk_size, config->max_chunks) : NULL;
+    if (!handle) {
+        fprintf(stderr, "Process %u failed to open %s: %s\n", process, filename, mmlog_strerror_cur());
+        for (uint64_t i = 0; i < config->threads; i++) {
+            atomic_store(&shared->writers[process * config->threads + i].failures, config->records);
+        }
+        atomic_fetch_add(&shared->ready, config->threads);
+        return 1;
+    }
+
+    uint64_t started = 0;
+    for (uint64_t i = 0; i < config->threads; i++) {
+        uint32_t writer = process * config->threads + i;
+        args[i] = (writer_args_t){0, config, handle, shared, samples + writer * config->records, writer};
+        if (0 == pthread_create(&args[i].thread, NULL, writer_routine, &args[i])) {
+            started++;
+        } else {
+            atomic_store(&shared->writers[writer].failures, config->records);
+            atomic_fetch_add(&shared->ready, 1);
+            args[i].config = NULL;
+        }
+    }
+    for (uint64_t i = 0; i < config->threads; i++) {
+        if (args[i].config) {
+            pthread_join(args[i].thread, NULL);
+        }
+    }
+    mmlog_close(handle);
+    free(args);
+    return started == config->threads ? 0 : 1;
+}
+
+static uint64_t percentile(const uint64_t* sorted, uint64_t count, double fraction)
+{
+    uint64_t i = (uint64_t)(fraction * count);
+    return sorted[i < count ? i : count - 1];
+}
+
+// Runs one configuration, then prints its row
+static bool run_config(FILE* out, const options_t* options, const config_t* config, double cycles_per_ns)
+{
+    char filename[PATH_MAX];
+    char meta_filename[PATH_MAX + 8];
+    snprintf(filename, sizeof(filename), "%s/mmlog_bench.%d.log", options->dir, (int)getpid());
+    snprintf(meta_filename, sizeof(meta_filename), "%s.mmlog", filename);
+    unlink(filename);
+    unlink(meta_filename);
+
+    // The log is created up front, so that the writers only time their inserts.  This handle also reads the counters.
+    log_handle_t* handle = mmlog_open(filename, config->chunk_size, config->max_chunks);
+    if (!handle) {
+        fprintf(stderr, "Failed to create %s: %s\n", filename, mmlog_strerror_cur());
+        return false;
+    }
+
+    uint64_t writers = config->threads * config->processes;
+    size_t samples_offset = ALIGN(sizeof(shared_t) + writers * sizeof(writer_result_t), (size_t)64);
+    size_t mapping_size = samples_offset + writers * config->records * sizeof(uint64_t);
+    shared_t* shared = (shared_t*)mmap(NULL, mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == shared) {
+        fprintf(stderr, "Failed to map %zu bytes for the results\n", mapping_size);
+        mmlog_close(handle);
+        return false;
+    }
+    uint64_t* samples = (uint64_t*)((char*)shared + samples_offset);
+
+    // Every writer process is a child, so that this one can start them all at once
+    uint64_t forked = 0;
+    for (; forked < config->processes; forked++) {
+        fflush(out);
+        pid_t pid = fork();
+        if (0 == pid) {
+            _exit(writer_process(filename, config, shared, samples, forked));
+        }
+        if (-1 == pid) {
+            atomic_fetch_add(&shared->ready, (config->processes - forked) * config->threads);
+            break;
+        }
+    }
+    while (atomic_load(&shared->ready) < writers) {
+        usleep(100);
+    }
+    atomic_store(&shared->go, true);
+
+    bool ok = forked == config->processes;
+    for (uint64_t i = 0; i < forked; i++) {
+        int status;
+        ok = wait(&status) > 0 && WIFEXITED(status) && 0 == WEXITSTATUS(status) && ok;
+    }
+
+    // Throughput is over the span from the first writer starting to the last one finishing
+    int64_t start_ns = INT64_MAX;
+    int64_t end_ns = 0;
+    uint64_t failures = 0;
+    for (uint64_t i = 0; i < writers; i++) {
+        writer_result_t* result = &shared->writers[i];
+        if (atomic_load(&result->end_ns)) {
+            start_ns = atomic_load(&result->start_ns) < start_ns ? atomic_load(&result->start_ns) : start_ns;
+            end_ns = atomic_load(&result->end_ns) > end_ns ? atomic_load(&result->end_ns) : end_ns;
+        }
+        failures += atomic_load(&result->failures);
+    }
+    uint64_t count = writers * config->records;
+    double seconds = end_ns > start_ns ? (end_ns - start_ns) / 1e9 : 0;
+    qsort(samples, count, sizeof(uint64_t), compare_u64);
+
+    mmlog_stats_t stats;
+    mmlog_stats(handle, &stats);
+    fprintf(out, "%s,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%.6f,%.0f,%.1f",
+            options->label, config->threads, config->processes, config->record_size, config->chunk_size,
+            config->max_chunks, count, seconds, seconds ? (count - failures) / seconds : 0,
+            seconds ? (count - failures) * config->record_size / seconds / (1 << 20) : 0);
+    fprintf(out, ",%.0f,%.0f,%.0f,%.0f", percentile(samples, count, 0.5) / cycles_per_ns,
+            percentile(samples, count, 0.99) / cycles_per_ns, percentile(samples, count, 0.999) / cycles_per_ns,
+            samples[count - 1] / cycles_per_ns);
+    fprintf(out, ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n", failures, stats.head_spins,
+            stats.expand_lock_failures, stats.ring_full, stats.pwrite_fallbacks);
+    fflush(out);
+
+    munmap(shared, mapping_size);
+    mmlog_close(handle);
+    unlink(filename);
+    unlink(meta_filename);
+    return ok;
+}
+
+// Sizes take an optional K, M or G suffix
+static bool parse_sweep(const char* arg, sweep_t* sweep)
+{
+    sweep->count = 0;
+    while (*arg) {
+        char* end;
+        uint64_t value = strtoull(arg, &end, 10);
+        switch (*end) {
+            case 'K': value <<= 10, end++; break;
+            case 'M': value <<= 20, end++; break;
+            case 'G': value <<= 30, end++; break;
+        }
+        if (end == arg || !value || (*end && ',' != *end) || sweep->count == MAX_VALUES) {
+            return false;
+        }
+        sweep->values[sweep->count++] = value;
+        arg = *end ? end + 1 : end;
+    }
+    return sweep->count > 0;
+}
+
+static bool parse_size(const char* arg, uint64_t* value)
+{
+    sweep_t sweep;
+    if (!parse_sweep(arg, &sweep) || 1 != sweep.count) {
+        return false;
+    }
+    *value = sweep.values[0];
+    return true;
+}
+
+static void usage(const char* name)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -t LIST   writer threads per process (default 1,4)\n"
+            "  -p LIST   writer processes (default 1,4)\n"
+            "  -s LIST   record sizes (default 8,64,512,4K,64K,1M)\n"
+            "  -c LIST   chunk sizes (default 64K,1M)\n"
+            "  -m LIST   max chunks (default 4,16)\n"
+            "  -b SIZE   bytes written per configuration (default 64M)\n"
+            "  -n COUNT  most records per writer (default 100000)\n"
+            "  -d DIR    where to put the log (default .)\n"
+            "  -l LABEL  first column of every row, e.g. a commit (default \"-\")\n"
+            "  -o FILE   write the CSV here instead of stdout\n"
+            "Lists are comma-separated; sizes take a K, M or G suffix.\n",
+            name);
+}
+
+int main(int argc, char** argv)
+{
+    options_t options = {
+        .dir = ".",
+        .label = "-",
+        .budget = 64ull << 20,
+        .max_records = 100000,
+        .threads = {{1, 4}, 2},
+        .processes = {{1, 4}, 2},
+        .record_sizes = {{8, 64, 512, 4096, 65536, 1 << 20}, 6},
+        .chunk_sizes = {{65536, 1 << 20}, 2},
+        .max_chunks = {{4, 16}, 2},
+    };
+    FILE* out = stdout;
+    for (int opt; -1 != (opt = getopt(argc, argv, "t:p:s:c:m:b:n:d:l:o:h"));) {
+        bool ok = true;
+        switch (opt) {
+            case 't': ok = parse_sweep(optarg, &options.threads); break;
+            case 'p': ok = parse_sweep(optarg, &options.processes); break;
+            case 's': ok = parse_sweep(optarg, &options.record_sizes); break;
+            case 'c': ok = parse_sweep(optarg, &options.chunk_sizes); break;
+            case 'm': ok = parse_sweep(optarg, &options.max_chunks); break;
+            case 'b': ok = parse_size(optarg, &options.budget); break;
+            case 'n': ok = parse_size(optarg, &options.max_records); break;
+            case 'd': options.dir = optarg; break;
+            case 'l': options.label = optarg; break;
+            case 'o': ok = NULL != (out = fopen(optarg, "w")); break;
+            default: ok = false; break;
+        }
+        if (!ok) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    double cycles_per_ns = calibrate_cycles_per_ns();
+    fprintf(stderr, "Cycle counter runs at %.3f GHz\n", cycles_per_ns);
+    fprintf(out, "label,threads,processes,record_size,chunk_size,max_chunks,records,seconds,records_per_sec,"
+                 "mib_per_sec,p50_ns,p99_ns,p999_ns,max_ns,failures,head_spins,expand_lock_failures,ring_full,"
+                 "pwrite_fallbacks\n");
+
+    int failed = 0;
+    for (int c = 0; c < options.chunk_sizes.count; c++) {
+        for (int m = 0; m < options.max_chunks.count; m++) {
+            for (int p = 0; p < options.processes.count; p++) {
+                for (int t = 0; t < options.threads.count; t++) {
+                    for (int s = 0; s < options.record_sizes.count; s++) {
+                        config_t config = {options.threads.values[t], options.processes.values[p],
+                                           options.record_sizes.values[s], options.chunk_sizes.values[c],
+                                           options.max_chunks.values[m], 0};
+                        uint64_t writers = config.threads * config.processes;
+                        config.records = options.budget / (config.record_size * writers);
+                        config.records = config.records < options.max_records ? config.records : options.max_records;
+                        config.records = config.records ? config.records : 1;
+                        fprintf(stderr, "chunk_size %" PRIu64 " max_chunks %" PRIu64 ": %" PRIu64 " x %" PRIu64
+                                        " writers, %" PRIu64 " x %" PRIu64 " bytes\n",
+                                config.chunk_size, config.max_chunks, config.processes, config.threads,
+                                config.records, config.record_size);
+                        failed += !run_config(out, &options, &config, cycles_per_ns);
+                    }
+                }
+            }
+        }
+    }
+
+    if (out != stdout) {
+        fclose(out);
+    }
+    return failed ? 1 : 0;
+}
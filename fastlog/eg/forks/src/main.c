@@ -69,7 +69,7 @@ void child_process(const char* log_filename, int process_num) {
         if (!mmlog_insert(handle, message, msg_len)) {
             fprintf(stderr, "Process %d: Failed to insert message %d: %s\n",
                     process_num, i, strerror(errno));
-            free(handle);
+            mmlog_close(handle);
             exit(1);
         }
 
@@ -80,7 +80,7 @@ void child_process(const char* log_filename, int process_num) {
     }
 
     // Clean up
-    free(handle);
+    mmlog_close(handle);
     exit(0);
 }
 
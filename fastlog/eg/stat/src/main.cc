@@ -0,0 +1,100 @@
+// Attaches to a log (any log, including one other processes are writing to) and prints its counters as they change
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+#include "accounting/cycle_counter.hpp"
+#include "libmmlog.h"
+
+// Upper bound of a latency bucket, in nanoseconds
+static uint64_t bucket_ns(uint32_t bucket)
+{
+    return CycleCounter::cycles_to_ns(2ull << bucket);
+}
+
+// Smallest bucket bound which covers the given fraction of the samples
+static uint64_t percentile_ns(const uint64_t* latency, uint64_t samples, double fraction)
+{
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < MMLOG_STATS_BUCKETS; i++) {
+        seen += latency[i];
+        if (seen >= fraction * samples) {
+            return bucket_ns(i);
+        }
+    }
+    return 0;
+}
+
+// Rates are left out if there's no interval to go by
+static void print_stats(const mmlog_stats_t& now, const mmlog_stats_t& then, double seconds)
+{
+    uint64_t latency[MMLOG_STATS_BUCKETS];
+    uint64_t samples = 0;
+    for (uint32_t i = 0; i < MMLOG_STATS_BUCKETS; i++) {
+        latency[i] = now.latency[i] - then.latency[i];
+        samples += latency[i];
+    }
+
+    printf("inserts %llu", (unsigned long long)now.inserts);
+    if (seconds > 0) {
+        printf(" (%.0f/s, %.1f MiB/s)", (now.inserts - then.inserts) / seconds,
+               (now.bytes - then.bytes) / seconds / (1 << 20));
+    }
+    printf("  bytes %llu  head_spins %llu  expand_lock_failures %llu  ring_full %llu  pwrite_fallbacks %llu",
+           (unsigned long long)now.bytes, (unsigned long long)now.head_spins,
+           (unsigned long long)now.expand_lock_failures,
+           (unsigned long long)now.ring_full, (unsigned long long)now.pwrite_fallbacks);
+    if (samples) {
+        printf("  latency p50 <%lluns p99 <%lluns p999 <%lluns", (unsigned long long)percentile_ns(latency, samples, 0.5),
+               (unsigned long long)percentile_ns(latency, samples, 0.99),
+               (unsigned long long)percentile_ns(latency, samples, 0.999));
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <log file> [interval_ms]\n", argv[0]);
+        fprintf(stderr, "  Prints the log's counters every interval (default 1000ms), or just once for 0\n");
+        return 1;
+    }
+    long interval_ms = argc > 2 ? strtol(argv[2], nullptr, 10) : 1000;
+
+    mmlog_reader_t* reader = mmlog_reader_open(argv[1]);
+    if (!reader) {
+        fprintf(stderr, "Failed to open %s: %s\n", argv[1], mmlog_strerror_cur());
+        return 1;
+    }
+
+    // Writers only record raw cycles
+    CycleCounter::initialize();
+
+    mmlog_stats_t then = {};
+    mmlog_stats_t now;
+    mmlog_reader_stats(reader, &now);
+    if (interval_ms <= 0) {
+        print_stats(now, then, 0);
+        for (uint32_t i = 0; i < MMLOG_STATS_BUCKETS; i++) {
+            if (now.latency[i]) {
+                printf("  <%12lluns %llu\n", (unsigned long long)bucket_ns(i), (unsigned long long)now.latency[i]);
+            }
+        }
+        mmlog_reader_close(reader);
+        return 0;
+    }
+
+    // Rates and percentiles are over the last interval, totals are since the log was created
+    auto last = std::chrono::steady_clock::now();
+    while (true) {
+        then = now;
+        std::this_thread::sleep_for(std::chrono::milliseconds(interval_ms));
+        auto current = std::chrono::steady_clock::now();
+        mmlog_reader_stats(reader, &now);
+        print_stats(now, then, std::chrono::duration<double>(current - last).count());
+        last = current;
+    }
+}
@@ -60,7 +60,7 @@ void* thread_worker(void* arg) {
         if (!mmlog_insert(handle, message, msg_len)) {
             fprintf(stderr, "Thread %d: Failed to insert message %d: %s\n",
                     args->thread_num, i, mmlog_strerror_cur());
-            free(handle);
+            mmlog_close(handle);
             args->success = false;
             return NULL;
         }
@@ -68,7 +68,7 @@ void* thread_worker(void* arg) {
     }
 
     // Clean up
-    free(handle);
+    mmlog_close(handle);
     args->success = true;
     return NULL;
 }
@@ -220,7 +220,7 @@ void run_mixed_size_test(const char* log_filename) {
     }
 
     // Clean up
-    free(handle);
+    mmlog_close(handle);
 }
 
 int main(void) {
@@ -1,10 +1,9 @@
 #include <cstddef>
-#include <fstream>
 #include <iostream>
 #include <string>
 #include <vector>
 
-#include "libmmlog.h"
+#include "mmlog.hpp"
 
 int main()
 {
@@ -22,40 +21,39 @@ int main()
 
     // Open log and write messages
     std::cout << "Writing messages to log...\n";
-    log_handle_t* handle = mmlog_open(filename.c_str(), chunk_size, 16);
-    if (!handle) {
-        std::cerr << "Failed to open log" << std::endl;
+    mmlog::Log log(filename.c_str(), chunk_size, 16);
+    if (!log) {
+        std::cerr << "Failed to open log: " << mmlog::Log::error() << std::endl;
         return 1;
     }
 
-    for (const auto& msg : messages) {
-        if (!mmlog_insert(handle, msg.c_str(), msg.length())) {
-            std::cerr << "Failed to insert" << std::endl;
-            free(handle);
-            return 1;
-        }
-        if (!mmlog_insert(handle, "\n", 1)) {
-            std::cerr << "Failed to insert newline" << std::endl;
-            free(handle);
+    for (size_t i = 0; i < messages.size(); i++) {
+        if (!log.log("{}: {}\n", i, messages[i])) {
+            std::cerr << "Failed to insert: " << mmlog::Log::error() << std::endl;
             return 1;
         }
-        std::cout << "Wrote: " << msg << std::endl;
+        std::cout << "Wrote: " << messages[i] << std::endl;
     }
 
     // Clean up and close
-    mmlog_trim(handle);
-    free(handle);
+    mmlog_trim(log.handle());
+    log.close();
 
-    // Read file back and validate
+    // Read the log back and validate
     std::cout << "\nValidating messages in log...\n";
-    std::ifstream file(filename, std::ios::binary);
-    if (!file) {
-        std::cerr << "Failed to open file for reading\n";
+    mmlog_reader_t* reader = mmlog_reader_open(filename.c_str());
+    if (!reader) {
+        std::cerr << "Failed to open log for reading: " << mmlog_strerror_cur() << std::endl;
         return 1;
     }
 
-    std::string content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
-    file.close();
+    std::string content;
+    const void* data;
+    size_t size;
+    while (mmlog_reader_next(reader, &data, &size)) {
+        content.append(static_cast<const char*>(data), size);
+    }
+    mmlog_reader_close(reader);
 
     size_t found = 0;
     for (const auto& msg : messages) {
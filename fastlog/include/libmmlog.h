@@ -10,15 +10,75 @@
 #include <stdint.h>
 #define EXTERN_C extern
 #endif
+#include <sys/uio.h>
 
 typedef struct log_metadata_t log_metadata_t;
 typedef struct chunk_info_t chunk_info_t;
 typedef struct log_handle_t log_handle_t;
 typedef struct log_range_t log_range_t;
+typedef struct mmlog_reader_t mmlog_reader_t;
 
+// Must match mmlog.h (src/libmmlog.c checks that they do)
+#define MMLOG_FLAG_FRAMED (1u << 0)
+#define MMLOG_FLAG_HUGEPAGES (1u << 1)
+#define MMLOG_HUGE_PAGE_SIZE (2u << 20)
+#define MMLOG_DURABILITY_NONE 0
+#define MMLOG_DURABILITY_ASYNC 1
+#define MMLOG_DURABILITY_GROUP 2
+#define MMLOG_SYNC_ALL ((uint64_t)-1)
+#define MMLOG_STATS_BUCKETS 32
+
+typedef struct {
+    uint64_t size;
+    uint32_t max_age_ms;
+    uint32_t retain;
+} mmlog_segments_t;
+
+typedef struct {
+    uint64_t inserts;
+    uint64_t bytes;
+    uint64_t head_spins;
+    uint64_t expand_lock_failures;
+    uint64_t ring_full;
+    uint64_t pwrite_fallbacks;
+    uint64_t latency[MMLOG_STATS_BUCKETS];
+} mmlog_stats_t;
+
+typedef struct {
+    log_handle_t* handle;
+    chunk_info_t* chunk;
+    uint64_t cursor;
+    size_t size;
+    void* data;
+} mmlog_reservation_t;
+
+// src/libmmlog.c only wants the types above, to check them against mmlog.h
+#ifndef MMLOG_FFI_TYPES_ONLY
 EXTERN_C log_handle_t* mmlog_open(const char* filename, size_t chunk_size, uint32_t max_chunks);
+EXTERN_C log_handle_t* mmlog_open_ex(const char* filename, size_t chunk_size, uint32_t max_chunks, uint32_t flags);
+EXTERN_C log_handle_t* mmlog_open_segmented(const char* filename, size_t chunk_size, uint32_t max_chunks,
+                                            uint32_t flags, const mmlog_segments_t* segments);
+EXTERN_C bool mmlog_set_slab_size(log_handle_t* handle, size_t slab_size);
+EXTERN_C void mmlog_slab_flush(log_handle_t* handle);
+EXTERN_C bool mmlog_set_prefetch(log_handle_t* handle, uint32_t chunks_ahead);
+EXTERN_C bool mmlog_set_durability(log_handle_t* handle, uint32_t durability, uint32_t interval_ms);
+EXTERN_C bool mmlog_sync(log_handle_t* handle, uint64_t end);
+EXTERN_C bool mmlog_set_compression(log_handle_t* handle, bool enabled);
 EXTERN_C bool mmlog_insert(log_handle_t* handle, const void* data, size_t size);
+EXTERN_C bool mmlog_insertv(log_handle_t* handle, const struct iovec* iov, int iovcnt);
+EXTERN_C bool mmlog_insert_batch(log_handle_t* handle, const struct iovec* records, size_t count);
+EXTERN_C void* mmlog_reserve(log_handle_t* handle, size_t size, mmlog_reservation_t* reservation);
+EXTERN_C bool mmlog_commit(mmlog_reservation_t* reservation);
+EXTERN_C bool mmlog_abandon(mmlog_reservation_t* reservation);
 EXTERN_C void mmlog_trim(log_handle_t* handle);
+EXTERN_C bool mmlog_close(log_handle_t* handle);
+EXTERN_C bool mmlog_stats(log_handle_t* handle, mmlog_stats_t* stats);
+EXTERN_C mmlog_reader_t* mmlog_reader_open(const char* filename);
+EXTERN_C bool mmlog_reader_next(mmlog_reader_t* reader, const void** data, size_t* size);
+EXTERN_C void mmlog_reader_close(mmlog_reader_t* reader);
+EXTERN_C bool mmlog_reader_stats(mmlog_reader_t* reader, mmlog_stats_t* stats);
+EXTERN_C uint32_t mmlog_crc32c(uint32_t crc, const void* data, size_t size);
 EXTERN_C const char* mmlog_strerror(int err);
 EXTERN_C const char* mmlog_strerror_cur(void);
+#endif
 #undef EXTERN_C
@@ -1,6 +1,11 @@
 #pragma once
 
+#include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
 #include <sched.h>
 #include <stdatomic.h>
 #include <stdbool.h>
@@ -11,27 +16,152 @@
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #include <threads.h>
 #include <time.h>
 #include <unistd.h>
 
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define MMLOG_CRC32C_HW __attribute__((target("sse4.2")))
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#define MMLOG_CRC32C_HW __attribute__((target("+crc")))
+#endif
+
 // Constants
 #define LOG_PAGE_SIZE 4096    // Fixed page size
 #define SLEEP_TIME_MAX_MS 10  // Maximum sleep time in milliseconds (4 + 4 + a bit)
-#define MMLOG_VERSION 1       // Current version of the log format
+#define MMLOG_SPIN_COUNT 128  // How many times to poll before going to sleep on a futex
+#define MMLOG_STALL_MS 1000   // How long writers wait on each other before deciding the other side has died
+#define MMLOG_VERSION 8       // Current version of the log format
+#define MMLOG_SKIP_MAGIC 0x4b534d4d   // "MMSK", marks a skip record
+#define MMLOG_FRAME_MAGIC 0x52464d4d  // "MMFR", marks a committed frame
+#define MMLOG_FRAME_ALIGN 8           // Frames (and skips, in framed logs) start on this alignment
+#define MMLOG_PENDING_COMMITS 64      // Commits which can be parked waiting on slower writers
+#define MMLOG_PREFETCH_MAX 8          // Most chunks the prefetch helper will keep mapped ahead of the cursor
+#define MMLOG_POOL_SIZE(chunk_count) (2 * (chunk_count) + MMLOG_PREFETCH_MAX)  // Descriptors preallocated per handle
+#define MMLOG_LOCK_OPEN 0  // Byte of the metadata file which is locked (exclusively) while a handle is being opened
+#define MMLOG_LOCK_LIVE 1  // Byte of the metadata file which every open handle holds a shared lock on
+#define MMLOG_LZ4_MAGIC 0x184d2204         // Starts every LZ4 frame
+#define MMLOG_LZ4_BLOCK_MAX (4u << 20)     // Largest block size an LZ4 frame can declare
+#define MMLOG_LZ4_INDEX_MAGIC 0x184d2a5e   // Skippable frame at the end of a compressed segment, indexing its blocks
+#define MMLOG_SEGMENT_TRAILER 8            // Raw segments end with the offset (into the segment) where their data ends
+#define MMLOG_LZ4_HASH_BITS 14             // Match finder table size
+#define MMLOG_COMPRESS_INTERVAL_MS 100     // How often the compressor looks for sealed segments written elsewhere
+#define MMLOG_STATS_CPUS 64                // Counter slots in the stats page; CPUs beyond this share them
+#define MMLOG_STATS_BUCKETS 32             // Insert latency histogram: bucket i counts [2^i, 2^(i+1)) cycles
+
+// Flags for mmlog_open_ex().  These are fixed by whoever creates the log; everybody else inherits them.  Huge pages are
+// only a hint: the data file has to live somewhere that can back it with them (tmpfs mounted with huge=always or
+// huge=advise), otherwise the mappings quietly fall back to base pages.
+#define MMLOG_FLAG_FRAMED (1u << 0)     // Every record is wrapped in an mmlog_frame_t
+#define MMLOG_FLAG_HUGEPAGES (1u << 1)  // Chunks are multiples of MMLOG_HUGE_PAGE_SIZE and mapped with huge pages
+#define MMLOG_FLAG_MASK (MMLOG_FLAG_FRAMED | MMLOG_FLAG_HUGEPAGES)
+#define MMLOG_HUGE_PAGE_SIZE (2u << 20)  // PMD-sized pages on x86-64 and arm64 (with 4K base pages)
+
+// Durability modes for mmlog_set_durability()
+#define MMLOG_DURABILITY_NONE 0   // Leave it all to the kernel's writeback (the default)
+#define MMLOG_DURABILITY_ASYNC 1  // Start writeback of each chunk as it's retired, without waiting for it
+#define MMLOG_DURABILITY_GROUP 2  // A sync thread batches fdatasync() calls; see mmlog_sync()
+#define MMLOG_SYNC_ALL ((uint64_t)-1)  // mmlog_sync() everything committed so far
+
+// Only defined for _GNU_SOURCE
+#ifndef F_OFD_SETLK
+#define F_OFD_SETLK 37
+#define F_OFD_SETLKW 38
+#endif
+#ifndef FALLOC_FL_PUNCH_HOLE
+#define FALLOC_FL_KEEP_SIZE 0x01
+#define FALLOC_FL_PUNCH_HOLE 0x02
+#endif
+
+// Prefaults pages for writing without touching their contents (Linux 5.14+)
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+#ifndef MADV_HUGEPAGE
+#define MADV_HUGEPAGE 14
+#endif
+
+// Only defined for _GNU_SOURCE
+#ifndef SYNC_FILE_RANGE_WRITE
+#define SYNC_FILE_RANGE_WRITE 2
+#endif
 
 // Alignment macro
 #define ALIGN(x, a) (((x) + (a) - 1) & ~((a) - 1))
 
+// Something to sleep on until a condition might have changed.  Wakers bump the sequence first, and only make the
+// syscall if somebody is actually asleep.
+typedef struct {
+    _Atomic uint32_t seq;       // Futex word
+    _Atomic uint32_t sleepers;  // Number of waiters in FUTEX_WAIT
+} mmlog_waitq_t;
+
+// A commit which is waiting for the writes in front of it to finish.  Ranges starting at 0 are never parked, so a zero
+// start means the slot is free.
+typedef struct {
+    _Atomic uint64_t start;  // Start of the parked range, 0 if free, or LOG_CURSOR_INVALID while claimed
+    _Atomic uint64_t end;    // End of the parked range
+} mmlog_pending_t;
+
+// Rolls the data over into numbered segment files (<filename>.000000, <filename>.000001, ...).  Segment k holds log
+// offsets [k * size, (k + 1) * size), so every process agrees on where the boundaries are; records never straddle them.
+typedef struct {
+    uint64_t size;        // Size of each segment; a multiple of the chunk size, at most UINT32_MAX
+    uint32_t max_age_ms;  // Also roll over once the current segment is this old (0 for no limit)
+    uint32_t retain;      // Keep this many segments, deleting older ones (0 keeps them all)
+} mmlog_segments_t;
+
+// Counters for whichever threads (in whichever processes) ran on one CPU.  Writers bump them with relaxed atomics, so a
+// snapshot is only ever approximately consistent.
+typedef struct {
+    _Alignas(64) _Atomic uint64_t inserts;          // Records inserted
+    _Atomic uint64_t bytes;                         // Payload bytes inserted
+    _Atomic uint64_t head_spins;                    // Checkouts which found the head moving and had to go around again
+    _Atomic uint64_t expand_lock_failures;          // Times the expansion lock was held by somebody else past the spin
+    _Atomic uint64_t ring_full;                     // Rollovers which found every slot still held (ADD_NEW_CHUNK_EWAIT)
+    _Atomic uint64_t pwrite_fallbacks;              // Records spanning too many chunks, written with pwrite()
+    _Atomic uint64_t latency[MMLOG_STATS_BUCKETS];  // mmlog_insert() and mmlog_insertv(), in cycles
+} mmlog_cpu_stats_t;
+
+// Totals over every CPU, from mmlog_stats() or mmlog_reader_stats()
+typedef struct {
+    uint64_t inserts;
+    uint64_t bytes;
+    uint64_t head_spins;
+    uint64_t expand_lock_failures;
+    uint64_t ring_full;
+    uint64_t pwrite_fallbacks;
+    uint64_t latency[MMLOG_STATS_BUCKETS];
+} mmlog_stats_t;
+
 typedef struct {
     uint32_t version;            // Format version number
-    _Atomic bool is_ready;       // Initialization flag (true when fully initialized)
-    _Atomic bool is_locked;      // Lock flag for file extension
+    _Atomic uint32_t is_ready;   // Initialization flag (nonzero when fully initialized); also a futex
+    _Atomic uint32_t is_locked;  // Futex lock for file extension: 0 unlocked, 1 locked, 2 locked with sleepers
     _Atomic bool is_panicked;    // Panic flag (true when log is in an inconsistent state)
-    _Atomic uint64_t file_size;  // Current physical size of the data file
+    _Atomic uint64_t file_size;  // End of the log which is backed by the data file (or the newest segment)
     _Atomic uint64_t cursor;     // Current append position
-    uint32_t page_size;          // Fixed page size value
+    uint32_t page_size;          // Mapping granularity (MMLOG_HUGE_PAGE_SIZE for MMLOG_FLAG_HUGEPAGES logs)
     uint32_t chunk_size;         // Size of chunks (multiple of page_size)
+    uint32_t flags;              // MMLOG_FLAG_*
+    _Atomic uint64_t sequence;   // Next frame sequence number
+    _Alignas(64) _Atomic uint64_t committed;        // Everything below this has been written
+    mmlog_pending_t pending[MMLOG_PENDING_COMMITS];  // Commits waiting for the watermark to reach them
+    _Atomic uint64_t durable;                        // Everything below this has been through fdatasync()
+    mmlog_waitq_t synced;                            // Woken whenever durable moves (or the log panics)
+    mmlog_segments_t segments;                       // Segment policy; size is 0 if the log is a single file
+    _Atomic uint64_t segment;                        // Newest segment which has been created
+    _Atomic uint64_t first_segment;                  // Oldest segment which hasn't been deleted
+    _Atomic int64_t segment_created_ms;              // When the newest segment was created (CLOCK_MONOTONIC)
+    _Atomic uint64_t compress_next;                  // Next sealed segment to compress; whoever bumps it does the work
+    _Atomic uint64_t holes;                          // Entries claimed in the hole list (raw logs only)
+    _Alignas(LOG_PAGE_SIZE) mmlog_cpu_stats_t stats[MMLOG_STATS_CPUS];  // Shared with every process using the log
 } log_metadata_t;
 
 // Chunk tracking (returned at checkout time)
@@ -40,25 +170,139 @@ typedef struct chunk_info_t {
     uint64_t start_offset;       // Start offset in file
     uint64_t size;               // Size of this chunk
     void* mapping;               // Pointer to mapped memory
-    _Atomic uint32_t ref_count;  // Number of active users (atomic)
+    _Atomic uint32_t ref_count;  // Number of active users (atomic), or CHUNK_REF_RETIRED
+    _Atomic uint32_t next_free;  // While on the free list, index + 1 of the next free descriptor (0 at the end)
 } chunk_info_t;
 
+// The ringbuffer holds one reference on whichever chunk is at the head, and drops it when the head moves on.  Once a
+// chunk's refcount reaches zero it can never be revived; the cleaner unmaps it and marks it CHUNK_REF_RETIRED, at which
+// point the descriptor may be recycled by the next chunk installed into that slot.  Descriptors are never freed while
+// the handle is live, which is what allows writers to take references without any lock.
+// All of the descriptors come from a pool allocated up front: each slot starts out with its own retired descriptor, and
+// the rest (for untracked chunks and prefetched spares) sit on a free list, so steady-state inserts never allocate.
 typedef struct {
     _Atomic(chunk_info_t**) buffer;  // Buffer for chunk_info_t (maybe make this configurable?)
     size_t capacity;                 // Capacity of the buffer
-    _Atomic(chunk_info_t**) head;    // Pointer to the current chunk (head is _not_ available)
-    _Atomic(chunk_info_t**) tail;    // Pointer to the next chunk (tail is available)
-    _Atomic bool head_locked;        // Lock for head advancement operations
+    _Atomic uint64_t head;           // Sequence of the current chunk (head is _not_ available); slot is seq % capacity
+    _Atomic uint64_t tail;           // Sequence of the oldest chunk which may not have been cleaned yet
+    mmlog_waitq_t rollover;          // Woken whenever the head moves or a slot is retired
+    chunk_info_t* pool;              // Every descriptor the handle uses, unless the free list runs dry
+    uint32_t pool_size;              // Number of descriptors in the pool
+    _Atomic uint64_t free_list;      // Tag in the high half (against ABA), index + 1 of the first free descriptor in the low
 } chunk_buffer_t;
 
+// Chunks mapped and faulted in ahead of the writers by a helper thread; see mmlog_set_prefetch().  Spares are handed
+// over by exchanging the slot with NULL, so whoever takes one owns it.
+typedef struct {
+    pthread_t thread;                                  // Helper thread, if ahead is nonzero
+    uint32_t fork_generation;                          // The helper only exists in the process which started it
+    uint32_t ahead;                                    // How many chunks past the cursor to keep ready
+    _Atomic bool stop;                                 // Tells the helper to exit
+    _Atomic(chunk_info_t*) spare[MMLOG_PREFETCH_MAX];  // Mapped chunks; slot is chunk index % MMLOG_PREFETCH_MAX
+    uint64_t filled[MMLOG_PREFETCH_MAX];               // Helper-only: start offset of whatever it put in each slot
+    uint64_t last;                                     // Helper-only: chunk index of the cursor as of the last pass
+} mmlog_prefetch_t;
+
+// Group commit: a helper thread which flushes the data file whenever somebody is waiting, and at least every interval
+// while there's anything committed that isn't durable yet.
+typedef struct {
+    pthread_t thread;            // Sync thread, if running
+    uint32_t fork_generation;    // The sync thread only exists in the process which started it
+    uint32_t interval_ms;        // Upper bound on how long a committed record can go unsynced
+    _Atomic bool stop;           // Tells the sync thread to exit
+    _Atomic uint64_t requested;  // Highest position anybody in this process is waiting on
+    mmlog_waitq_t wake;          // Wakes the sync thread early
+} mmlog_syncer_t;
+
+// Compresses sealed segments into LZ4 frames (<filename>.000000.lz4, ...) in the background, then drops the originals
+typedef struct {
+    pthread_t thread;          // Compressor thread, if running
+    uint32_t fork_generation;  // The compressor thread only exists in the process which started it
+    _Atomic bool stop;         // Tells the compressor thread to exit
+    mmlog_waitq_t wake;        // Wakes the compressor thread early
+} mmlog_compressor_t;
+
 // Process-local state
 typedef struct {
-    int metadata_fd;           // File descriptor for metadata
-    int data_fd;               // File descriptor for data
-    log_metadata_t* metadata;  // Pointer to mapped metadata
-    chunk_buffer_t chunks;     // Ringbuffer for current chunks
+    int metadata_fd;                          // File descriptor for metadata
+    int data_fd;                              // File descriptor for data, or -1 for segmented logs
+    char* filename;                           // Name of the data file, or the prefix of the segment files
+    log_metadata_t* metadata;                 // Pointer to mapped metadata
+    chunk_buffer_t chunks;                    // Ringbuffer for current chunks
+    size_t slab_size;                         // If nonzero, threads reserve the log this many bytes at a time
+    tss_t slab_key;                           // Per-thread slab (mmlog_slab_t) for this handle
+    _Atomic(mmlog_prefetch_t*) prefetch;      // Set on the first call to mmlog_set_prefetch(), then never changes
+    _Atomic uint32_t durability;              // MMLOG_DURABILITY_*
+    _Atomic(mmlog_syncer_t*) syncer;          // Set the first time group commit is turned on, then never changes
+    _Atomic(mmlog_compressor_t*) compressor;  // Set the first time compression is turned on, then never changes
+    uint32_t fork_generation;                 // Handles inherited across fork() have no business waiting on chunks
 } log_handle_t;
 
+// Per-thread reservation of the log.  Small inserts are carved out of the slab without touching the shared cursor, and
+// committed one by one like any other record; retiring the slab only has to deal with the part that was never used.
+typedef struct {
+    log_handle_t* handle;      // For retiring the slab when the thread exits
+    uint32_t fork_generation;  // Slabs inherited across fork() belong to the parent
+    uint64_t pos;              // Next free byte
+    uint64_t end;              // End of the slab
+} mmlog_slab_t;
+
+// Skip records pad out the unused tail of a retired slab (or of a segment cut short), so readers can step over it.  The
+// length includes the header; tails too short to hold a header are left as zeros (this can't happen in framed logs).
+typedef struct {
+    uint32_t magic;   // MMLOG_SKIP_MAGIC
+    uint32_t length;  // Total length of the skipped region
+} mmlog_skip_t;
+
+// Raw logs can't tell a skip record from data, so each range they pad is also noted in a list which follows the metadata
+// in its file.  Entries are claimed by bumping the count in the metadata, then written; a blank one is still in flight.
+typedef struct {
+    uint64_t start;  // Log offset of the padding
+    uint64_t end;    // End of the padding, never 0 once written
+} mmlog_hole_t;
+
+// Header for records in framed logs, followed by the payload and zero padding up to MMLOG_FRAME_ALIGN.  The length is
+// written before the payload and the magic is written last, so a record whose magic is still zero was torn (or is still
+// in flight) but can be stepped over all the same.  Skip records share the first two fields.
+typedef struct {
+    _Atomic uint32_t magic;  // MMLOG_FRAME_MAGIC once committed, or MMLOG_SKIP_MAGIC
+    uint32_t length;         // Payload length
+    uint64_t sequence;       // Unique across the log, but only roughly in file order (slabs and racing writers reorder)
+    uint32_t crc;            // CRC32C over the sequence, length and payload
+    uint32_t reserved;       // Zero
+} mmlog_frame_t;
+
+// A record reserved with mmlog_reserve(), to be filled in place and then published with mmlog_commit()
+typedef struct {
+    log_handle_t* handle;
+    chunk_info_t* chunk;  // Keeps the mapping alive until commit
+    uint64_t cursor;      // Start of the record in the log
+    size_t size;          // Payload size
+    void* data;           // Where the payload goes
+} mmlog_reservation_t;
+
+// Follows a log from another handle (or process), seeing only what writers have committed
+typedef struct {
+    int metadata_fd;           // File descriptor for metadata
+    int data_fd;               // File descriptor for the data file, or -1 for segmented logs
+    char* filename;            // Name of the data file, or the prefix of the segment files
+    log_metadata_t* metadata;  // Read-only view of the metadata
+    const char* mapping;       // Read-only view of the data file (or the whole segment being read)
+    uint64_t mapping_size;     // Size of the view, which may run past the end of the file
+    uint64_t base;             // Log offset at the start of the view
+    uint64_t pos;              // Next unread byte
+    uint64_t data_end;         // Where the data in the raw segment being read ends, once it's sealed (0 until then)
+    int lz4_fd;                // The segment being read, if it's compressed, otherwise -1
+    uint64_t* lz4_index;       // File offset of each of its blocks, then of the end mark
+    uint8_t* lz4_block;        // Room for one block as it's stored in the file
+    uint64_t inflated_start;   // The view only holds [inflated_start, inflated_end) of a compressed segment
+    uint64_t inflated_end;
+    uint64_t holes_seen;       // Entries of the hole list before this one have all been picked up (raw logs only)
+    mmlog_hole_t* holes;       // Padding which ends past pos, in log order
+    size_t hole_count;         // Entries in holes
+    size_t hole_capacity;      // Room in holes
+} mmlog_reader_t;
+
 // Range returned from checkout operation
 typedef struct {
     bool is_valid;          // True if this range is valid
@@ -74,6 +318,10 @@ typedef struct {
 // Sentinel value for chunk in intermediate state
 #define CHUNK_PENDING (chunk_info_t*)1
 
+// Sentinel refcounts for a chunk being unmapped by the cleaner, and for one whose descriptor can be reused
+#define CHUNK_REF_CLEANING (UINT32_MAX - 1)
+#define CHUNK_REF_RETIRED UINT32_MAX
+
 // X macro for error codes
 #define ERR_TABLE(X) \
     X(OK, "mmlog success") \
@@ -94,24 +342,72 @@ typedef struct {
     X(FILES_OPEN_VERSION, "[files_open] incompatible metadata version") \
     X(FILES_OPEN_OR_CREATE_EINVAL, "[files_open_or_create] invalid arguments") \
     X(FILES_OPEN_OR_CREATE_SNPRINTF, "[files_open_or_create] failed to intern string") \
+    X(FILES_OPEN_OR_CREATE_OPEN, "[files_open_or_create] metadata open() failed") \
+    X(FILES_OPEN_OR_CREATE_LOCK, "[files_open_or_create] failed to lock metadata") \
+    X(FILES_RECOVER_FSTAT, "[files_recover] data fstat() failed") \
+    X(DATA_FD_GET_OPEN, "[data_fd_get] failed to open segment file") \
     X(MMLOG_OPEN_EINVAL, "[mmlog_open] invalid arguments") \
     X(MMLOG_OPEN_ENOMEM, "[mmlog_open] out of memory") \
     X(MMLOG_OPEN_OR_CREATE_EINVAL, "[mmlog_open_or_create] invalid arguments") \
-    X(FILE_EXPAND_INNER_PANICKED, "[file_expand_inner] log is in a panic state") \
-    X(FILE_EXPAND_INNER_GROW, "[file_expand_inner] ftruncate() failed") \
-    X(FILE_EXPAND_INNER_LOCKED, "[file_expand_inner] failed to acquire lock") \
+    X(DATA_FILE_EXPAND_PANICKED, "[data_file_expand] log is in a panic state") \
+    X(DATA_FILE_EXPAND_GROW, "[data_file_expand] fallocate() or ftruncate() failed") \
+    X(DATA_FILE_EXPAND_LOCKED, "[data_file_expand] failed to acquire lock") \
     X(MMLOG_CHECKOUT_EINVAL, "[mmlog_checkout] invalid arguments") \
+    X(MMLOG_CHECKOUT_STALE_LOCK, "[mmlog_checkout] expansion lock held by a dead process; log is now in a panic state") \
+    X(COMMIT_RANGE_STALLED, "[commit_range] writers ahead never committed; log is now in a panic state") \
     X(CLEAN_CHUNKS_EINVAL, "[clean_chunks] invalid arguments") \
     X(CREATE_CHUNK_AT_CURSOR_ENOMEM, "[create_chunk_at_cursor] out of memory") \
     X(CREATE_CHUNK_AT_CURSOR_MMAP, "[create_chunk_at_cursor] mmap() failed") \
     X(ADD_NEW_CHUNK_EINVALID, "[add_new_chunk] invalid arguments") \
     X(ADD_NEW_CHUNK_EWAIT, "[add_new_chunk] ringbuffer is full") \
     X(MMLOG_RB_CHECKOUT_EINVAL, "[mmlog_rb_checkout] invalid arguments") \
-    X(MMLOG_RB_CHECKOUT_NOLOCK, "[mmlog_rb_checkout] failed to acquire head lock") \
     X(WRITE_TO_CHUNK_ECHUNK, "[write_to_chunk] failed to checkout chunk") \
+    X(MMLOG_SET_SLAB_SIZE_EINVAL, "[mmlog_set_slab_size] invalid arguments") \
+    X(MMLOG_SET_SLAB_SIZE_TSS, "[mmlog_set_slab_size] tss_create() failed") \
+    X(SLAB_CHECKOUT_ENOMEM, "[slab_checkout] out of memory") \
+    X(MMLOG_SET_PREFETCH_EINVAL, "[mmlog_set_prefetch] invalid arguments") \
+    X(MMLOG_SET_PREFETCH_ENOMEM, "[mmlog_set_prefetch] out of memory") \
+    X(MMLOG_SET_PREFETCH_THREAD, "[mmlog_set_prefetch] pthread_create() failed") \
+    X(MMLOG_SET_DURABILITY_EINVAL, "[mmlog_set_durability] invalid arguments") \
+    X(MMLOG_SET_DURABILITY_ENOMEM, "[mmlog_set_durability] out of memory") \
+    X(MMLOG_SET_DURABILITY_THREAD, "[mmlog_set_durability] pthread_create() failed") \
+    X(MMLOG_SYNC_EINVAL, "[mmlog_sync] invalid arguments, or the range hasn't been committed") \
+    X(MMLOG_SYNC_FDATASYNC, "[mmlog_sync] fdatasync() failed") \
+    X(MMLOG_SYNC_PANICKED, "[mmlog_sync] log is in a panic state") \
+    X(MMLOG_SET_COMPRESSION_EINVAL, "[mmlog_set_compression] invalid arguments, or the log isn't segmented") \
+    X(MMLOG_SET_COMPRESSION_ENOMEM, "[mmlog_set_compression] out of memory") \
+    X(MMLOG_SET_COMPRESSION_THREAD, "[mmlog_set_compression] pthread_create() failed") \
+    X(WRITE_RANGE_PWRITE, "[write_range] pwrite() failed") \
+    X(PUBLISH_FRAME_ECHUNK, "[publish_frame] failed to checkout chunk") \
+    X(WRITE_FRAME_ECHUNK, "[write_frame] failed to checkout chunk") \
+    X(WRITE_IOV_ECHUNK, "[write_iov] failed to checkout chunk") \
+    X(WRITE_BATCH_ECHUNK, "[write_batch] failed to checkout chunk") \
     X(MMLOG_INSERT_EINVAL, "[mmlog_insert] invalid arguments") \
-    X(MMLOG_INSERT_PWRITE, "[mmlog_insert] pwrite() failed") \
+    X(MMLOG_INSERTV_EINVAL, "[mmlog_insertv] invalid arguments") \
+    X(MMLOG_INSERT_BATCH_EINVAL, "[mmlog_insert_batch] invalid arguments") \
+    X(MMLOG_RESERVE_EINVAL, "[mmlog_reserve] invalid arguments") \
+    X(MMLOG_RESERVE_ECHUNK, "[mmlog_reserve] failed to checkout chunk") \
+    X(MMLOG_COMMIT_EINVAL, "[mmlog_commit] invalid arguments") \
+    X(MMLOG_ABANDON_EINVAL, "[mmlog_abandon] invalid arguments") \
+    X(MMLOG_READER_OPEN_EINVAL, "[mmlog_reader_open] invalid arguments") \
+    X(MMLOG_READER_OPEN_ENOMEM, "[mmlog_reader_open] out of memory") \
+    X(MMLOG_READER_OPEN_MDATA, "[mmlog_reader_open] failed to open metadata") \
+    X(MMLOG_READER_OPEN_VERSION, "[mmlog_reader_open] metadata not ready or incompatible") \
+    X(MMLOG_READER_OPEN_DATA, "[mmlog_reader_open] failed to open data file") \
+    X(READER_MAP_MMAP, "[reader_map] mmap() failed") \
+    X(READER_MAP_SEGMENT_OPEN, "[reader_map_segment] failed to open segment file") \
+    X(READER_MAP_SEGMENT_INFLATE, "[reader_map_segment] failed to open compressed segment file") \
+    X(READER_INFLATE_BLOCK, "[reader_inflate] failed to read or decompress a block") \
+    X(READER_LOAD_HOLES_READ, "[reader_load_holes] failed to read the hole list") \
+    X(READER_LOAD_HOLES_ENOMEM, "[reader_load_holes] out of memory") \
+    X(MMLOG_READER_NEXT_EINVAL, "[mmlog_reader_next] invalid arguments") \
+    X(MMLOG_READER_NEXT_CORRUPT, "[mmlog_reader_next] unreadable frame below the committed watermark") \
+    X(MMLOG_READER_NEXT_CRC, "[mmlog_reader_next] frame failed its CRC check") \
     X(MMLOG_TRIM_EINVAL, "[mmlog_trim] invalid arguments") \
+    X(MMLOG_CLOSE_EINVAL, "[mmlog_close] invalid arguments") \
+    X(MMLOG_STATS_EINVAL, "[mmlog_stats] invalid arguments") \
+    X(MMLOG_READER_STATS_EINVAL, "[mmlog_reader_stats] invalid arguments") \
+    X(MMLOG_CLOSE_SYNC, "[mmlog_close] final sync failed") \
     X(MMLOG_TRIM_FTRUNCATE, "[mmlog_trim] ftruncate() failed") \
     X(_LENGTH, "UNKNOWN ERROR")
 
@@ -154,612 +450,1957 @@ static inline bool hot_wait_for_cond(bool (*fun)(void*), void* arg, int64_t time
 {
     int64_t start_time = ms_since_epoch_monotonic();
     int64_t cur_time = start_time;
-    while (cur_time - start_time < timeout_ms) {
+    do {
         if (fun(arg)) {
             return true;
         }
         sched_yield();
         cur_time = ms_since_epoch_monotonic();
-    }
+    } while (cur_time - start_time < timeout_ms);
     return false;
 }
 
-static inline bool files_create(int fd_meta, const char* filename, uint32_t chunk_size, log_handle_t* handle)
+static inline void mmlog_cpu_relax(void)
 {
-    log_metadata_t* metadata = NULL;
-    int fd_data = -1;
-    mmlog_errno = MMLOG_ERR_OK;
-    if (-1 == ftruncate(fd_meta, sizeof(log_metadata_t))) {
-        mmlog_errno = MMLOG_ERR_FILES_CREATE_FTRUNCATE_MDATA;
-        goto files_create_cleanup;
-    }
-
-    metadata = (log_metadata_t*)mmap(NULL, sizeof(log_metadata_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd_meta, 0);
-    if (MAP_FAILED == metadata) {
-        mmlog_errno = MMLOG_ERR_FILES_CREATE_MMAP_MDATA;
-        goto files_create_cleanup;
-    }
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ volatile("yield");
+#endif
+}
 
-    metadata->version = MMLOG_VERSION;
-    metadata->page_size = LOG_PAGE_SIZE;
-    metadata->chunk_size = chunk_size;
+// Only declared for _GNU_SOURCE; glibc answers it from the rseq area (or the vDSO) without a syscall
+int sched_getcpu(void);
 
-    // We're going to try and open the data file, but it's a bit tricky.
-    // 1. if it doesn't exist--great!
-    // 2. if it does exist, it's hard to figure out where to put the cursor, and we don't want to corrupt incoming
-    // binary data. For this implementation, just clobber the file!
-    fd_data = open(filename, O_RDWR | O_CREAT, 0644);
-    if (-1 == fd_data) {
-        mmlog_errno = MMLOG_ERR_FILES_CREATE_OPEN_DATA;
-        goto files_create_cleanup;
-    }
+// Raw cycle counter for timing inserts, the same one tsc_time's CycleCounter reads.  Converting it to time takes a
+// calibration, which is left to whoever reads the stats.
+static inline uint64_t mmlog_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    uint64_t cycles;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(cycles));
+    return cycles;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
 
-    // Zero + init the data file and init the metadata file
-    if (-1 == ftruncate(fd_data, 0) || -1 == ftruncate(fd_data, chunk_size)) {
-        mmlog_errno = MMLOG_ERR_FILES_CREATE_FTRUNCATE_DATA;
-        goto files_create_cleanup;
-    }
+static inline mmlog_cpu_stats_t* stats_cpu(log_metadata_t* metadata)
+{
+    int cpu = sched_getcpu();
+    return &metadata->stats[(cpu < 0 ? 0 : (uint32_t)cpu) % MMLOG_STATS_CPUS];
+}
 
-    handle->metadata = metadata;
-    handle->data_fd = fd_data;
-    handle->metadata_fd = fd_meta;
-    atomic_store(&metadata->file_size, chunk_size);
-    atomic_store(&metadata->is_ready, true);
-    return true;
+#define MMLOG_STAT_ADD(metadata, field, n) \
+    atomic_fetch_add_explicit(&stats_cpu(metadata)->field, (n), memory_order_relaxed)
 
-files_create_cleanup:
-    if (metadata && metadata != MAP_FAILED) {
-        if (-1 == munmap(metadata, sizeof(log_metadata_t))) {
-            // Nothing to do here
-        }
-    }
-    if (-1 != fd_data) {
-        close(fd_data);
+// Counts inserted records, and if `cycles` is nonzero, how long the insert took
+static inline void stats_insert(log_metadata_t* metadata, uint64_t records, uint64_t bytes, uint64_t cycles)
+{
+    mmlog_cpu_stats_t* stats = stats_cpu(metadata);
+    atomic_fetch_add_explicit(&stats->inserts, records, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->bytes, bytes, memory_order_relaxed);
+    if (cycles) {
+        uint32_t bucket = 63 - __builtin_clzll(cycles);
+        bucket = bucket < MMLOG_STATS_BUCKETS ? bucket : MMLOG_STATS_BUCKETS - 1;
+        atomic_fetch_add_explicit(&stats->latency[bucket], 1, memory_order_relaxed);
     }
-    return false;
 }
 
-typedef struct {
-    int* fd;
-    const char* filename;
-    size_t size;
-} try_check_file_ready_args_t;
-
-static inline bool try_check_file_ready(void* args)
+static inline void stats_sum(log_metadata_t* metadata, mmlog_stats_t* out)
 {
-    try_check_file_ready_args_t* m = (try_check_file_ready_args_t*)args;
-    int* fd = m->fd;
-    size_t size = m->size;
-    const char* filename = m->filename;
-    if (-1 == *fd) {
-        *fd = open(filename, O_RDWR);
-        if (-1 == *fd) {
-            mmlog_errno = MMLOG_ERR_TRY_CHECK_FILE_READY_OPEN;
-            return false;
+    memset(out, 0, sizeof(*out));
+    for (uint32_t i = 0; i < MMLOG_STATS_CPUS; i++) {
+        mmlog_cpu_stats_t* stats = &metadata->stats[i];
+        out->inserts += atomic_load_explicit(&stats->inserts, memory_order_relaxed);
+        out->bytes += atomic_load_explicit(&stats->bytes, memory_order_relaxed);
+        out->head_spins += atomic_load_explicit(&stats->head_spins, memory_order_relaxed);
+        out->expand_lock_failures += atomic_load_explicit(&stats->expand_lock_failures, memory_order_relaxed);
+        out->ring_full += atomic_load_explicit(&stats->ring_full, memory_order_relaxed);
+        out->pwrite_fallbacks += atomic_load_explicit(&stats->pwrite_fallbacks, memory_order_relaxed);
+        for (uint32_t j = 0; j < MMLOG_STATS_BUCKETS; j++) {
+            out->latency[j] += atomic_load_explicit(&stats->latency[j], memory_order_relaxed);
         }
     }
-    struct stat st;
-    if (0 != fstat(*fd, &st) || (size_t)st.st_size < size) {
-        mmlog_errno = MMLOG_ERR_TRY_CHECK_FILE_READY_FSTAT;
-        return false;
-    }
-    return true;
 }
 
-static inline bool try_check_metadata_ready(void* args)
+// Sleeps until *word is no longer `expected`, somebody wakes us, or the timeout expires.  Shared futexes work across
+// processes, as long as the word is in a MAP_SHARED mapping.
+static inline void mmlog_futex_wait(_Atomic uint32_t* word, uint32_t expected, int64_t timeout_ms, bool shared)
 {
-    log_metadata_t* metadata = (log_metadata_t*)args;
-    return atomic_load(&metadata->is_ready);
+    struct timespec ts = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000};
+    syscall(SYS_futex, word, shared ? FUTEX_WAIT : FUTEX_WAIT_PRIVATE, expected, &ts, NULL, 0);
 }
 
-static inline bool files_open(const char* filename, const char* meta_filename, log_handle_t* handle)
+static inline void mmlog_futex_wake(_Atomic uint32_t* word, bool shared)
 {
-    mmlog_errno = MMLOG_ERR_OK;
-    int fd_meta = -1;
-    int fd_data = -1;
-    log_metadata_t* metadata = handle->metadata;
-
-    // Before we mmap the metadata, check the file size.  If it's nonzero, but less than the size of the metadata, it's
-    // probable that we have an incompatible metadata version--so bail out
-    try_check_file_ready_args_t fd_meta_args = {&fd_meta, meta_filename, sizeof(log_metadata_t)};
-    try_check_file_ready_args_t fd_data_args = {&fd_data, filename, 0};
-    if (!hot_wait_for_cond(try_check_file_ready, &fd_meta_args, SLEEP_TIME_MAX_MS)) {
-        if (mmlog_errno == MMLOG_ERR_TRY_CHECK_FILE_READY_OPEN) {
-            mmlog_errno = MMLOG_ERR_FILES_OPEN_MDATA_READY_OPEN;
-        } else if (mmlog_errno == MMLOG_ERR_TRY_CHECK_FILE_READY_FSTAT) {
-            mmlog_errno = MMLOG_ERR_FILES_OPEN_MDATA_READY_FSTAT;
-        }
-        goto files_open_cleanup;
-    }
-
-    // Nothing is valid until we've mapped the metadata (above check ensures the metadata file is at least as big as we
-    // need)
-    metadata = (log_metadata_t*)mmap(NULL, sizeof(log_metadata_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd_meta, 0);
-    fd_data_args.size = metadata->chunk_size;  // Set the size for the data file check
-    if (MAP_FAILED == metadata) {
-        mmlog_errno = MMLOG_ERR_FILES_OPEN_MDATA_MMAP;
-        goto files_open_cleanup;
-    }
+    syscall(SYS_futex, word, shared ? FUTEX_WAKE : FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
 
-    // Sit in a try-sleep loop for checking readiness
-    if (!hot_wait_for_cond(try_check_metadata_ready, metadata, SLEEP_TIME_MAX_MS)) {
-        mmlog_errno = MMLOG_ERR_FILES_OPEN_MDATA_READY;
-        goto files_open_cleanup;
+static inline void waitq_wake(mmlog_waitq_t* waitq, bool shared)
+{
+    atomic_fetch_add(&waitq->seq, 1);
+    if (atomic_load(&waitq->sleepers)) {
+        mmlog_futex_wake(&waitq->seq, shared);
     }
+}
 
-    // If the version is not compatible, we can't use this log
-    if (metadata->version != MMLOG_VERSION) {
-        mmlog_errno = MMLOG_ERR_FILES_OPEN_VERSION;
-        goto files_open_cleanup;
+// Like hot_wait_for_cond(), but after a short spin it sleeps until the condition might have changed
+static inline bool waitq_wait_for_cond(bool (*fun)(void*), void* arg, mmlog_waitq_t* waitq, bool shared,
+                                       int64_t timeout_ms)
+{
+    for (int i = 0; i < MMLOG_SPIN_COUNT; i++) {
+        if (fun(arg)) {
+            return true;
+        }
+        mmlog_cpu_relax();
     }
 
-    // Finally, we have to open the data file
-    if (!hot_wait_for_cond(try_check_file_ready, &fd_data_args, SLEEP_TIME_MAX_MS)) {
-        if (mmlog_errno == MMLOG_ERR_TRY_CHECK_FILE_READY_OPEN) {
-            mmlog_errno = MMLOG_ERR_FILES_OPEN_DATA_READY_OPEN;
-        } else if (mmlog_errno == MMLOG_ERR_TRY_CHECK_FILE_READY_FSTAT) {
-            mmlog_errno = MMLOG_ERR_FILES_OPEN_DATA_READY_FSTAT;
+    int64_t start_time = ms_since_epoch_monotonic();
+    while (true) {
+        // Read the sequence before checking, so that a wake in between makes the futex return straight away
+        uint32_t seq = atomic_load(&waitq->seq);
+        if (fun(arg)) {
+            return true;
         }
-        goto files_open_cleanup;
+        int64_t remaining = timeout_ms - (ms_since_epoch_monotonic() - start_time);
+        if (remaining <= 0) {
+            return false;
+        }
+        atomic_fetch_add(&waitq->sleepers, 1);
+        mmlog_futex_wait(&waitq->seq, seq, remaining, shared);
+        atomic_fetch_sub(&waitq->sleepers, 1);
     }
+}
 
-    handle->metadata_fd = fd_meta;
-    handle->data_fd = fd_data;
-    handle->metadata = metadata;
-
-    return true;
+// CRC32C (Castagnoli), using the CPU's CRC instructions when it has them
+static uint32_t mmlog_crc32c_table[256];
+static uint32_t (*mmlog_crc32c_impl)(uint32_t, const unsigned char*, size_t) = NULL;
+static once_flag mmlog_crc32c_once = ONCE_FLAG_INIT;
 
-files_open_cleanup:
-    if (metadata && MAP_FAILED != metadata) {
-        munmap(metadata, sizeof(log_metadata_t));
+static inline uint32_t mmlog_crc32c_sw(uint32_t crc, const unsigned char* data, size_t size)
+{
+    while (size--) {
+        crc = mmlog_crc32c_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
     }
-    if (-1 != fd_data) {
-        close(fd_data);
+    return crc;
+}
+
+#if defined(__x86_64__)
+MMLOG_CRC32C_HW static uint32_t mmlog_crc32c_hw(uint32_t crc, const unsigned char* data, size_t size)
+{
+    uint64_t crc64 = crc;
+    for (; size >= 8; data += 8, size -= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
     }
-    if (-1 != fd_meta) {
-        close(fd_meta);
+    crc = (uint32_t)crc64;
+    while (size--) {
+        crc = _mm_crc32_u8(crc, *data++);
     }
-    return false;
+    return crc;
 }
 
-static inline bool files_open_or_create(const char* filename, uint32_t chunk_size, log_handle_t* handle)
+static inline bool mmlog_crc32c_hw_supported(void)
 {
-    mmlog_errno = MMLOG_ERR_OK;
-    if (!filename || !*filename || chunk_size == 0 || chunk_size % LOG_PAGE_SIZE != 0 || !handle) {
-        mmlog_errno = MMLOG_ERR_FILES_OPEN_OR_CREATE_EINVAL;
-        return false;
+    return __builtin_cpu_supports("sse4.2");
+}
+#elif defined(__aarch64__)
+MMLOG_CRC32C_HW static uint32_t mmlog_crc32c_hw(uint32_t crc, const unsigned char* data, size_t size)
+{
+    for (; size >= 8; data += 8, size -= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc = __crc32cd(crc, word);
     }
-
-    static const char* suffix = ".mmlog";
-    size_t meta_filename_len = strlen(filename) + strlen(suffix) + 1;
-    char* meta_filename = (char*)malloc(meta_filename_len);
-    int fd_meta = -1;
-    if (!meta_filename) {
-        mmlog_errno = MMLOG_ERR_FILES_OPEN_OR_CREATE_EINVAL;
-        goto files_open_or_create_cleanup;
+    while (size--) {
+        crc = __crc32cb(crc, *data++);
     }
+    return crc;
+}
 
-    if (snprintf(meta_filename, meta_filename_len, "%s%s", filename, suffix) < 0) {
-        mmlog_errno = MMLOG_ERR_FILES_OPEN_OR_CREATE_SNPRINTF;
-        goto files_open_or_create_cleanup;
-    }
+static inline bool mmlog_crc32c_hw_supported(void)
+{
+    return getauxval(AT_HWCAP) & (1 << 7);  // HWCAP_CRC32
+}
+#endif
 
-    // Try to create metadata file (exclusive create)
-    // NOTE: we never `unlink()` this file, so some error conditions can cause an orphaned metadata file.
-    //       TODO: can we do better?  Difficult if ftruncate fails
-    fd_meta = open(meta_filename, O_RDWR | O_CREAT | O_EXCL, 0644);
-    if (-1 == fd_meta) {
-        if (!files_open(filename, meta_filename, handle)) {
-            // callee sets errno
-            goto files_open_or_create_cleanup;
-        }
-    } else {
-        if (!files_create(fd_meta, filename, chunk_size, handle)) {
-            // callee sets errno
-            goto files_open_or_create_cleanup;
+static void mmlog_crc32c_init(void)
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0x82f63b78 & (0 - (crc & 1)));
         }
+        mmlog_crc32c_table[i] = crc;
     }
 
-    return true;
-
-files_open_or_create_cleanup:
-    free(meta_filename);
-    if (-1 != fd_meta) {
-        close(fd_meta);
+    mmlog_crc32c_impl = mmlog_crc32c_sw;
+#if defined(MMLOG_CRC32C_HW)
+    if (mmlog_crc32c_hw_supported()) {
+        mmlog_crc32c_impl = mmlog_crc32c_hw;
     }
-    return false;
+#endif
 }
 
-log_handle_t* mmlog_open(const char* filename, size_t chunk_size, uint32_t chunk_count)
+uint32_t mmlog_crc32c(uint32_t crc, const void* data, size_t size)
 {
-    mmlog_errno = MMLOG_ERR_OK;
-    // chunks are page multiples, and we need at least 2 chunks
-    if (chunk_size % LOG_PAGE_SIZE != 0 || chunk_size == 0 || chunk_count < 2) {
-        mmlog_errno = MMLOG_ERR_MMLOG_OPEN_EINVAL;
-        return NULL;
-    }
+    // Pass 0 to start a new checksum, or a previous result to extend it
+    call_once(&mmlog_crc32c_once, mmlog_crc32c_init);
+    return ~mmlog_crc32c_impl(~crc, (const unsigned char*)data, size);
+}
 
-    // Allocate handle
-    log_handle_t* handle = (log_handle_t*)calloc(1, sizeof(log_handle_t));
-    if (!handle) {
-        mmlog_errno = MMLOG_ERR_MMLOG_OPEN_ENOMEM;
-        return NULL;
-    }
+static inline uint32_t mmlog_frame_crc(uint64_t sequence, uint32_t length, const void* payload)
+{
+    uint32_t crc = mmlog_crc32c(0, &sequence, sizeof(sequence));
+    crc = mmlog_crc32c(crc, &length, sizeof(length));
+    return mmlog_crc32c(crc, payload, length);
+}
 
-    // Allocate chunk buffer
-    handle->chunks.capacity = chunk_count;
-    handle->chunks.buffer = (_Atomic(chunk_info_t**))(chunk_info_t**)calloc(chunk_count, sizeof(chunk_info_t*));
-    if (!handle->chunks.buffer) {
-        mmlog_errno = MMLOG_ERR_MMLOG_OPEN_ENOMEM;
-        free(handle);
-        return NULL;
-    }
+// Total size of a framed record with the given payload
+static inline uint64_t mmlog_frame_size(size_t size)
+{
+    return ALIGN(sizeof(mmlog_frame_t) + (uint64_t)size, MMLOG_FRAME_ALIGN);
+}
 
-    for (uint32_t i = 0; i < chunk_count; i++) {
-        handle->chunks.buffer[i] = NULL;
+// Distance from the start of a frame (or skip record) to the next one.  Returns 0 when the header hasn't been written
+// at all, in which case a reader has to wait, or scan ahead for the next valid frame.
+static inline uint64_t mmlog_frame_span(const mmlog_frame_t* frame)
+{
+    uint32_t magic = atomic_load_explicit(&frame->magic, memory_order_acquire);
+    if (MMLOG_SKIP_MAGIC == magic) {
+        return frame->length;
     }
+    return frame->length ? mmlog_frame_size(frame->length) : 0;
+}
 
-    if (!files_open_or_create(filename, chunk_size, handle)) {
-        // callee sets errno
-        free(handle->chunks.buffer);
-        free(handle);
-        return NULL;
-    }
+// True if the frame was committed and is intact
+static inline bool mmlog_frame_is_valid(const mmlog_frame_t* frame)
+{
+    return MMLOG_FRAME_MAGIC == atomic_load_explicit(&frame->magic, memory_order_acquire) &&
+           frame->crc == mmlog_frame_crc(frame->sequence, frame->length, frame + 1);
+}
 
-    // Set the head (leave the tail NULL)
-    atomic_store(&handle->chunks.head, handle->chunks.buffer);
+// Just enough of LZ4 (https://github.com/lz4/lz4/blob/dev/doc) to compress sealed segments into standard frames of
+// independent blocks, and to read the blocks back one at a time.  The compressor is the plain greedy single-probe one; it's meant to keep
+// up with the disk, not to win on ratio.
+static inline uint32_t lz4_read32(const uint8_t* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
 
-    return handle;
+static inline void lz4_write32(uint8_t* p, uint32_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
 }
 
-typedef struct {
-    log_handle_t* handle;
-    uint64_t end;
-} file_expand_args_t;
+static inline uint8_t* lz4_write_length(uint8_t* op, size_t length)
+{
+    for (; length >= 255; length -= 255) {
+        *op++ = 255;
+    }
+    *op++ = (uint8_t)length;
+    return op;
+}
 
-static inline bool file_expand_inner(void* arg)
+// Compresses `src` into a single block.  Returns the compressed size, or 0 if it doesn't fit in `capacity` (in which
+// case the block should be stored as-is).
+static inline size_t lz4_compress_block(const uint8_t* src, size_t size, uint8_t* dst, size_t capacity)
 {
-    mmlog_errno = MMLOG_ERR_OK;
+    uint32_t table[1 << MMLOG_LZ4_HASH_BITS] = {0};
+    const uint8_t* ip = src;
+    const uint8_t* anchor = src;
+    const uint8_t* end = src + size;
+    uint8_t* op = dst;
+    uint8_t* oend = dst + capacity;
 
-    file_expand_args_t* args = (file_expand_args_t*)arg;
-    log_handle_t* handle = args->handle;
-    uint64_t end = args->end;
-    log_metadata_t* metadata = handle->metadata;
+    // Matches can't start in the last 12 bytes, and the last 5 are always literals
+    while (size > 12 && ip < end - 12) {
+        uint32_t sequence = lz4_read32(ip);
+        uint32_t* slot = &table[(sequence * 2654435761u) >> (32 - MMLOG_LZ4_HASH_BITS)];
+        const uint8_t* ref = src + *slot;
+        *slot = (uint32_t)(ip - src);
+        if (ref >= ip || ip - ref > 65535 || lz4_read32(ref) != sequence) {
+            ip += 1 + ((ip - anchor) >> 6);  // Skip ahead faster through data which isn't compressing
+            continue;
+        }
 
-    bool expected = false;
-    if (atomic_compare_exchange_strong(&metadata->is_locked, &expected, true)) {
-        if (atomic_load(&metadata->is_panicked)) {
-            // Unfortunate, but we'll probably end up retrying in this condition
-            // TODO fence this properly or create an early escape enum or something
-            mmlog_errno = MMLOG_ERR_FILE_EXPAND_INNER_PANICKED;
-            return false;
-        }
-
-        uint64_t file_size = atomic_load(&metadata->file_size);
-        if (file_size < end) {
-            // Need to expand
-            uint64_t new_size = ALIGN(end, metadata->chunk_size);
-            if (-1 == ftruncate(handle->data_fd, new_size)) {
-                // Whoa, we can't ftruncate!  Everything sucks!
-                atomic_store(&metadata->is_panicked, true);
-                atomic_store(&metadata->is_locked, false);
-                mmlog_errno = MMLOG_ERR_FILE_EXPAND_INNER_GROW;
-                return true;  // Bails out, but we we need to check in the caller
-            }
-
-            // Expanded, update metadata
-            atomic_store(&metadata->file_size, new_size);
-            atomic_store(&metadata->is_locked, false);
-            file_size = new_size;
-            return true;
+        const uint8_t* match_end = ip + 4;
+        while (match_end < end - 5 && *match_end == ref[match_end - ip]) {
+            match_end++;
+        }
+        size_t literals = ip - anchor;
+        size_t match = match_end - ip - 4;
+        if ((size_t)(oend - op) < 1 + literals / 255 + 1 + literals + 2 + match / 255 + 1) {
+            return 0;
         }
 
-        // release the lock--filesize is fine
-        atomic_store(&metadata->is_locked, false);
-        return true;
+        uint8_t* token = op++;
+        *token = (uint8_t)((literals < 15 ? literals : 15) << 4 | (match < 15 ? match : 15));
+        if (literals >= 15) {
+            op = lz4_write_length(op, literals - 15);
+        }
+        memcpy(op, anchor, literals);
+        op += literals;
+        *op++ = (uint8_t)(ip - ref);
+        *op++ = (uint8_t)((ip - ref) >> 8);
+        if (match >= 15) {
+            op = lz4_write_length(op, match - 15);
+        }
+        ip = anchor = match_end;
     }
 
-    // Couldn't take the lock, so retry
-    mmlog_errno = MMLOG_ERR_FILE_EXPAND_INNER_LOCKED;
-    return false;
-}
-
-static inline bool data_file_expand(log_handle_t* handle, uint64_t end)
-{
-    mmlog_errno = MMLOG_ERR_OK;
-    file_expand_args_t args = {handle, end};
-    if (hot_wait_for_cond(file_expand_inner, &args, SLEEP_TIME_MAX_MS)) {
-        // callee sets errno
-        return !atomic_load(&handle->metadata->is_panicked);
+    size_t literals = end - anchor;
+    if ((size_t)(oend - op) < 1 + literals / 255 + 1 + literals) {
+        return 0;
     }
-    return false;
+    *op++ = (uint8_t)((literals < 15 ? literals : 15) << 4);
+    if (literals >= 15) {
+        op = lz4_write_length(op, literals - 15);
+    }
+    memcpy(op, anchor, literals);
+    op += literals;
+    return op - dst;
 }
 
-uint64_t mmlog_checkout(log_handle_t* handle, size_t size)
+static inline bool lz4_read_length(const uint8_t** ip, const uint8_t* iend, size_t* length)
 {
-    // Gets the start position for the requested write operation
-    // Will increase the capacity of the file if needed, but does not map the new pages
-    mmlog_errno = MMLOG_ERR_OK;
-    if (!handle || !handle->metadata) {
-        mmlog_errno = MMLOG_ERR_MMLOG_CHECKOUT_EINVAL;
-        return LOG_CURSOR_INVALID;
-    }
-
-    log_metadata_t* metadata = handle->metadata;
-    uint64_t start = atomic_fetch_add(&metadata->cursor, size);
-    uint64_t end = start + size;
-    uint64_t file_size = atomic_load(&metadata->file_size);
-
-    if (end > file_size) {
-        if (!data_file_expand(handle, end)) {
-            // callee sets errno
-            return LOG_CURSOR_INVALID;
+    uint8_t b;
+    do {
+        if (*ip >= iend) {
+            return false;
         }
-    }
-    return start;
+        b = *(*ip)++;
+        *length += b;
+    } while (255 == b);
+    return true;
 }
 
-static inline bool clean_chunks(chunk_buffer_t* chunks)
+// Decompresses a single block into `dst`, returning the decompressed size in `*size`.  False if the block is malformed
+// or doesn't fit.
+static inline bool lz4_decompress_block(const uint8_t* src, size_t src_size, uint8_t* dst, size_t capacity,
+                                        size_t* size)
 {
-    // Attempts to clean up any unused chunks in the ring buffer, starting from the tail
-    // Chunks are unusued if they are not the head and their refcount is 0
-    // This type of property checking is done in a few steps
-    // 1. Atomic acquisition of the current tail
-    // 2. Verification that this snapshot has certain properties
-    // 3. "Take" the tail atomically via a CAS type operation
-    // 4. If successful, clean it up and repeat.
-    // 5. If not, then repeat anyway
-    // 6. Stop if the current tail cannot be cleaned (e.g., it is the head or it has a nonzero refcount)
-    mmlog_errno = MMLOG_ERR_OK;
-    if (!chunks || !chunks->buffer) {
-        mmlog_errno = MMLOG_ERR_CLEAN_CHUNKS_EINVAL;
-        return false;  // Invalid chunk buffer
-    }
-
-    while (true) {
-        // Get the current tail and head pointers atomically
-        chunk_info_t** tail_ptr = atomic_load(&chunks->tail);
-        chunk_info_t** head_ptr = atomic_load(&chunks->head);
-
-        // If there's no tail, we're done here
-        if (!tail_ptr) {
-            break;  // No tail to clean
+    const uint8_t* ip = src;
+    const uint8_t* iend = src + src_size;
+    uint8_t* op = dst;
+    uint8_t* oend = dst + capacity;
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        size_t literals = token >> 4;
+        if ((15 == literals && !lz4_read_length(&ip, iend, &literals)) || literals > (size_t)(iend - ip) ||
+            literals > (size_t)(oend - op)) {
+            return false;
         }
-        chunk_info_t* tail_chunk = *tail_ptr;
-
-        // No matter what, if head==tail we don't have to clean anything up
-        if (tail_ptr == head_ptr) {
-            // No chunks to clean
-            return true;
+        memcpy(op, ip, literals);
+        op += literals;
+        ip += literals;
+        if (ip == iend) {
+            break;  // The last sequence is just literals
         }
 
-        // Get the chunk at the tail position
-        if (!tail_chunk || tail_chunk == CHUNK_PENDING) {
-            break;  // No chunk to clean
+        if (iend - ip < 2) {
+            return false;
         }
-
-        // Check if chunk can be cleaned
-        if (!tail_chunk->is_untracked && tail_chunk->ref_count > 0) {
-            break;  // Also no chunk to clean
+        size_t offset = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t match = token & 15;
+        if (!offset || offset > (size_t)(op - dst) || (15 == match && !lz4_read_length(&ip, iend, &match)) ||
+            match + 4 > (size_t)(oend - op)) {
+            return false;
         }
+        match += 4;
 
-        // Calculate the next tail position with wraparound
-        ptrdiff_t tail_index = tail_ptr - chunks->buffer;
-        ptrdiff_t next_index = (tail_index + 1) % chunks->capacity;
-        chunk_info_t** next_tail_ptr = chunks->buffer + next_index;
-
-        // Attempt to update the tail pointer atomically
-        if (atomic_compare_exchange_strong(&chunks->tail, &tail_ptr, next_tail_ptr)) {
-            // Success - clean up the chunk
-            munmap(tail_chunk->mapping, tail_chunk->size);
-            free(tail_chunk);
+        // Matches may overlap the bytes they produce
+        const uint8_t* ref = op - offset;
+        if (offset >= match) {
+            memcpy(op, ref, match);
+            op += match;
         } else {
-            // Failed to update tail pointer, another thread changed it
-            // Try again from the beginning
-            continue;
+            while (match--) {
+                *op++ = *ref++;
+            }
         }
     }
-
+    *size = op - dst;
     return true;
 }
 
-static inline uint32_t mmlog_cross_count(uint64_t start, size_t size, uint32_t chunk_size)
+// xxHash32 with a zero seed, for inputs under 16 bytes; that covers the frame descriptor, which is all we need it for
+static inline uint32_t lz4_xxh32_short(const uint8_t* p, size_t size)
 {
-    uint64_t end = start + size;
-
-    // Calculate the chunk indices for the start and end positions
-    uint64_t start_chunk_index = start / chunk_size;
-    uint64_t end_chunk_index = end / chunk_size;
-    return end_chunk_index - start_chunk_index;
+    static const uint32_t PRIME1 = 2654435761u, PRIME2 = 2246822519u, PRIME3 = 3266489917u, PRIME4 = 668265263u,
+                          PRIME5 = 374761393u;
+    uint32_t h = PRIME5 + (uint32_t)size;
+    for (; size >= 4; p += 4, size -= 4) {
+        h += lz4_read32(p) * PRIME3;
+        h = ((h << 17) | (h >> 15)) * PRIME4;
+    }
+    for (; size; p++, size--) {
+        h += *p * PRIME5;
+        h = ((h << 11) | (h >> 21)) * PRIME1;
+    }
+    h ^= h >> 15;
+    h *= PRIME2;
+    h ^= h >> 13;
+    h *= PRIME3;
+    h ^= h >> 16;
+    return h;
 }
 
-inline static chunk_info_t* create_chunk_at_cursor(log_handle_t* handle, uint64_t cursor)
+// Writes the header of a frame of independent blocks of up to `block_size` bytes, holding `content_size` bytes in all.
+// Returns the header size.
+static inline size_t lz4_frame_header(uint8_t* header, uint32_t block_size, uint64_t content_size)
 {
-    mmlog_errno = MMLOG_ERR_OK;
-    chunk_info_t* chunk = (chunk_info_t*)calloc(1, sizeof(chunk_info_t));
-    if (!chunk) {
-        mmlog_errno = MMLOG_ERR_CREATE_CHUNK_AT_CURSOR_ENOMEM;
-        return NULL;
+    uint8_t block_id = 4;  // 64KB, then 256KB, 1MB and 4MB
+    while (block_id < 7 && (1u << (8 + 2 * block_id)) < block_size) {
+        block_id++;
     }
+    lz4_write32(header, MMLOG_LZ4_MAGIC);
+    header[4] = 0x68;  // Version 1, independent blocks, content size present, no checksums
+    header[5] = (uint8_t)(block_id << 4);
+    lz4_write32(header + 6, (uint32_t)content_size);
+    lz4_write32(header + 10, (uint32_t)(content_size >> 32));
+    header[14] = (uint8_t)(lz4_xxh32_short(header + 4, 10) >> 8);
+    return 15;
+}
 
-    // Initialize the chunk for this cursor position
-    chunk->start_offset = (cursor / handle->metadata->chunk_size) * handle->metadata->chunk_size;
-    chunk->size = handle->metadata->chunk_size;
-    chunk->mapping = mmap(NULL, chunk->size, PROT_READ | PROT_WRITE, MAP_SHARED, handle->data_fd, chunk->start_offset);
-
-    if (MAP_FAILED == chunk->mapping) {
-        mmlog_errno = MMLOG_ERR_CREATE_CHUNK_AT_CURSOR_MMAP;
-        free(chunk);
-        return NULL;
+static inline bool segment_path(char* path, const char* filename, uint64_t segment, const char* suffix)
+{
+    int len = snprintf(path, PATH_MAX, "%s.%06" PRIu64 "%s", filename, segment, suffix);
+    if (len < 0 || len >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return false;
     }
+    return true;
+}
 
-    atomic_store(&chunk->ref_count, 1);
-    return chunk;
+static inline int segment_open(const char* filename, uint64_t segment, int flags)
+{
+    char path[PATH_MAX];
+    return segment_path(path, filename, segment, "") ? open(path, flags, 0644) : -1;
 }
 
-// Helper to check if cursor is within chunk
-static inline bool is_cursor_in_chunk(const chunk_info_t* chunk, uint64_t cursor)
+// Removes a segment, whether or not it has been compressed
+static inline void segment_unlink(const char* filename, uint64_t segment)
 {
-    return chunk && chunk != CHUNK_PENDING && chunk->start_offset <= cursor &&
-           cursor < chunk->start_offset + chunk->size;
+    char path[PATH_MAX];
+    if (segment_path(path, filename, segment, "")) {
+        unlink(path);
+    }
+    if (segment_path(path, filename, segment, ".lz4")) {
+        unlink(path);
+    }
 }
 
-static inline bool lock_head_inner(void* args)
+// The file behind a log offset, and where the offset lands in it.  Segment files are only opened for the duration of
+// an mmap() or the like, which happen on chunk boundaries rather than on every insert; hand the fd back with
+// data_fd_put().
+static inline int data_fd_get(log_handle_t* handle, uint64_t offset, uint64_t* file_offset)
 {
-    chunk_buffer_t* chunks = (chunk_buffer_t*)args;
-    bool expected = false;
-    return atomic_compare_exchange_strong(&chunks->head_locked, &expected, true);
+    uint64_t segment_size = handle->metadata->segments.size;
+    if (!segment_size) {
+        *file_offset = offset;
+        return handle->data_fd;
+    }
+
+    *file_offset = offset % segment_size;
+    int fd = segment_open(handle->filename, offset / segment_size, O_RDWR);
+    if (-1 == fd) {
+        mmlog_errno = MMLOG_ERR_DATA_FD_GET_OPEN;
+    }
+    return fd;
 }
 
-// Helper to lock the head pointer
-static inline bool lock_head(chunk_buffer_t* chunks)
+static inline void data_fd_put(log_handle_t* handle, int fd)
 {
-    return hot_wait_for_cond(lock_head_inner, chunks, SLEEP_TIME_MAX_MS);
+    if (-1 != fd && fd != handle->data_fd) {
+        close(fd);
+    }
 }
 
-// Helper to unlock the head pointer
-static inline void unlock_head(chunk_buffer_t* chunks)
+// pwrite() until it's all there.  Signals can cut a write short (or stop it before it starts) even on regular files.
+static inline bool pwrite_all(int fd, const void* data, size_t size, uint64_t offset)
 {
-    atomic_store(&chunks->head_locked, false);
+    for (size_t done = 0; done < size;) {
+        ssize_t written = pwrite(fd, (const char*)data + done, size - done, (off_t)(offset + done));
+        if (written < 0 && EINTR == errno) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        done += written;
+    }
+    return true;
 }
 
-// Fiddly arithmetic goes into a helper
-static inline chunk_info_t** get_next_head_ptr(chunk_buffer_t* chunks, chunk_info_t** head_ptr)
+// Zeroes [start, end) of the log, so that nothing left over from before a crash can be mistaken for a record later on
+static inline void recover_zero(log_handle_t* handle, uint64_t start, uint64_t end)
 {
-    return chunks->buffer + ((head_ptr - chunks->buffer + 1) % chunks->capacity);
+    static const char zeros[LOG_PAGE_SIZE];
+    uint64_t segment_size = handle->metadata->segments.size;
+    while (start < end) {
+        uint64_t size = end - start;
+        if (segment_size && size > segment_size - start % segment_size) {
+            size = segment_size - start % segment_size;
+        }
+        uint64_t file_offset;
+        int fd = data_fd_get(handle, start, &file_offset);
+        if (-1 != fd && 0 != syscall(SYS_fallocate, fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                                     (off_t)file_offset, (off_t)size)) {
+            for (uint64_t done = 0; done < size;) {
+                size_t n = size - done < sizeof(zeros) ? size - done : sizeof(zeros);
+                if (!pwrite_all(fd, zeros, n, file_offset + done)) {
+                    break;
+                }
+                done += n;
+            }
+        }
+        data_fd_put(handle, fd);
+        start += size;
+    }
 }
 
-// Helper function to add a new chunk
-static inline chunk_info_t* add_new_chunk(log_handle_t* handle,
-                                   chunk_buffer_t* chunks,
-                                   chunk_info_t** head_ptr,
-                                   chunk_info_t** tail_ptr,
-                                   uint64_t cursor)
+// Reads the frame at `pos` and checks it end to end, without going past `limit`
+static inline bool recover_frame_is_valid(log_handle_t* handle, uint64_t pos, uint64_t limit)
 {
-    mmlog_errno = MMLOG_ERR_OK;
+    mmlog_frame_t header;
+    uint64_t file_offset;
+    int fd = data_fd_get(handle, pos, &file_offset);
+    bool valid = -1 != fd && sizeof(header) == (size_t)pread(fd, &header, sizeof(header), file_offset) &&
+                 MMLOG_FRAME_MAGIC == atomic_load(&header.magic) && pos + mmlog_frame_size(header.length) <= limit;
+    mmlog_frame_t* frame = valid ? (mmlog_frame_t*)malloc(sizeof(header) + header.length) : NULL;
+    valid = frame && sizeof(header) + header.length ==
+                         (size_t)pread(fd, frame, sizeof(header) + header.length, file_offset) &&
+            mmlog_frame_is_valid(frame);
+    free(frame);
+    data_fd_put(handle, fd);
+    return valid;
+}
 
-    // Check if head_ptr is NULL
-    if (!head_ptr) {
-        mmlog_errno = MMLOG_ERR_ADD_NEW_CHUNK_EINVALID;
-        return NULL;
-    }
+// Looks for the next intact frame after a header which can't be made sense of, so that one writer dying before it got
+// anything down doesn't take everything after it along.  Only goes up to `limit`, which is returned if there's nothing.
+static inline uint64_t recover_scan(log_handle_t* handle, uint64_t start, uint64_t limit)
+{
+    char buffer[LOG_PAGE_SIZE];
+    uint64_t pos = start;
+    while (pos + sizeof(mmlog_frame_t) <= limit) {
+        uint64_t file_offset;
+        int fd = data_fd_get(handle, pos, &file_offset);
+        size_t size = limit - pos < sizeof(buffer) ? limit - pos : sizeof(buffer);
+        ssize_t got = -1 == fd ? -1 : pread(fd, buffer, size, file_offset);
+        data_fd_put(handle, fd);
+        if (got < (ssize_t)sizeof(mmlog_frame_t)) {
+            break;
+        }
 
-    // Calculate next head position
-    chunk_info_t** next_head_ptr = get_next_head_ptr(chunks, head_ptr);
-    if (next_head_ptr >= chunks->buffer + chunks->capacity) {
-        next_head_ptr = chunks->buffer;  // Wrap around
+        // Headers are aligned, so only those offsets can hold one
+        size_t offset = 0;
+        for (; offset + sizeof(mmlog_frame_t) <= (size_t)got; offset += MMLOG_FRAME_ALIGN) {
+            uint32_t magic;
+            memcpy(&magic, buffer + offset, sizeof(magic));
+            if (MMLOG_FRAME_MAGIC == magic && recover_frame_is_valid(handle, pos + offset, limit)) {
+                return pos + offset;
+            }
+        }
+        pos += offset;
     }
+    return limit;
+}
 
-    // Check if buffer is full, retry _one_ time
-    if (next_head_ptr == tail_ptr) {
-        clean_chunks(&handle->chunks);
-
-        // Recalculate next head position with updated pointers
-        head_ptr = atomic_load(&chunks->head);
-        tail_ptr = atomic_load(&chunks->tail);
-        next_head_ptr = get_next_head_ptr(chunks, head_ptr);
+// Works out where the log really ends, once everybody who was writing to it is gone.  Everything below `committed` is
+// known to be complete.  Past that, framed logs are followed one header at a time up to `cursor`.  Frames which were
+// reserved but never committed become skip records, and so do stretches where the header never got written, as long
+// as there's an intact frame somewhere after them (in the same segment).  Raw logs have nothing to go on, so whatever
+// was reserved is kept as-is.  Leaves the log ready to append at the end.
+static inline uint64_t recover_log(log_handle_t* handle, uint64_t committed, uint64_t cursor)
+{
+    log_metadata_t* metadata = handle->metadata;
+    uint64_t segment_size = metadata->segments.size;
+    uint64_t sequence = atomic_load(&metadata->sequence);
+    uint64_t end = committed;
+    while ((metadata->flags & MMLOG_FLAG_FRAMED) && end + sizeof(mmlog_skip_t) <= cursor) {
+        mmlog_frame_t frame = {0};
+        uint64_t file_offset;
+        int fd = data_fd_get(handle, end, &file_offset);
+        if (-1 == fd || pread(fd, &frame, sizeof(frame), file_offset) < (ssize_t)sizeof(mmlog_skip_t)) {
+            data_fd_put(handle, fd);
+            break;
+        }
 
-        if (next_head_ptr == tail_ptr) {
-            // Still full after cleaning, so we can't add a new chunk
-            mmlog_errno = MMLOG_ERR_ADD_NEW_CHUNK_EWAIT;
-            return NULL;
+        uint32_t magic = atomic_load(&frame.magic);
+        uint64_t span = mmlog_frame_span(&frame);
+        bool is_torn = 0 == magic;
+        uint64_t limit = segment_size && cursor > (end / segment_size + 1) * segment_size
+                             ? (end / segment_size + 1) * segment_size
+                             : cursor;
+        if (!span || span % MMLOG_FRAME_ALIGN || end + span > limit ||
+            (!is_torn && MMLOG_FRAME_MAGIC != magic && MMLOG_SKIP_MAGIC != magic)) {
+            // Nothing to go on; skip ahead to the next frame, or at least to the end of the segment
+            span = recover_scan(handle, end + MMLOG_FRAME_ALIGN, limit) - end;
+            is_torn = limit != cursor || end + span != cursor;
+            if (span > UINT32_MAX) {
+                span = UINT32_MAX & ~(uint64_t)(MMLOG_FRAME_ALIGN - 1);  // More than a skip record can cover at once
+            }
+            if (!is_torn) {
+                data_fd_put(handle, fd);
+                break;
+            }
+        }
+        if (is_torn) {
+            mmlog_skip_t skip = {MMLOG_SKIP_MAGIC, (uint32_t)span};
+            if (sizeof(skip) != (size_t)pwrite(fd, &skip, sizeof(skip), file_offset)) {
+                data_fd_put(handle, fd);
+                break;
+            }
+        } else if (MMLOG_FRAME_MAGIC == magic && frame.sequence >= sequence) {
+            sequence = frame.sequence + 1;
         }
+        data_fd_put(handle, fd);
+        end += span;
     }
-
-    // Create new chunk
-    chunk_info_t* new_chunk = create_chunk_at_cursor(handle, cursor);
-    if (!new_chunk) {
-        // Unmark the pending chunk; I guess this might create churn as other writers try the same thing
-        // TODO: probably a global failure state, like our panic state
-        // callee sets errno
-        atomic_store((chunk_info_t * _Atomic*)next_head_ptr, NULL);
-        return NULL;
+    if (!(metadata->flags & MMLOG_FLAG_FRAMED)) {
+        end = cursor;
     }
 
-    // Store new chunk
-    atomic_store((chunk_info_t * _Atomic*)next_head_ptr, new_chunk);
+    uint64_t file_size = atomic_load(&metadata->file_size);
+    recover_zero(handle, end, cursor < file_size ? cursor : file_size);
 
-    // Advance head pointer
-    if (!atomic_compare_exchange_strong(&chunks->head, &head_ptr, next_head_ptr)) {
-        // This should _never_ happen because the caller has the head lock
+    // Nobody is waiting on, holding or parked in anything anymore
+    atomic_store(&metadata->cursor, end);
+    atomic_store(&metadata->committed, end);
+    atomic_store(&metadata->sequence, sequence);
+    for (size_t i = 0; i < MMLOG_PENDING_COMMITS; i++) {
+        atomic_store(&metadata->pending[i].start, 0);
+        atomic_store(&metadata->pending[i].end, 0);
     }
-
-    return new_chunk;
+    if (atomic_load(&metadata->durable) > end) {
+        atomic_store(&metadata->durable, end);
+    }
+    atomic_store(&metadata->synced.sleepers, 0);
+    atomic_store(&metadata->is_locked, 0);
+    atomic_store(&metadata->is_panicked, false);
+    atomic_store(&metadata->segment_created_ms, ms_since_epoch_monotonic());  // The clock may have been reset
+    return end;
 }
 
-static inline chunk_info_t* mmlog_rb_checkout(log_handle_t* handle, uint64_t cursor)
+static inline bool files_create(int fd_meta, const char* filename, uint32_t chunk_size, uint32_t flags,
+                                const mmlog_segments_t* segments, log_handle_t* handle)
 {
+    log_metadata_t* metadata = NULL;
+    int fd_data = -1;
     mmlog_errno = MMLOG_ERR_OK;
+    // Whatever was there before (if anything) is of no use
+    if (-1 == ftruncate(fd_meta, 0) || -1 == ftruncate(fd_meta, sizeof(log_metadata_t))) {
+        mmlog_errno = MMLOG_ERR_FILES_CREATE_FTRUNCATE_MDATA;
+        goto files_create_cleanup;
+    }
 
-    // Validate inputs
-    if (!handle || !handle->chunks.buffer) {
-        mmlog_errno = MMLOG_ERR_MMLOG_RB_CHECKOUT_EINVAL;
-        return NULL;
+    metadata = (log_metadata_t*)mmap(NULL, sizeof(log_metadata_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd_meta, 0);
+    if (MAP_FAILED == metadata) {
+        mmlog_errno = MMLOG_ERR_FILES_CREATE_MMAP_MDATA;
+        goto files_create_cleanup;
     }
 
-    // Need to create or find a suitable chunk - acquire lock for the entire operation
-    chunk_buffer_t* chunks = &handle->chunks;
-    if (!lock_head(chunks)) {
-        mmlog_errno = MMLOG_ERR_MMLOG_RB_CHECKOUT_NOLOCK;
-        return NULL;
+    metadata->version = MMLOG_VERSION;
+    metadata->page_size = (flags & MMLOG_FLAG_HUGEPAGES) ? MMLOG_HUGE_PAGE_SIZE : LOG_PAGE_SIZE;
+    metadata->chunk_size = chunk_size;
+    metadata->flags = flags;
+    if (segments) {
+        metadata->segments = *segments;
+    }
+    atomic_store(&metadata->segment_created_ms, ms_since_epoch_monotonic());
+
+    // We're going to try and open the data file, but it's a bit tricky.
+    // 1. if it doesn't exist--great!
+    // 2. if it does exist, framed logs can be followed from the start to find where to put the cursor.  Otherwise
+    // it's hard to tell where the data ends, and we don't want to corrupt incoming binary data, so clobber the file!
+    fd_data = segments ? segment_open(filename, 0, O_RDWR | O_CREAT) : open(filename, O_RDWR | O_CREAT, 0644);
+    if (-1 == fd_data) {
+        mmlog_errno = MMLOG_ERR_FILES_CREATE_OPEN_DATA;
+        goto files_create_cleanup;
+    }
+
+    // Zero + init the data file and init the metadata file
+    struct stat st;
+    uint64_t kept = 0;
+    if (!segments && (flags & MMLOG_FLAG_FRAMED) && 0 == fstat(fd_data, &st)) {
+        kept = (uint64_t)st.st_size;
     }
-    chunk_info_t** head_ptr = atomic_load(&chunks->head);
-    chunk_info_t** tail_ptr = atomic_load(&chunks->tail);
-    if (!head_ptr) {
-        head_ptr = chunks->buffer;  // Initialize head pointer if NULL
+    if ((!kept && -1 == ftruncate(fd_data, 0)) || (kept < chunk_size && -1 == ftruncate(fd_data, chunk_size))) {
+        mmlog_errno = MMLOG_ERR_FILES_CREATE_FTRUNCATE_DATA;
+        goto files_create_cleanup;
     }
-    chunk_info_t* head_chunk = *head_ptr;
 
-    // If we fit inside of the head, we're done
-    if (head_chunk && is_cursor_in_chunk(head_chunk, cursor)) {
-        atomic_fetch_add(&head_chunk->ref_count, 1);
-        unlock_head(chunks);
-        return head_chunk;
+    // Segment files come and go, so they're only opened as needed
+    if (segments) {
+        close(fd_data);
+        fd_data = -1;
     }
 
-    head_chunk = add_new_chunk(handle, chunks, head_ptr, tail_ptr, cursor);
-    if (!head_chunk) {
-        // callee sets errno
-        unlock_head(chunks);
-        return NULL;  // Failed to add new chunk
+    handle->metadata = metadata;
+    handle->data_fd = fd_data;
+    handle->metadata_fd = fd_meta;
+    atomic_store(&metadata->file_size, kept > chunk_size ? kept : chunk_size);
+    if (kept) {
+        recover_log(handle, 0, kept);
+    }
+    atomic_store(&metadata->is_ready, 1);
+    mmlog_futex_wake(&metadata->is_ready, true);
+    return true;
+
+files_create_cleanup:
+    if (metadata && metadata != MAP_FAILED) {
+        if (-1 == munmap(metadata, sizeof(log_metadata_t))) {
+            // Nothing to do here
+        }
     }
-    unlock_head(chunks);
-    atomic_fetch_add(&head_chunk->ref_count, 1);
-    return head_chunk;
+    if (-1 != fd_data) {
+        close(fd_data);
+    }
+    return false;
 }
 
-static inline bool write_to_chunk(log_handle_t* handle, uint64_t cursor, const void* data, size_t size)
+typedef struct {
+    int* fd;
+    const char* filename;
+    size_t size;
+} try_check_file_ready_args_t;
+
+static inline bool try_check_file_ready(void* args)
 {
-    mmlog_errno = MMLOG_ERR_OK;
-    chunk_info_t* chunk = mmlog_rb_checkout(handle, cursor);
-    if (!chunk) {
-        mmlog_errno = MMLOG_ERR_WRITE_TO_CHUNK_ECHUNK;
-        return false;  // Failed to checkout chunk
+    try_check_file_ready_args_t* m = (try_check_file_ready_args_t*)args;
+    int* fd = m->fd;
+    size_t size = m->size;
+    const char* filename = m->filename;
+    if (-1 == *fd) {
+        *fd = open(filename, O_RDWR);
+        if (-1 == *fd) {
+            mmlog_errno = MMLOG_ERR_TRY_CHECK_FILE_READY_OPEN;
+            return false;
+        }
+    }
+    struct stat st;
+    if (0 != fstat(*fd, &st) || (size_t)st.st_size < size) {
+        mmlog_errno = MMLOG_ERR_TRY_CHECK_FILE_READY_FSTAT;
+        return false;
     }
-
-    uint64_t chunk_offset = cursor - chunk->start_offset;
-    memcpy((char*)chunk->mapping + chunk_offset, data, size);
-    atomic_fetch_sub(&chunk->ref_count, 1);
     return true;
 }
 
-bool mmlog_insert(log_handle_t* handle, const void* data, size_t size)
+// Sleeps on the ready flag until whoever created the log is done setting it up
+static inline bool wait_for_metadata_ready(log_metadata_t* metadata, int64_t timeout_ms)
 {
-    mmlog_errno = MMLOG_ERR_OK;
+    for (int i = 0; i < MMLOG_SPIN_COUNT; i++) {
+        if (atomic_load(&metadata->is_ready)) {
+            return true;
+        }
+        mmlog_cpu_relax();
+    }
 
-    if (!handle || !data || size == 0) {
-        mmlog_errno = MMLOG_ERR_MMLOG_INSERT_EINVAL;
-        return false;
+    int64_t start_time = ms_since_epoch_monotonic();
+    while (!atomic_load(&metadata->is_ready)) {
+        int64_t remaining = timeout_ms - (ms_since_epoch_monotonic() - start_time);
+        if (remaining <= 0) {
+            return false;
+        }
+        mmlog_futex_wait(&metadata->is_ready, 0, remaining, true);
     }
+    return true;
+}
 
+static inline bool files_open(int fd_meta, const char* filename, int64_t timeout_ms, log_handle_t* handle)
+{
+    mmlog_errno = MMLOG_ERR_OK;
+    int fd_data = -1;
     log_metadata_t* metadata = handle->metadata;
 
-    uint64_t cursor = mmlog_checkout(handle, size);
-    if (LOG_CURSOR_INVALID == cursor) {
-        // callee sets errno
-        return false;
+    // Before we mmap the metadata, check the file size.  If it's nonzero, but less than the size of the metadata, it's
+    // probable that we have an incompatible metadata version--so bail out
+    try_check_file_ready_args_t fd_meta_args = {&fd_meta, NULL, sizeof(log_metadata_t)};
+    try_check_file_ready_args_t fd_data_args = {&fd_data, filename, 0};
+    if (!hot_wait_for_cond(try_check_file_ready, &fd_meta_args, timeout_ms)) {
+        if (mmlog_errno == MMLOG_ERR_TRY_CHECK_FILE_READY_OPEN) {
+            mmlog_errno = MMLOG_ERR_FILES_OPEN_MDATA_READY_OPEN;
+        } else if (mmlog_errno == MMLOG_ERR_TRY_CHECK_FILE_READY_FSTAT) {
+            mmlog_errno = MMLOG_ERR_FILES_OPEN_MDATA_READY_FSTAT;
+        }
+        goto files_open_cleanup;
     }
 
+    // Nothing is valid until we've mapped the metadata (above check ensures the metadata file is at least as big as we
+    // need)
+    metadata = (log_metadata_t*)mmap(NULL, sizeof(log_metadata_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd_meta, 0);
+    if (MAP_FAILED == metadata) {
+        mmlog_errno = MMLOG_ERR_FILES_OPEN_MDATA_MMAP;
+        goto files_open_cleanup;
+    }
+
+    // Wait for the creator to finish
+    if (!wait_for_metadata_ready(metadata, timeout_ms)) {
+        mmlog_errno = MMLOG_ERR_FILES_OPEN_MDATA_READY;
+        goto files_open_cleanup;
+    }
+    fd_data_args.size = metadata->chunk_size;  // Set the size for the data file check
+
+    // If the version is not compatible, we can't use this log
+    if (metadata->version != MMLOG_VERSION) {
+        mmlog_errno = MMLOG_ERR_FILES_OPEN_VERSION;
+        goto files_open_cleanup;
+    }
+
+    // Finally, we have to open the data file; segments were created before the metadata was ready
+    if (!metadata->segments.size && !hot_wait_for_cond(try_check_file_ready, &fd_data_args, timeout_ms)) {
+        if (mmlog_errno == MMLOG_ERR_TRY_CHECK_FILE_READY_OPEN) {
+            mmlog_errno = MMLOG_ERR_FILES_OPEN_DATA_READY_OPEN;
+        } else if (mmlog_errno == MMLOG_ERR_TRY_CHECK_FILE_READY_FSTAT) {
+            mmlog_errno = MMLOG_ERR_FILES_OPEN_DATA_READY_FSTAT;
+        }
+        goto files_open_cleanup;
+    }
+
+    handle->metadata_fd = fd_meta;
+    handle->data_fd = fd_data;
+    handle->metadata = metadata;
+
+    return true;
+
+files_open_cleanup:
+    if (metadata && MAP_FAILED != metadata) {
+        munmap(metadata, sizeof(log_metadata_t));
+    }
+    if (-1 != fd_data) {
+        close(fd_data);
+    }
+    return false;
+}
+
+// Picks up a log which nobody else has open, presumably because whoever had it open before is gone (maybe without
+// getting a chance to clean up)
+static inline bool files_recover(log_handle_t* handle)
+{
+    mmlog_errno = MMLOG_ERR_OK;
+    log_metadata_t* metadata = handle->metadata;
+    uint64_t segment_size = metadata->segments.size;
+
+    // The newest segment file (or the data file) decides how much of the log is backed
+    uint64_t base = segment_size ? atomic_load(&metadata->segment) * segment_size : 0;
+    uint64_t file_offset;
+    struct stat st;
+    int fd = data_fd_get(handle, base, &file_offset);
+    if (-1 == fd || 0 != fstat(fd, &st)) {
+        data_fd_put(handle, fd);
+        mmlog_errno = MMLOG_ERR_FILES_RECOVER_FSTAT;
+        return false;
+    }
+    data_fd_put(handle, fd);
+    atomic_store(&metadata->file_size, base + (uint64_t)st.st_size);
+
+    recover_log(handle, atomic_load(&metadata->committed), atomic_load(&metadata->cursor));
+    return true;
+}
+
+// Takes an OFD lock on one byte of the metadata file.  These belong to the open file description rather than the
+// process, so they're shared with forked children, and they go away once the last descriptor and mapping of the file is
+// gone (so, at the latest, when the last process holding one dies).
+static inline bool meta_lock(int fd_meta, off_t byte, short type, bool wait)
+{
+    struct flock lock = {0};
+    lock.l_type = type;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = byte;
+    lock.l_len = 1;
+    while (-1 == fcntl(fd_meta, wait ? F_OFD_SETLKW : F_OFD_SETLK, &lock)) {
+        if (EINTR != errno) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static inline bool files_open_or_create(const char* filename, uint32_t chunk_size, uint32_t flags,
+                                        const mmlog_segments_t* segments, log_handle_t* handle)
+{
+    mmlog_errno = MMLOG_ERR_OK;
+    if (!filename || !*filename || chunk_size == 0 || chunk_size % LOG_PAGE_SIZE != 0 || !handle) {
+        mmlog_errno = MMLOG_ERR_FILES_OPEN_OR_CREATE_EINVAL;
+        return false;
+    }
+
+    static const char* suffix = ".mmlog";
+    size_t meta_filename_len = strlen(filename) + strlen(suffix) + 1;
+    char* meta_filename = (char*)malloc(meta_filename_len);
+    int fd_meta = -1;
+    if (!meta_filename) {
+        mmlog_errno = MMLOG_ERR_FILES_OPEN_OR_CREATE_EINVAL;
+        goto files_open_or_create_cleanup;
+    }
+
+    if (snprintf(meta_filename, meta_filename_len, "%s%s", filename, suffix) < 0) {
+        mmlog_errno = MMLOG_ERR_FILES_OPEN_OR_CREATE_SNPRINTF;
+        goto files_open_or_create_cleanup;
+    }
+
+    // Handles are opened one at a time, and every open handle holds a shared lock on MMLOG_LOCK_LIVE.  So if we can get
+    // that lock exclusively, then nobody else has the log open: either it doesn't exist yet, or it's left over from
+    // processes which are gone (possibly mid-write, or mid-create).  Either way, it's ours to set right.
+    fd_meta = open(meta_filename, O_RDWR | O_CREAT, 0644);
+    if (-1 == fd_meta) {
+        mmlog_errno = MMLOG_ERR_FILES_OPEN_OR_CREATE_OPEN;
+        goto files_open_or_create_cleanup;
+    }
+    if (!meta_lock(fd_meta, MMLOG_LOCK_OPEN, F_WRLCK, true)) {
+        mmlog_errno = MMLOG_ERR_FILES_OPEN_OR_CREATE_LOCK;
+        goto files_open_or_create_cleanup;
+    }
+
+    bool ok;
+    if (!meta_lock(fd_meta, MMLOG_LOCK_LIVE, F_WRLCK, false)) {
+        ok = files_open(fd_meta, filename, SLEEP_TIME_MAX_MS, handle);
+    } else if (!(ok = files_open(fd_meta, filename, 0, handle) && files_recover(handle))) {
+        // Missing, half-created, from an incompatible version or missing its data; start over
+        if (handle->metadata) {
+            munmap(handle->metadata, sizeof(log_metadata_t));
+            handle->metadata = NULL;
+            if (-1 != handle->data_fd) {
+                close(handle->data_fd);
+            }
+        }
+        ok = files_create(fd_meta, filename, chunk_size, flags, segments, handle);
+    }
+    if (ok && !meta_lock(fd_meta, MMLOG_LOCK_LIVE, F_RDLCK, false)) {
+        mmlog_errno = MMLOG_ERR_FILES_OPEN_OR_CREATE_LOCK;
+        ok = false;
+    }
+    if (!ok) {
+        // callee sets errno
+        goto files_open_or_create_cleanup;
+    }
+
+    meta_lock(fd_meta, MMLOG_LOCK_OPEN, F_UNLCK, false);
+    free(meta_filename);
+    return true;
+
+files_open_or_create_cleanup:
+    free(meta_filename);
+    if (-1 != fd_meta) {
+        close(fd_meta);
+    }
+    return false;
+}
+
+// Bumped in the child after every fork(), so that slabs and handles can tell they were inherited from the parent
+static _Atomic uint32_t mmlog_fork_generation = 0;
+static once_flag mmlog_atfork_once = ONCE_FLAG_INIT;
+
+static void mmlog_atfork_child(void)
+{
+    atomic_fetch_add(&mmlog_fork_generation, 1);
+}
+
+static void mmlog_atfork_register(void)
+{
+    pthread_atfork(NULL, NULL, mmlog_atfork_child);
+}
+
+log_handle_t* mmlog_open_segmented(const char* filename, size_t chunk_size, uint32_t chunk_count, uint32_t flags,
+                                   const mmlog_segments_t* segments)
+{
+    // Like mmlog_open_ex(), but if this call creates the log, it rolls over into segment files according to `segments`
+    // (or never, if that's NULL).  Otherwise the log keeps whatever policy it was created with.
+    mmlog_errno = MMLOG_ERR_OK;
+    // chunks are page multiples, and we need at least 2 chunks
+    size_t page_size = (flags & MMLOG_FLAG_HUGEPAGES) ? MMLOG_HUGE_PAGE_SIZE : LOG_PAGE_SIZE;
+    if (chunk_size % page_size != 0 || chunk_size == 0 || chunk_count < 2 || (flags & ~MMLOG_FLAG_MASK) ||
+        (segments && (!segments->size || segments->size % chunk_size || segments->size > UINT32_MAX))) {
+        mmlog_errno = MMLOG_ERR_MMLOG_OPEN_EINVAL;
+        return NULL;
+    }
+
+    // Allocate handle
+    log_handle_t* handle = (log_handle_t*)calloc(1, sizeof(log_handle_t));
+    if (!handle || !(handle->filename = strdup(filename))) {
+        mmlog_errno = MMLOG_ERR_MMLOG_OPEN_ENOMEM;
+        free(handle);
+        return NULL;
+    }
+
+    // Allocate chunk buffer
+    handle->chunks.capacity = chunk_count;
+    handle->chunks.buffer = (_Atomic(chunk_info_t**))(chunk_info_t**)calloc(chunk_count, sizeof(chunk_info_t*));
+    if (!handle->chunks.buffer) {
+        mmlog_errno = MMLOG_ERR_MMLOG_OPEN_ENOMEM;
+        free(handle->filename);
+        free(handle);
+        return NULL;
+    }
+
+    // Every slot gets a retired descriptor, and the rest of the pool goes on the free list
+    handle->chunks.pool_size = MMLOG_POOL_SIZE(chunk_count);
+    handle->chunks.pool = (chunk_info_t*)calloc(handle->chunks.pool_size, sizeof(chunk_info_t));
+    if (!handle->chunks.pool) {
+        mmlog_errno = MMLOG_ERR_MMLOG_OPEN_ENOMEM;
+        free(handle->chunks.buffer);
+        free(handle->filename);
+        free(handle);
+        return NULL;
+    }
+    for (uint32_t i = 0; i < handle->chunks.pool_size; i++) {
+        chunk_info_t* chunk = &handle->chunks.pool[i];
+        if (i < chunk_count) {
+            atomic_store(&chunk->ref_count, CHUNK_REF_RETIRED);
+            handle->chunks.buffer[i] = chunk;
+        } else {
+            atomic_store(&chunk->next_free, i + 1 < handle->chunks.pool_size ? i + 2 : 0);
+        }
+    }
+    atomic_store(&handle->chunks.free_list, chunk_count + 1);
+
+    if (!files_open_or_create(filename, chunk_size, flags, segments, handle)) {
+        // callee sets errno
+        free(handle->chunks.pool);
+        free(handle->chunks.buffer);
+        free(handle->filename);
+        free(handle);
+        return NULL;
+    }
+
+    // Head and tail both start out on the same (empty) slot
+    atomic_store(&handle->chunks.head, 0);
+    atomic_store(&handle->chunks.tail, 0);
+    call_once(&mmlog_atfork_once, mmlog_atfork_register);
+    handle->fork_generation = atomic_load(&mmlog_fork_generation);
+
+    return handle;
+}
+
+log_handle_t* mmlog_open_ex(const char* filename, size_t chunk_size, uint32_t chunk_count, uint32_t flags)
+{
+    // Like mmlog_open(), but with MMLOG_FLAG_* options.  The flags only matter if this call creates the log.
+    return mmlog_open_segmented(filename, chunk_size, chunk_count, flags, NULL);
+}
+
+log_handle_t* mmlog_open(const char* filename, size_t chunk_size, uint32_t chunk_count)
+{
+    return mmlog_open_ex(filename, chunk_size, chunk_count, 0);
+}
+
+// The expansion lock is only ever held across a single ftruncate(), so spin briefly and then sleep on it.  Sleepers
+// mark the lock as contended, so that whoever unlocks it knows to wake them.
+static inline bool expand_lock(log_metadata_t* metadata, int64_t timeout_ms)
+{
+    for (int i = 0; i < MMLOG_SPIN_COUNT; i++) {
+        uint32_t expected = 0;
+        if (atomic_compare_exchange_weak(&metadata->is_locked, &expected, 1)) {
+            return true;
+        }
+        mmlog_cpu_relax();
+    }
+
+    MMLOG_STAT_ADD(metadata, expand_lock_failures, 1);
+    int64_t start_time = ms_since_epoch_monotonic();
+    while (0 != atomic_exchange(&metadata->is_locked, 2)) {
+        int64_t remaining = timeout_ms - (ms_since_epoch_monotonic() - start_time);
+        if (remaining <= 0) {
+            return false;
+        }
+        mmlog_futex_wait(&metadata->is_locked, 2, remaining, true);
+    }
+    return true;
+}
+
+static inline void expand_unlock(log_metadata_t* metadata)
+{
+    if (2 == atomic_exchange(&metadata->is_locked, 0)) {
+        mmlog_futex_wake(&metadata->is_locked, true);
+    }
+}
+
+// Allocates the new blocks up front, so that writers don't end up doing it from inside a page fault.  Not every
+// filesystem can, but a sparse file works too.
+static inline bool grow_data_file(int fd, uint64_t old_size, uint64_t new_size)
+{
+    if (0 == syscall(SYS_fallocate, fd, 0, (off_t)old_size, (off_t)(new_size - old_size))) {
+        return true;
+    }
+    return (EOPNOTSUPP == errno || ENOSYS == errno) && 0 == ftruncate(fd, new_size);
+}
+
+// Rolls the log over into new segment files until the one containing `end` exists, then grows that one to cover it.
+// Sealed segments are extended to their full size so that readers can map them whole, even when they were cut short;
+// the tail stays sparse.  Called with the expansion lock held.
+static inline bool segment_expand(log_handle_t* handle, uint64_t end)
+{
+    log_metadata_t* metadata = handle->metadata;
+    uint64_t segment_size = metadata->segments.size;
+    uint64_t current = atomic_load(&metadata->segment);
+    uint64_t target = (end - 1) / segment_size;
+    int fd = segment_open(handle->filename, current, O_RDWR);
+    if (-1 == fd) {
+        return false;
+    }
+
+    while (current < target) {
+        int next = segment_open(handle->filename, current + 1, O_RDWR | O_CREAT | O_TRUNC);
+        if (-1 == next || -1 == ftruncate(fd, segment_size)) {
+            if (-1 != next) {
+                close(next);
+            }
+            close(fd);
+            return false;
+        }
+        close(fd);
+        fd = next;
+        current++;
+        atomic_store(&metadata->segment_created_ms, ms_since_epoch_monotonic());
+        atomic_store(&metadata->file_size, current * segment_size);
+        atomic_store(&metadata->segment, current);
+
+        // Readers check first_segment before opening anything, so move it before the files go away
+        uint32_t retain = metadata->segments.retain;
+        uint64_t first = atomic_load(&metadata->first_segment);
+        if (retain && current - first >= retain) {
+            atomic_store(&metadata->first_segment, current - retain + 1);
+            for (; first < current - retain + 1; first++) {
+                segment_unlink(handle->filename, first);
+            }
+        }
+    }
+
+    uint64_t file_size = atomic_load(&metadata->file_size);
+    uint64_t new_size = ALIGN(end, (uint64_t)metadata->chunk_size);
+    bool ok = new_size <= file_size ||
+              grow_data_file(fd, file_size - current * segment_size, new_size - current * segment_size);
+    close(fd);
+    if (ok && new_size > file_size) {
+        atomic_store(&metadata->file_size, new_size);
+    }
+    return ok;
+}
+
+static inline bool data_file_expand(log_handle_t* handle, uint64_t end)
+{
+    mmlog_errno = MMLOG_ERR_OK;
+    log_metadata_t* metadata = handle->metadata;
+
+    // Whoever holds the lock may have already grown the file for us
+    if (atomic_load(&metadata->file_size) >= end) {
+        return true;
+    }
+
+    if (!expand_lock(metadata, SLEEP_TIME_MAX_MS)) {
+        mmlog_errno = MMLOG_ERR_DATA_FILE_EXPAND_LOCKED;
+        return false;
+    }
+
+    bool ok = true;
+    if (atomic_load(&metadata->is_panicked)) {
+        mmlog_errno = MMLOG_ERR_DATA_FILE_EXPAND_PANICKED;
+        ok = false;
+    } else if (atomic_load(&metadata->file_size) < end) {
+        // Need to expand
+        uint64_t new_size = ALIGN(end, (uint64_t)metadata->chunk_size);
+        if (metadata->segments.size ? !segment_expand(handle, end)
+                                    : !grow_data_file(handle->data_fd, atomic_load(&metadata->file_size), new_size)) {
+            // Whoa, we can't ftruncate!  Everything sucks!
+            atomic_store(&metadata->is_panicked, true);
+            mmlog_errno = MMLOG_ERR_DATA_FILE_EXPAND_GROW;
+            ok = false;
+        } else {
+            atomic_store(&metadata->file_size, new_size);
+        }
+    }
+
+    expand_unlock(metadata);
+    return ok;
+}
+
+// How much of each segment records can use.  Raw logs can't tell padding from data, so their segments keep a trailer
+// at the end saying how far the data goes, for readers to stop there; framed logs pad with skip records instead.
+static inline uint64_t segment_capacity(const log_metadata_t* metadata)
+{
+    return metadata->segments.size - (metadata->flags & MMLOG_FLAG_FRAMED ? 0 : MMLOG_SEGMENT_TRAILER);
+}
+
+// Moves the cursor past a record without ever letting it straddle two segments.  If it doesn't fit in what's left of
+// the current segment, or the segment has been open for too long, the record goes at the start of the next one and
+// `gap` is set to where the leftover space begins; otherwise `gap` is set to the start of the record.
+static inline uint64_t segment_reserve(log_metadata_t* metadata, size_t size, uint64_t* gap)
+{
+    uint64_t segment_size = metadata->segments.size;
+    uint64_t capacity = segment_capacity(metadata);
+    uint32_t max_age_ms = metadata->segments.max_age_ms;
+    uint64_t cursor = atomic_load(&metadata->cursor);
+    uint64_t start;
+    do {
+        start = cursor;
+        if (cursor % segment_size) {
+            uint64_t boundary = (cursor / segment_size + 1) * segment_size;
+            if (cursor + size > boundary - segment_size + capacity ||
+                (max_age_ms && atomic_load(&metadata->segment) == cursor / segment_size &&
+                 ms_since_epoch_monotonic() - atomic_load(&metadata->segment_created_ms) >= max_age_ms)) {
+                start = boundary;
+            }
+        }
+    } while (!atomic_compare_exchange_weak(&metadata->cursor, &cursor, start + size));
+    *gap = cursor;
+    return start;
+}
+
+static inline void write_skip(log_handle_t* handle, uint64_t start, uint64_t end);
+static inline bool write_range(log_handle_t* handle, uint64_t cursor, const void* data, size_t size);
+static inline bool commit_range(log_handle_t* handle, uint64_t start, uint64_t end);
+
+uint64_t mmlog_checkout(log_handle_t* handle, size_t size)
+{
+    // Gets the start position for the requested write operation
+    // Will increase the capacity of the file if needed, but does not map the new pages
+    mmlog_errno = MMLOG_ERR_OK;
+    if (!handle || !handle->metadata) {
+        mmlog_errno = MMLOG_ERR_MMLOG_CHECKOUT_EINVAL;
+        return LOG_CURSOR_INVALID;
+    }
+
+    log_metadata_t* metadata = handle->metadata;
+    uint64_t start;
+    uint64_t gap;
+    if (!metadata->segments.size) {
+        gap = start = atomic_fetch_add(&metadata->cursor, size);
+    } else if (size > segment_capacity(metadata)) {
+        mmlog_errno = MMLOG_ERR_MMLOG_CHECKOUT_EINVAL;
+        return LOG_CURSOR_INVALID;
+    } else {
+        start = segment_reserve(metadata, size, &gap);
+    }
+    uint64_t end = start + size;
+
+    // Once the cursor has moved the range is ours, and readers can't get past it until it's been committed; so unless
+    // the log is broken for good, keep at it rather than leaving a hole.  The lock is only ever held across a single
+    // ftruncate(), so if it stays taken for MMLOG_STALL_MS, whoever took it died holding it and nobody can grow the
+    // file anymore.  That's broken for good too, until recovery clears the lock.
+    int64_t deadline = 0;
+    while (end > atomic_load(&metadata->file_size)) {
+        if (data_file_expand(handle, end)) {
+            break;
+        }
+        if (atomic_load(&metadata->is_panicked)) {
+            // callee sets errno
+            return LOG_CURSOR_INVALID;
+        }
+        int64_t now = ms_since_epoch_monotonic();
+        deadline = deadline ? deadline : now + MMLOG_STALL_MS;
+        if (now >= deadline) {
+            atomic_store(&metadata->is_panicked, true);
+            mmlog_errno = MMLOG_ERR_MMLOG_CHECKOUT_STALE_LOCK;
+            return LOG_CURSOR_INVALID;
+        }
+    }
+
+    // Whatever was left of the last segment still has to be committed, or the watermark would never get past it.  If
+    // it has a trailer, that gets filled in too.
+    if (gap != start) {
+        uint64_t data_limit = start - metadata->segments.size + segment_capacity(metadata);
+        write_skip(handle, gap, data_limit);
+        if (data_limit != start) {
+            uint64_t trailer = gap % metadata->segments.size;
+            write_range(handle, data_limit, &trailer, sizeof(trailer));
+        }
+        if (!commit_range(handle, gap, start)) {
+            // callee sets errno
+            return LOG_CURSOR_INVALID;
+        }
+    }
+    return start;
+}
+
+// Claims the parked range starting at `start`, so that nobody else can absorb or extend it
+static inline bool claim_pending(mmlog_pending_t* pending, uint64_t start)
+{
+    return atomic_load(&pending->start) == start &&
+           atomic_compare_exchange_strong(&pending->start, &start, LOG_CURSOR_INVALID);
+}
+
+// Picks up commits which were parked waiting for the watermark to reach them.  Ranges never overlap, so whoever claims
+// the range starting at the watermark is the only one who can move it.
+static inline void absorb_pending(log_metadata_t* metadata, uint64_t committed)
+{
+    bool found = true;
+    while (found) {
+        found = false;
+        for (size_t i = 0; i < MMLOG_PENDING_COMMITS; i++) {
+            mmlog_pending_t* pending = &metadata->pending[i];
+            if (!claim_pending(pending, committed)) {
+                continue;
+            }
+            committed = atomic_load(&pending->end);
+            atomic_store(&pending->start, 0);
+            atomic_store(&metadata->committed, committed);
+            found = true;
+        }
+    }
+}
+
+// Puts back a claimed range.  If the watermark caught up with it in the meantime, nobody else is going to absorb it.
+static inline void release_pending(log_metadata_t* metadata, mmlog_pending_t* pending, uint64_t start)
+{
+    atomic_store(&pending->start, start);
+    if (atomic_load(&metadata->committed) == start && claim_pending(pending, start)) {
+        uint64_t end = atomic_load(&pending->end);
+        atomic_store(&pending->start, 0);
+        atomic_store(&metadata->committed, end);
+        absorb_pending(metadata, end);
+    }
+}
+
+// Finds a slot for [start, end), merging it with any parked neighbours so that a stalled writer only ever holds up one
+// slot no matter how much gets written after it.  Returns the slot (claimed), or NULL if every slot is taken; either way
+// the range may have grown.
+static inline mmlog_pending_t* park_range(log_metadata_t* metadata, uint64_t* start, uint64_t* end)
+{
+    // Soak up whatever was parked right after us
+    bool found = true;
+    while (found) {
+        found = false;
+        for (size_t i = 0; i < MMLOG_PENDING_COMMITS; i++) {
+            mmlog_pending_t* pending = &metadata->pending[i];
+            if (claim_pending(pending, *end)) {
+                *end = atomic_load(&pending->end);
+                atomic_store(&pending->start, 0);
+                found = true;
+            }
+        }
+    }
+
+    // Then tack ourselves onto whatever was parked right before us, or take a free slot
+    mmlog_pending_t* free_slot = NULL;
+    for (size_t i = 0; i < MMLOG_PENDING_COMMITS; i++) {
+        mmlog_pending_t* pending = &metadata->pending[i];
+        uint64_t pending_start = atomic_load(&pending->start);
+        if (!pending_start) {
+            free_slot = free_slot ? free_slot : pending;
+            continue;
+        }
+        if (LOG_CURSOR_INVALID == pending_start || atomic_load(&pending->end) != *start ||
+            !claim_pending(pending, pending_start)) {
+            continue;
+        }
+        if (atomic_load(&pending->end) != *start) {
+            release_pending(metadata, pending, pending_start);  // It changed before we got to it
+            continue;
+        }
+        *start = pending_start;
+        return pending;
+    }
+
+    uint64_t expected = 0;
+    if (free_slot && atomic_compare_exchange_strong(&free_slot->start, &expected, LOG_CURSOR_INVALID)) {
+        return free_slot;
+    }
+    return NULL;
+}
+
+// Moves the committed watermark past [start, end), which has been completely written.  Writes finish out of order, so
+// if somebody in front of us is still going, we park the range and leave it to them.  Only fails if the log panics
+// while we wait for a slot to park in.
+static inline bool commit_range(log_handle_t* handle, uint64_t start, uint64_t end)
+{
+    log_metadata_t* metadata = handle->metadata;
+    int64_t deadline = 0;
+    while (true) {
+        uint64_t expected = start;
+        if (atomic_compare_exchange_strong(&metadata->committed, &expected, end)) {
+            absorb_pending(metadata, end);
+            return true;
+        }
+
+        mmlog_pending_t* pending = park_range(metadata, &start, &end);
+        if (pending) {
+            atomic_store(&pending->end, end);
+            release_pending(metadata, pending, start);
+            return true;
+        }
+
+        // Every slot is held up by a different stalled writer.  Giving up would leave a hole that readers can never get
+        // past, so wait for one of them; but if none of them has finished within MMLOG_STALL_MS, they're dead, and the
+        // watermark isn't going anywhere until recovery.
+        int64_t now = ms_since_epoch_monotonic();
+        deadline = deadline ? deadline : now + MMLOG_STALL_MS;
+        if (atomic_load(&metadata->is_panicked) || now >= deadline) {
+            atomic_store(&metadata->is_panicked, true);
+            mmlog_errno = MMLOG_ERR_COMMIT_RANGE_STALLED;
+            return false;
+        }
+        sched_yield();
+    }
+}
+
+// Ring slots are updated by installers and cleaners alike, so always touch them through an atomic view
+static inline chunk_info_t* _Atomic* chunk_slot(chunk_buffer_t* chunks, uint64_t seq)
+{
+    return (chunk_info_t * _Atomic*)(chunks->buffer + (seq % chunks->capacity));
+}
+
+// Takes a reference on a chunk, unless the chunk is dead.  A chunk whose refcount has reached zero is never revived;
+// it can only be cleaned, retired and eventually recycled.
+static inline bool chunk_tryget(chunk_info_t* chunk)
+{
+    uint32_t refs = atomic_load(&chunk->ref_count);
+    while (refs > 0 && refs < CHUNK_REF_CLEANING) {
+        if (atomic_compare_exchange_weak(&chunk->ref_count, &refs, refs + 1)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Pops a descriptor off of the free list.  If the pool has run dry (lots of writers stuck behind the ring), fall back to
+// the heap.
+static inline chunk_info_t* chunk_alloc(chunk_buffer_t* chunks)
+{
+    uint64_t head = atomic_load(&chunks->free_list);
+    while ((uint32_t)head) {
+        chunk_info_t* chunk = &chunks->pool[(uint32_t)head - 1];
+        uint64_t next = ((head >> 32) + 1) << 32 | atomic_load(&chunk->next_free);
+        if (atomic_compare_exchange_weak(&chunks->free_list, &head, next)) {
+            chunk->is_untracked = false;
+            chunk->start_offset = 0;
+            chunk->size = 0;
+            chunk->mapping = NULL;
+            atomic_store(&chunk->ref_count, 0);
+            return chunk;
+        }
+    }
+    return (chunk_info_t*)calloc(1, sizeof(chunk_info_t));
+}
+
+static inline void chunk_free(chunk_buffer_t* chunks, chunk_info_t* chunk)
+{
+    uintptr_t pos = (uintptr_t)chunk - (uintptr_t)chunks->pool;
+    if (pos >= (uintptr_t)chunks->pool_size * sizeof(chunk_info_t)) {
+        free(chunk);
+        return;
+    }
+
+    uint32_t index = pos / sizeof(chunk_info_t) + 1;
+    uint64_t head = atomic_load(&chunks->free_list);
+    do {
+        atomic_store(&chunk->next_free, (uint32_t)head);
+    } while (!atomic_compare_exchange_weak(&chunks->free_list, &head, ((head >> 32) + 1) << 32 | index));
+}
+
+static inline void chunk_writeback(log_handle_t* handle, const chunk_info_t* chunk);
+
+static inline bool clean_chunks(log_handle_t* handle)
+{
+    // Attempts to clean up any unused chunks in the ring buffer, starting from the tail
+    // Chunks are unusued if they are not the head and their refcount is 0
+    // This type of property checking is done in a few steps
+    // 1. Atomic acquisition of the current tail
+    // 2. Verification that this snapshot has certain properties
+    // 3. "Take" the chunk by moving its refcount from 0 to CHUNK_REF_CLEANING, then take the tail via CAS
+    // 4. If successful, clean it up and repeat.
+    // 5. If not, then repeat anyway
+    // 6. Stop if the current tail cannot be cleaned (e.g., it is the head or it has a nonzero refcount)
+    // Since head and tail are monotonic sequence numbers, a stale snapshot can never win the tail CAS.
+    mmlog_errno = MMLOG_ERR_OK;
+    if (!handle || !handle->chunks.buffer) {
+        mmlog_errno = MMLOG_ERR_CLEAN_CHUNKS_EINVAL;
+        return false;  // Invalid chunk buffer
+    }
+    chunk_buffer_t* chunks = &handle->chunks;
+
+    while (true) {
+        // Get the current tail and head positions atomically
+        uint64_t tail = atomic_load(&chunks->tail);
+        uint64_t head = atomic_load(&chunks->head);
+
+        // No matter what, if head==tail we don't have to clean anything up
+        if (tail == head) {
+            // No chunks to clean
+            return true;
+        }
+
+        // Get the chunk at the tail position
+        chunk_info_t* tail_chunk = atomic_load(chunk_slot(chunks, tail));
+        if (tail_chunk == CHUNK_PENDING) {
+            break;  // No chunk to clean
+        }
+
+        // Retired slots can just be skipped over
+        if (atomic_load(&tail_chunk->ref_count) == CHUNK_REF_RETIRED) {
+            atomic_compare_exchange_strong(&chunks->tail, &tail, tail + 1);
+            continue;
+        }
+
+        // Check if chunk can be cleaned
+        uint32_t refs = 0;
+        if (!atomic_compare_exchange_strong(&tail_chunk->ref_count, &refs, CHUNK_REF_CLEANING)) {
+            break;  // Also no chunk to clean
+        }
+
+        // Attempt to update the tail pointer atomically
+        if (atomic_compare_exchange_strong(&chunks->tail, &tail, tail + 1)) {
+            // Success - clean up the chunk, leaving the descriptor in place for the next chunk in this slot
+            chunk_writeback(handle, tail_chunk);
+            munmap(tail_chunk->mapping, tail_chunk->size);
+            tail_chunk->mapping = NULL;
+            atomic_store(&tail_chunk->ref_count, CHUNK_REF_RETIRED);
+            waitq_wake(&chunks->rollover, false);
+        } else {
+            // Failed to update tail pointer, another thread changed it
+            // Put the chunk back the way we found it and try again from the beginning
+            atomic_store(&tail_chunk->ref_count, 0);
+            continue;
+        }
+    }
+
+    return true;
+}
+
+static inline uint32_t mmlog_cross_count(uint64_t start, size_t size, uint32_t chunk_size)
+{
+    uint64_t end = start + size;
+
+    // Calculate the chunk indices for the start and end positions
+    uint64_t start_chunk_index = start / chunk_size;
+    uint64_t end_chunk_index = end / chunk_size;
+    return end_chunk_index - start_chunk_index;
+}
+
+// Maps part of the data file for writing.  Huge pages can only back a mapping where the address and the file offset
+// are both aligned to the huge page size, and mmap() only promises base page alignment, so in that mode we reserve
+// enough address space to find an aligned start, map over it and hand back the rest.
+static inline void* data_mmap(log_handle_t* handle, size_t size, int fd, uint64_t file_offset, int flags)
+{
+    if (!(handle->metadata->flags & MMLOG_FLAG_HUGEPAGES)) {
+        return mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | flags, fd, file_offset);
+    }
+
+    size_t reserved = size + MMLOG_HUGE_PAGE_SIZE;
+    uint8_t* area = (uint8_t*)mmap(NULL, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (MAP_FAILED == area) {
+        return MAP_FAILED;
+    }
+    uint8_t* start = (uint8_t*)ALIGN((uintptr_t)area, (uintptr_t)MMLOG_HUGE_PAGE_SIZE);
+
+    // Populating has to wait for the advice, or the pages come in small
+    void* mapping = mmap(start, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED | (flags & ~MAP_POPULATE), fd,
+                         file_offset);
+    if (MAP_FAILED == mapping) {
+        munmap(area, reserved);
+        return MAP_FAILED;
+    }
+    if (start > area) {
+        munmap(area, start - area);
+    }
+    munmap(start + size, area + reserved - (start + size));
+    madvise(mapping, size, MADV_HUGEPAGE);
+    if (flags & MAP_POPULATE) {
+        madvise(mapping, size, MADV_POPULATE_WRITE);
+    }
+    return mapping;
+}
+
+// Maps the chunk containing the cursor into an existing descriptor
+inline static bool map_chunk_at_cursor(log_handle_t* handle, chunk_info_t* chunk, uint64_t cursor)
+{
+    mmlog_errno = MMLOG_ERR_OK;
+
+    // Initialize the chunk for this cursor position
+    chunk->start_offset = (cursor / handle->metadata->chunk_size) * handle->metadata->chunk_size;
+    chunk->size = handle->metadata->chunk_size;
+    uint64_t file_offset;
+    int fd = data_fd_get(handle, chunk->start_offset, &file_offset);
+    if (-1 == fd) {
+        // callee sets errno
+        chunk->mapping = NULL;
+        return false;
+    }
+    chunk->mapping = data_mmap(handle, chunk->size, fd, file_offset, 0);
+    data_fd_put(handle, fd);
+
+    if (MAP_FAILED == chunk->mapping) {
+        mmlog_errno = MMLOG_ERR_CREATE_CHUNK_AT_CURSOR_MMAP;
+        chunk->mapping = NULL;
+        return false;
+    }
+    return true;
+}
+
+inline static chunk_info_t* create_chunk_at_cursor(log_handle_t* handle, uint64_t cursor)
+{
+    mmlog_errno = MMLOG_ERR_OK;
+    chunk_info_t* chunk = chunk_alloc(&handle->chunks);
+    if (!chunk) {
+        mmlog_errno = MMLOG_ERR_CREATE_CHUNK_AT_CURSOR_ENOMEM;
+        return NULL;
+    }
+
+    if (!map_chunk_at_cursor(handle, chunk, cursor)) {
+        // callee sets errno
+        chunk_free(&handle->chunks, chunk);
+        return NULL;
+    }
+
+    atomic_store(&chunk->ref_count, 1);
+    return chunk;
+}
+
+// With MMLOG_DURABILITY_ASYNC, kicks off writeback of a chunk which is about to be unmapped.  This is what
+// msync(MS_ASYNC) was meant for, but on Linux that's a no-op; sync_file_range() actually queues the I/O.
+static inline void chunk_writeback(log_handle_t* handle, const chunk_info_t* chunk)
+{
+    if (MMLOG_DURABILITY_ASYNC == atomic_load(&handle->durability)) {
+        uint64_t file_offset;
+        int fd = data_fd_get(handle, chunk->start_offset, &file_offset);
+        if (-1 != fd) {
+            syscall(SYS_sync_file_range, fd, (off_t)file_offset, (off_t)chunk->size, SYNC_FILE_RANGE_WRITE);
+            data_fd_put(handle, fd);
+        }
+    }
+}
+
+static inline void chunk_discard(chunk_buffer_t* chunks, chunk_info_t* chunk)
+{
+    munmap(chunk->mapping, chunk->size);
+    chunk_free(chunks, chunk);
+}
+
+// Maps a chunk for the prefetch helper, faulting every page in for writing.  MAP_POPULATE alone only gets the pages
+// mapped read-only, so without MADV_POPULATE_WRITE the first write to each page still takes a (minor) fault.
+static inline chunk_info_t* prefetch_map(log_handle_t* handle, uint64_t offset)
+{
+    chunk_info_t* chunk = chunk_alloc(&handle->chunks);
+    if (!chunk) {
+        return NULL;
+    }
+
+    chunk->start_offset = offset;
+    chunk->size = handle->metadata->chunk_size;
+    uint64_t file_offset;
+    int fd = data_fd_get(handle, offset, &file_offset);
+    if (-1 == fd) {
+        chunk_free(&handle->chunks, chunk);
+        return NULL;
+    }
+    chunk->mapping = data_mmap(handle, chunk->size, fd, file_offset, MAP_POPULATE);
+    data_fd_put(handle, fd);
+    if (MAP_FAILED == chunk->mapping) {
+        chunk_free(&handle->chunks, chunk);
+        return NULL;
+    }
+    madvise(chunk->mapping, chunk->size, MADV_POPULATE_WRITE);
+    return chunk;
+}
+
+// Moves a prefetched mapping of the chunk containing the cursor into a ring descriptor, if the helper has one ready
+static inline bool prefetch_adopt(log_handle_t* handle, chunk_info_t* chunk, uint64_t cursor)
+{
+    mmlog_prefetch_t* prefetch = atomic_load(&handle->prefetch);
+    if (!prefetch) {
+        return false;
+    }
+
+    uint32_t chunk_size = handle->metadata->chunk_size;
+    uint64_t offset = cursor - cursor % chunk_size;
+    chunk_info_t* _Atomic* slot = &prefetch->spare[(offset / chunk_size) % MMLOG_PREFETCH_MAX];
+    chunk_info_t* spare = atomic_exchange(slot, NULL);
+    if (!spare) {
+        return false;
+    }
+    if (spare->start_offset != offset) {
+        // Somebody else's; put it back unless the helper has already refilled the slot
+        chunk_info_t* expected = NULL;
+        if (!atomic_compare_exchange_strong(slot, &expected, spare)) {
+            chunk_discard(&handle->chunks, spare);
+        }
+        return false;
+    }
+
+    chunk->start_offset = spare->start_offset;
+    chunk->size = spare->size;
+    chunk->mapping = spare->mapping;
+    chunk_free(&handle->chunks, spare);
+    return true;
+}
+
+// Helper to check if cursor is within chunk
+static inline bool is_cursor_in_chunk(const chunk_info_t* chunk, uint64_t cursor)
+{
+    return chunk && chunk != CHUNK_PENDING && chunk->start_offset <= cursor &&
+           cursor < chunk->start_offset + chunk->size;
+}
+
+// Takes a reference on the chunk in a ring slot, but only if that chunk covers the cursor.  Descriptors are recycled,
+// so nothing about the chunk can be trusted until we hold a reference to it.
+static inline chunk_info_t* try_checkout_slot(chunk_info_t* _Atomic* slot, uint64_t cursor)
+{
+    chunk_info_t* chunk = atomic_load(slot);
+    if (!chunk || chunk == CHUNK_PENDING || !chunk_tryget(chunk)) {
+        return NULL;
+    }
+    if (!is_cursor_in_chunk(chunk, cursor)) {
+        atomic_fetch_sub(&chunk->ref_count, 1);
+        return NULL;
+    }
+    return chunk;
+}
+
+// Releases a chunk obtained from mmlog_rb_checkout()
+static inline void mmlog_rb_release(log_handle_t* handle, chunk_info_t* chunk)
+{
+    if (chunk->is_untracked) {
+        // Nobody else can see this chunk, so it goes away with the last (only) user
+        chunk_writeback(handle, chunk);
+        chunk_discard(&handle->chunks, chunk);
+        return;
+    }
+    atomic_fetch_sub(&chunk->ref_count, 1);
+}
+
+// A chunk mapped for a single caller, outside of the ringbuffer
+static inline chunk_info_t* create_untracked_chunk(log_handle_t* handle, uint64_t cursor)
+{
+    chunk_info_t* chunk = create_chunk_at_cursor(handle, cursor);
+    if (chunk) {
+        chunk->is_untracked = true;
+    }
+    return chunk;
+}
+
+// Maps just the pages covering [start, start + size) for a single caller, for records which don't fit in one chunk
+static inline chunk_info_t* create_untracked_span(log_handle_t* handle, uint64_t start, uint64_t size)
+{
+    mmlog_errno = MMLOG_ERR_OK;
+    uint32_t page_size = handle->metadata->page_size;
+    chunk_info_t* chunk = chunk_alloc(&handle->chunks);
+    if (!chunk) {
+        mmlog_errno = MMLOG_ERR_CREATE_CHUNK_AT_CURSOR_ENOMEM;
+        return NULL;
+    }
+
+    chunk->start_offset = start - start % page_size;
+    chunk->size = ALIGN(start + size, (uint64_t)page_size) - chunk->start_offset;
+    uint64_t file_offset;
+    int fd = data_fd_get(handle, chunk->start_offset, &file_offset);
+    if (-1 == fd) {
+        // callee sets errno
+        chunk_free(&handle->chunks, chunk);
+        return NULL;
+    }
+    chunk->mapping = data_mmap(handle, chunk->size, fd, file_offset, 0);
+    data_fd_put(handle, fd);
+    if (MAP_FAILED == chunk->mapping) {
+        mmlog_errno = MMLOG_ERR_CREATE_CHUNK_AT_CURSOR_MMAP;
+        chunk_free(&handle->chunks, chunk);
+        return NULL;
+    }
+    chunk->is_untracked = true;
+    atomic_store(&chunk->ref_count, 1);
+    return chunk;
+}
+
+// Fallback for cursors which are behind the head.  This happens when a writer reserved a range and then stalled
+// while other writers moved the head forward.  If the old chunk is still live we use it, otherwise we map a chunk
+// just for this caller.
+static inline chunk_info_t* checkout_behind_head(log_handle_t* handle, uint64_t head, uint64_t cursor)
+{
+    chunk_buffer_t* chunks = &handle->chunks;
+    uint64_t tail = atomic_load(&chunks->tail);
+    for (uint64_t seq = head; seq > tail; seq--) {
+        chunk_info_t* chunk = try_checkout_slot(chunk_slot(chunks, seq - 1), cursor);
+        if (chunk) {
+            return chunk;
+        }
+    }
+
+    return create_untracked_chunk(handle, cursor);
+}
+
+typedef enum {
+    INSTALL_DONE,   // New head chunk is installed (or we failed for good)
+    INSTALL_RETRY,  // Somebody else is moving the head or cleaning the target slot
+    INSTALL_FULL,   // Every slot is held by a live chunk
+} install_result_t;
+
+// Advances the head to a new chunk containing the cursor.  This is the only place the head moves.  Writers race by
+// claiming the next slot with a CAS to CHUNK_PENDING; the winner maps the chunk and publishes it with a CAS on the head,
+// everybody else backs off and retries once the head has moved.
+static inline install_result_t add_new_chunk(log_handle_t* handle, uint64_t head, uint64_t cursor, chunk_info_t** out)
+{
+    mmlog_errno = MMLOG_ERR_OK;
+    chunk_buffer_t* chunks = &handle->chunks;
+    *out = NULL;
+
+    // Check if buffer is full, retry _one_ time
+    if (head + 1 - atomic_load(&chunks->tail) >= chunks->capacity) {
+        clean_chunks(handle);
+        if (head + 1 - atomic_load(&chunks->tail) >= chunks->capacity) {
+            // Still full after cleaning, so we can't add a new chunk
+            MMLOG_STAT_ADD(handle->metadata, ring_full, 1);
+            mmlog_errno = MMLOG_ERR_ADD_NEW_CHUNK_EWAIT;
+            return INSTALL_FULL;
+        }
+    }
+
+    // The next slot must hold a retired descriptor, and we have to be the one to claim it
+    chunk_info_t* _Atomic* next_slot = chunk_slot(chunks, head + 1);
+    chunk_info_t* old_chunk = atomic_load(next_slot);
+    if (old_chunk == CHUNK_PENDING || atomic_load(&old_chunk->ref_count) != CHUNK_REF_RETIRED ||
+        !atomic_compare_exchange_strong(next_slot, &old_chunk, CHUNK_PENDING)) {
+        return INSTALL_RETRY;
+    }
+
+    // The head may have moved (all the way around the ring) between our snapshot and the claim
+    if (atomic_load(&chunks->head) != head) {
+        atomic_store(next_slot, old_chunk);
+        waitq_wake(&chunks->rollover, false);
+        return INSTALL_RETRY;
+    }
+
+    // Create new chunk in the slot's retired descriptor
+    chunk_info_t* new_chunk = old_chunk;
+    if (!prefetch_adopt(handle, new_chunk, cursor) && !map_chunk_at_cursor(handle, new_chunk, cursor)) {
+        // Unmark the pending chunk; I guess this might create churn as other writers try the same thing
+        // TODO: probably a global failure state, like our panic state
+        // callee sets errno
+        atomic_store(next_slot, new_chunk);
+        waitq_wake(&chunks->rollover, false);
+        return INSTALL_DONE;
+    }
+
+    // One reference for the ring (as the head) and one for the caller
+    atomic_store(&new_chunk->ref_count, 2);
+    atomic_store(next_slot, new_chunk);
+
+    // Advance head pointer
+    if (!atomic_compare_exchange_strong(&chunks->head, &head, head + 1)) {
+        // This should _never_ happen because nobody else can advance the head without our slot
+    }
+
+    // The old head no longer needs the ring's reference (before the first chunk, there was no old head)
+    chunk_info_t* old_head = atomic_load(chunk_slot(chunks, head));
+    if (head && old_head != CHUNK_PENDING) {
+        atomic_fetch_sub(&old_head->ref_count, 1);
+    }
+    waitq_wake(&chunks->rollover, false);
+
+    *out = new_chunk;
+    return INSTALL_DONE;
+}
+
+typedef struct {
+    log_handle_t* handle;
+    uint64_t cursor;
+    chunk_info_t* chunk;
+} rb_checkout_args_t;
+
+static inline bool mmlog_rb_checkout_inner(void* arg)
+{
+    rb_checkout_args_t* args = (rb_checkout_args_t*)arg;
+    chunk_buffer_t* chunks = &args->handle->chunks;
+    uint64_t cursor = args->cursor;
+
+    // Somebody else may have done the work for us
+    uint64_t head = atomic_load(&chunks->head);
+    args->chunk = try_checkout_slot(chunk_slot(chunks, head), cursor);
+    if (args->chunk) {
+        return true;
+    }
+
+    // Figure out whether we're ahead of or behind the head (before the first chunk, the head is just a retired slot)
+    chunk_info_t* head_chunk = atomic_load(chunk_slot(chunks, head));
+    if (head_chunk == CHUNK_PENDING) {
+        MMLOG_STAT_ADD(args->handle->metadata, head_spins, 1);
+        return false;  // Our snapshot is stale, and the slot is already being reused
+    }
+    if (head) {
+        if (!chunk_tryget(head_chunk)) {
+            MMLOG_STAT_ADD(args->handle->metadata, head_spins, 1);
+            return false;  // The head moved out from under us
+        }
+        bool is_behind = cursor < head_chunk->start_offset;
+        atomic_fetch_sub(&head_chunk->ref_count, 1);
+        if (is_behind) {
+            args->chunk = checkout_behind_head(args->handle, head, cursor);
+            return true;  // callee sets errno
+        }
+    }
+
+    switch (add_new_chunk(args->handle, head, cursor, &args->chunk)) {
+        case INSTALL_DONE:
+            return true;  // callee sets errno
+        case INSTALL_RETRY:
+            MMLOG_STAT_ADD(args->handle->metadata, head_spins, 1);
+            return false;
+        case INSTALL_FULL:
+            // The oldest chunk is still held by some (probably descheduled) writer.  Rather than failing the insert,
+            // give this caller a chunk of its own; the ring will drain once that writer gets going again.
+            args->chunk = create_untracked_chunk(args->handle, cursor);
+            return true;
+    }
+    return false;
+}
+
+static inline chunk_info_t* mmlog_rb_checkout(log_handle_t* handle, uint64_t cursor)
+{
+    mmlog_errno = MMLOG_ERR_OK;
+
+    // Validate inputs
+    if (!handle || !handle->chunks.buffer) {
+        mmlog_errno = MMLOG_ERR_MMLOG_RB_CHECKOUT_EINVAL;
+        return NULL;
+    }
+
+    // If we fit inside of the head, we're done--this is the common case, and it takes no locks
+    chunk_buffer_t* chunks = &handle->chunks;
+    chunk_info_t* chunk = try_checkout_slot(chunk_slot(chunks, atomic_load(&chunks->head)), cursor);
+    if (chunk) {
+        return chunk;
+    }
+
+    // Otherwise we need to create or find a suitable chunk, which may mean waiting for another writer's rollover
+    rb_checkout_args_t args = {handle, cursor, NULL};
+    if (!waitq_wait_for_cond(mmlog_rb_checkout_inner, &args, &chunks->rollover, false, SLEEP_TIME_MAX_MS)) {
+        // Whoever is rolling over got descheduled; don't make the insert fail on their account
+        return create_untracked_chunk(handle, cursor);
+    }
+    // callee sets errno
+    return args.chunk;
+}
+
+static inline bool write_to_chunk(log_handle_t* handle, uint64_t cursor, const void* data, size_t size)
+{
+    mmlog_errno = MMLOG_ERR_OK;
+    chunk_info_t* chunk = mmlog_rb_checkout(handle, cursor);
+    if (!chunk) {
+        mmlog_errno = MMLOG_ERR_WRITE_TO_CHUNK_ECHUNK;
+        return false;  // Failed to checkout chunk
+    }
+
+    uint64_t chunk_offset = cursor - chunk->start_offset;
+    memcpy((char*)chunk->mapping + chunk_offset, data, size);
+    mmlog_rb_release(handle, chunk);
+    return true;
+}
+
+// Copies data into a range of the log which has already been checked out
+static inline bool write_range(log_handle_t* handle, uint64_t cursor, const void* data, size_t size)
+{
+    mmlog_errno = MMLOG_ERR_OK;
+    log_metadata_t* metadata = handle->metadata;
+
     // With this, we have a contiguous range to write to, but it needs to be in-memory for us to map it.  Consider a few
     // scenarios
     // 1. The data fits in a chunk (although it may cross up to one chunk boundary)--check/add to ringbuffer
@@ -770,43 +2411,1151 @@ bool mmlog_insert(log_handle_t* handle, const void* data, size_t size)
         // operation;
         //   so there is no point in using the ringbuffer--just map everything specifically for this operation
         // - If the span straddles a chunk in its entirety, then we also avoid using the ringbuffer
-        // Rather than hassling with mmap, let's just do a direct write to memory
-        // TODO signals?
-        if (size != (size_t)pwrite(handle->data_fd, data, size, cursor)) {
-            mmlog_errno = MMLOG_ERR_MMLOG_INSERT_PWRITE;
+        // Rather than hassling with mmap, let's just do a direct write to the file.  A one-off mapping of the span
+        // would avoid the syscall, but the mmap()/munmap() and per-page faults cost several times what the copy does,
+        // and running out of disk turns into a SIGBUS instead of an error.
+        uint64_t file_offset;
+        int fd = data_fd_get(handle, cursor, &file_offset);
+        if (-1 == fd) {
+            // callee sets errno
+            return false;
+        }
+        bool ok = pwrite_all(fd, data, size, file_offset);
+        data_fd_put(handle, fd);
+        MMLOG_STAT_ADD(metadata, pwrite_fallbacks, 1);
+        if (!ok) {
+            mmlog_errno = MMLOG_ERR_WRITE_RANGE_PWRITE;
             return false;  // Failed to write to chunk
         }
         return true;
-    } else {
-        // Handle 0 or 1 crossing by writing each portion to the appropriate chunk
-        uint64_t current_cursor = cursor;
-        size_t bytes_written = 0;
-
-        while (bytes_written < size) {
-            // Calculate chunk boundary
-            uint64_t chunk_end = ((current_cursor / metadata->chunk_size) + 1) * metadata->chunk_size;
-
-            // Calculate how much we can write in this chunk
-            size_t bytes_to_write = size - bytes_written;
-            if (current_cursor + bytes_to_write > chunk_end) {
-                bytes_to_write = chunk_end - current_cursor;
+    }
+
+    // Handle 0 or 1 crossing by writing each portion to the appropriate chunk
+    uint64_t current_cursor = cursor;
+    size_t bytes_written = 0;
+
+    while (bytes_written < size) {
+        // Calculate chunk boundary
+        uint64_t chunk_end = ((current_cursor / metadata->chunk_size) + 1) * metadata->chunk_size;
+
+        // Calculate how much we can write in this chunk
+        size_t bytes_to_write = size - bytes_written;
+        if (current_cursor + bytes_to_write > chunk_end) {
+            bytes_to_write = chunk_end - current_cursor;
+        }
+
+        // Write to this chunk
+        if (!write_to_chunk(handle, current_cursor, (const char*)data + bytes_written, bytes_to_write)) {
+            // callee sets errno
+            return false;
+        }
+
+        // Advance to next chunk
+        current_cursor += bytes_to_write;
+        bytes_written += bytes_to_write;
+    }
+    return true;
+}
+
+// Sets the magic of the frame (or skip record) at the cursor, making it visible to readers
+static inline bool publish_frame(log_handle_t* handle, uint64_t cursor, uint32_t magic)
+{
+    mmlog_errno = MMLOG_ERR_OK;
+    chunk_info_t* chunk = mmlog_rb_checkout(handle, cursor);
+    if (!chunk) {
+        mmlog_errno = MMLOG_ERR_PUBLISH_FRAME_ECHUNK;
+        return false;
+    }
+
+    // Frames are aligned, so the magic never straddles a chunk boundary
+    mmlog_frame_t* frame = (mmlog_frame_t*)((char*)chunk->mapping + (cursor - chunk->start_offset));
+    atomic_store_explicit(&frame->magic, magic, memory_order_release);
+    mmlog_rb_release(handle, chunk);
+    return true;
+}
+
+static inline bool write_frame(log_handle_t* handle, uint64_t cursor, const void* data, size_t size, uint64_t sequence)
+{
+    mmlog_errno = MMLOG_ERR_OK;
+    mmlog_frame_t frame = {0};
+    frame.length = (uint32_t)size;
+    frame.sequence = sequence;
+
+    // The length goes in as soon as we have somewhere to put it, so that if we die before the end, recovery can still
+    // step over the record.  The rest of the header and the payload follow, and the magic is left as zero until all of
+    // that is in place.
+    const size_t body = offsetof(mmlog_frame_t, length);
+    const char* header = (const char*)&frame + body;
+    if (0 == mmlog_cross_count(cursor, mmlog_frame_size(size), handle->metadata->chunk_size)) {
+        // Common case: the whole frame is in one chunk, so only check it out once
+        chunk_info_t* chunk = mmlog_rb_checkout(handle, cursor);
+        if (!chunk) {
+            mmlog_errno = MMLOG_ERR_WRITE_FRAME_ECHUNK;
+            return false;
+        }
+        mmlog_frame_t* dst = (mmlog_frame_t*)((char*)chunk->mapping + (cursor - chunk->start_offset));
+        dst->length = frame.length;
+        frame.crc = mmlog_frame_crc(frame.sequence, frame.length, data);
+        memcpy((char*)dst + body, header, sizeof(frame) - body);
+        memcpy(dst + 1, data, size);
+        atomic_store_explicit(&dst->magic, MMLOG_FRAME_MAGIC, memory_order_release);
+        mmlog_rb_release(handle, chunk);
+        return true;
+    }
+
+    if (!write_range(handle, cursor + body, &frame.length, sizeof(frame.length))) {
+        // callee sets errno
+        return false;
+    }
+    frame.crc = mmlog_frame_crc(frame.sequence, frame.length, data);
+    if (!write_range(handle, cursor + body, header, sizeof(frame) - body) ||
+        !write_range(handle, cursor + sizeof(frame), data, size)) {
+        // callee sets errno
+        return false;
+    }
+    return publish_frame(handle, cursor, MMLOG_FRAME_MAGIC);
+}
+
+// mmlog_frame_crc() for a payload in pieces
+static inline uint32_t iov_crc(const mmlog_frame_t* frame, const struct iovec* iov, int iovcnt)
+{
+    uint32_t crc = mmlog_crc32c(mmlog_crc32c(0, &frame->sequence, sizeof(frame->sequence)), &frame->length,
+                                sizeof(frame->length));
+    for (int i = 0; i < iovcnt; i++) {
+        crc = mmlog_crc32c(crc, iov[i].iov_base, iov[i].iov_len);
+    }
+    return crc;
+}
+
+// Like write_frame() (or write_range(), for raw logs), but the record is gathered from `size` bytes worth of fragments
+static inline bool write_iov(log_handle_t* handle, uint64_t cursor, const struct iovec* iov, int iovcnt, size_t size)
+{
+    mmlog_errno = MMLOG_ERR_OK;
+    bool framed = handle->metadata->flags & MMLOG_FLAG_FRAMED;
+    mmlog_frame_t frame = {0};
+    size_t offset = 0;
+    if (framed) {
+        frame.length = (uint32_t)size;
+        frame.sequence = atomic_fetch_add(&handle->metadata->sequence, 1);
+        offset = sizeof(frame);
+    }
+
+    // Same order as write_frame(): the length, then everything else, then the magic
+    const size_t body = offsetof(mmlog_frame_t, length);
+    const char* header = (const char*)&frame + body;
+    if (0 == mmlog_cross_count(cursor, framed ? mmlog_frame_size(size) : size, handle->metadata->chunk_size)) {
+        // Common case: the whole record is in one chunk, so only check it out once
+        chunk_info_t* chunk = mmlog_rb_checkout(handle, cursor);
+        if (!chunk) {
+            mmlog_errno = MMLOG_ERR_WRITE_IOV_ECHUNK;
+            return false;
+        }
+        char* dst = (char*)chunk->mapping + (cursor - chunk->start_offset);
+        if (framed) {
+            ((mmlog_frame_t*)dst)->length = frame.length;
+            frame.crc = iov_crc(&frame, iov, iovcnt);
+        }
+        for (int i = 0; i < iovcnt; i++) {
+            if (iov[i].iov_len) {
+                memcpy(dst + offset, iov[i].iov_base, iov[i].iov_len);
+                offset += iov[i].iov_len;
+            }
+        }
+        if (framed) {
+            memcpy(dst + body, header, sizeof(frame) - body);
+            atomic_store_explicit(&((mmlog_frame_t*)dst)->magic, MMLOG_FRAME_MAGIC, memory_order_release);
+        }
+        mmlog_rb_release(handle, chunk);
+        return true;
+    }
+
+    if (framed) {
+        if (!write_range(handle, cursor + body, &frame.length, sizeof(frame.length))) {
+            // callee sets errno
+            return false;
+        }
+        frame.crc = iov_crc(&frame, iov, iovcnt);
+        if (!write_range(handle, cursor + body, header, sizeof(frame) - body)) {
+            // callee sets errno
+            return false;
+        }
+    }
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len && !write_range(handle, cursor + offset, iov[i].iov_base, iov[i].iov_len)) {
+            // callee sets errno
+            return false;
+        }
+        offset += iov[i].iov_len;
+    }
+    return !framed || publish_frame(handle, cursor, MMLOG_FRAME_MAGIC);
+}
+
+// Writes records back to back from the cursor, holding on to each chunk for as long as the records stay in it.  The
+// sequence numbers were handed out to the whole batch at once, starting at `sequence`.
+static inline bool write_batch(log_handle_t* handle, uint64_t cursor, const struct iovec* records, size_t count,
+                               uint64_t sequence)
+{
+    mmlog_errno = MMLOG_ERR_OK;
+    bool framed = handle->metadata->flags & MMLOG_FLAG_FRAMED;
+    uint32_t chunk_size = handle->metadata->chunk_size;
+    chunk_info_t* chunk = NULL;
+    bool ok = true;
+    for (size_t i = 0; ok && i < count; i++) {
+        const void* data = records[i].iov_base;
+        size_t size = records[i].iov_len;
+        uint64_t span = framed ? mmlog_frame_size(size) : size;
+        if (chunk && cursor + span > chunk->start_offset + chunk->size) {
+            mmlog_rb_release(handle, chunk);
+            chunk = NULL;
+        }
+        if (mmlog_cross_count(cursor, span, chunk_size)) {
+            // Straddles a chunk boundary, which the single-record paths already know how to deal with
+            ok = framed ? write_frame(handle, cursor, data, size, sequence + i)
+                        : write_range(handle, cursor, data, size);
+            cursor += span;
+            continue;
+        }
+
+        if (!chunk && !(chunk = mmlog_rb_checkout(handle, cursor))) {
+            mmlog_errno = MMLOG_ERR_WRITE_BATCH_ECHUNK;
+            return false;
+        }
+
+        char* dst = (char*)chunk->mapping + (cursor - chunk->start_offset);
+        if (framed) {
+            mmlog_frame_t* frame = (mmlog_frame_t*)dst;
+            frame->length = (uint32_t)size;
+            frame->sequence = sequence + i;
+            frame->crc = mmlog_frame_crc(frame->sequence, frame->length, data);
+            memcpy(frame + 1, data, size);
+            atomic_store_explicit(&frame->magic, MMLOG_FRAME_MAGIC, memory_order_release);
+        } else {
+            memcpy(dst, data, size);
+        }
+        cursor += span;
+    }
+    if (chunk) {
+        mmlog_rb_release(handle, chunk);
+    }
+    return ok;
+}
+
+// Pads out [start, end) with a skip record, if there's room for one.  In framed logs, readers key off of the magic, so
+// it has to go in last.
+static inline void write_skip(log_handle_t* handle, uint64_t start, uint64_t end)
+{
+    if (end - start < sizeof(mmlog_skip_t)) {
+        return;
+    }
+    mmlog_skip_t skip = {MMLOG_SKIP_MAGIC, (uint32_t)(end - start)};
+    if (handle->metadata->flags & MMLOG_FLAG_FRAMED) {
+        if (write_to_chunk(handle, start + sizeof(skip.magic), &skip.length, sizeof(skip.length))) {
+            publish_frame(handle, start, skip.magic);
+        }
+    } else {
+        write_range(handle, start, &skip, sizeof(skip));
+    }
+}
+
+// Notes padding in a raw log's hole list, for readers to step over.  It has to be there before the range is committed.
+static inline void note_hole(log_handle_t* handle, uint64_t start, uint64_t end)
+{
+    log_metadata_t* metadata = handle->metadata;
+    if ((metadata->flags & MMLOG_FLAG_FRAMED) || start == end) {
+        return;  // Skip records are enough
+    }
+    mmlog_hole_t hole = {start, end};
+    uint64_t i = atomic_fetch_add(&metadata->holes, 1);
+    pwrite_all(handle->metadata_fd, &hole, sizeof(hole), sizeof(log_metadata_t) + i * sizeof(hole));
+}
+
+// Gives up on a record whose range has been checked out but couldn't be written.  The range is ours all the same, so
+// it gets padded out and committed like any other; otherwise the watermark would never get past it.
+static inline void abandon_range(log_handle_t* handle, uint64_t cursor, uint64_t span)
+{
+    mmlog_err_t err = mmlog_errno;  // The caller wants to report why the write failed, not how the padding went
+    write_skip(handle, cursor, cursor + span);
+    note_hole(handle, cursor, cursor + span);
+    commit_range(handle, cursor, cursor + span);
+    mmlog_errno = err;
+}
+
+static inline void slab_retire(log_handle_t* handle, mmlog_slab_t* slab)
+{
+    uint64_t pos = slab->pos;
+    uint64_t end = slab->end;
+    slab->pos = slab->end = 0;
+    if (pos == end) {
+        return;  // All used up, or there was no slab
+    }
+
+    // If nobody has reserved anything since, just hand the tail back.  Otherwise pad it out; the records in front of
+    // it have been committed already, so it's all that stands between them and whatever comes after.
+    uint64_t expected = end;
+    if (!atomic_compare_exchange_strong(&handle->metadata->cursor, &expected, pos)) {
+        write_skip(handle, pos, end);
+        note_hole(handle, pos, end);
+        commit_range(handle, pos, end);
+    }
+}
+
+// Runs when a thread exits, so that a thread which never flushed doesn't hold up the log forever.  Once the handle is
+// closed its key is gone, and this doesn't get called anymore.
+static void slab_destroy(void* arg)
+{
+    mmlog_slab_t* slab = (mmlog_slab_t*)arg;
+    if (slab->fork_generation == atomic_load(&mmlog_fork_generation)) {
+        slab_retire(slab->handle, slab);
+    }
+    free(slab);
+}
+
+bool mmlog_set_slab_size(log_handle_t* handle, size_t slab_size)
+{
+    // Opts the handle into per-thread slab reservation.  Must be called before the handle is shared between threads.
+    // Records are visible as soon as they're written, but the unused part of a thread's slab holds back every record
+    // after it until the slab is retired, so threads should call mmlog_slab_flush() when they go idle.  Slabs are
+    // retired on their own when threads exit.
+    mmlog_errno = MMLOG_ERR_OK;
+    // Framed logs need every record (including the skip records we pad slabs with) to stay aligned
+    bool framed = handle && (handle->metadata->flags & MMLOG_FLAG_FRAMED);
+    if (!handle || handle->slab_size || slab_size < sizeof(mmlog_skip_t) || slab_size > UINT32_MAX ||
+        (framed && slab_size % MMLOG_FRAME_ALIGN) ||
+        (handle->metadata->segments.size && slab_size > segment_capacity(handle->metadata))) {
+        mmlog_errno = MMLOG_ERR_MMLOG_SET_SLAB_SIZE_EINVAL;
+        return false;
+    }
+
+    if (thrd_success != tss_create(&handle->slab_key, slab_destroy)) {
+        mmlog_errno = MMLOG_ERR_MMLOG_SET_SLAB_SIZE_TSS;
+        return false;
+    }
+    call_once(&mmlog_atfork_once, mmlog_atfork_register);
+    handle->slab_size = slab_size;
+    return true;
+}
+
+void mmlog_slab_flush(log_handle_t* handle)
+{
+    // Retires the calling thread's slab, if it has one
+    mmlog_errno = MMLOG_ERR_OK;
+    if (!handle || !handle->slab_size) {
+        return;
+    }
+    mmlog_slab_t* slab = (mmlog_slab_t*)tss_get(handle->slab_key);
+    if (slab && slab->fork_generation == atomic_load(&mmlog_fork_generation)) {
+        slab_retire(handle, slab);
+    }
+}
+
+static inline uint64_t slab_checkout(log_handle_t* handle, size_t size)
+{
+    mmlog_slab_t* slab = (mmlog_slab_t*)tss_get(handle->slab_key);
+    if (!slab) {
+        slab = (mmlog_slab_t*)calloc(1, sizeof(mmlog_slab_t));
+        if (!slab || thrd_success != tss_set(handle->slab_key, slab)) {
+            free(slab);
+            mmlog_errno = MMLOG_ERR_SLAB_CHECKOUT_ENOMEM;
+            return LOG_CURSOR_INVALID;
+        }
+        slab->handle = handle;
+        slab->fork_generation = atomic_load(&mmlog_fork_generation);
+    }
+
+    // If we've been forked, the slab is still being filled by the parent; forget about it
+    uint32_t fork_generation = atomic_load(&mmlog_fork_generation);
+    if (slab->fork_generation != fork_generation) {
+        slab->fork_generation = fork_generation;
+        slab->pos = slab->end = 0;
+    }
+
+    if (slab->end - slab->pos < size) {
+        slab_retire(handle, slab);
+        uint64_t start = mmlog_checkout(handle, handle->slab_size);
+        if (LOG_CURSOR_INVALID == start) {
+            // callee sets errno
+            return LOG_CURSOR_INVALID;
+        }
+        slab->pos = start;
+        slab->end = start + handle->slab_size;
+    }
+
+    uint64_t start = slab->pos;
+    slab->pos += size;
+    return start;
+}
+
+typedef struct {
+    log_handle_t* handle;
+    mmlog_prefetch_t* prefetch;
+} prefetch_args_t;
+
+// There's more to do once the cursor has moved into another chunk
+static inline bool prefetch_is_behind(void* arg)
+{
+    prefetch_args_t* args = (prefetch_args_t*)arg;
+    uint64_t index = atomic_load(&args->handle->metadata->cursor) / args->handle->metadata->chunk_size;
+    return atomic_load(&args->prefetch->stop) || index != args->prefetch->last;
+}
+
+// Makes sure the file covers, and the spares hold, the next `ahead` chunks past the cursor
+static inline void prefetch_fill(log_handle_t* handle, mmlog_prefetch_t* prefetch)
+{
+    uint32_t chunk_size = handle->metadata->chunk_size;
+    uint64_t segment_size = handle->metadata->segments.size;
+    uint64_t cursor = atomic_load(&handle->metadata->cursor);
+    prefetch->last = cursor / chunk_size;
+    for (uint64_t index = prefetch->last + 1; index <= prefetch->last + prefetch->ahead; index++) {
+        uint64_t offset = index * chunk_size;
+        uint32_t i = index % MMLOG_PREFETCH_MAX;
+        if (segment_size && offset / segment_size != cursor / segment_size) {
+            return;  // Rolling over early would throw off the segment's age
+        }
+        if (atomic_load(&prefetch->spare[i]) && prefetch->filled[i] == offset) {
+            continue;
+        }
+
+        // Whatever is in the slot now is for a chunk the writers are done with
+        chunk_info_t* chunk = atomic_exchange(&prefetch->spare[i], NULL);
+        if (chunk) {
+            chunk_discard(&handle->chunks, chunk);
+        }
+        if (!data_file_expand(handle, offset + chunk_size) || !(chunk = prefetch_map(handle, offset))) {
+            return;  // Writers can still do it themselves
+        }
+
+        chunk_info_t* expected = NULL;
+        if (atomic_compare_exchange_strong(&prefetch->spare[i], &expected, chunk)) {
+            prefetch->filled[i] = offset;
+        } else {
+            chunk_discard(&handle->chunks, chunk);
+        }
+    }
+}
+
+static void* prefetch_routine(void* arg)
+{
+    log_handle_t* handle = (log_handle_t*)arg;
+    prefetch_args_t args = {handle, atomic_load(&handle->prefetch)};
+    while (!atomic_load(&args.prefetch->stop)) {
+        prefetch_fill(handle, args.prefetch);
+
+        // Rollovers in this process wake us up; the timeout catches writers in other processes
+        waitq_wait_for_cond(prefetch_is_behind, &args, &handle->chunks.rollover, false, SLEEP_TIME_MAX_MS);
+    }
+    return NULL;
+}
+
+bool mmlog_set_prefetch(log_handle_t* handle, uint32_t chunks_ahead)
+{
+    // Starts a helper thread which keeps the data file grown and the next `chunks_ahead` chunks mapped and faulted in,
+    // so writers crossing into a new chunk don't have to stop for fallocate(), mmap() and page faults.  Zero stops it.
+    // Can be called while the handle is in use, but not concurrently with itself.
+    mmlog_errno = MMLOG_ERR_OK;
+    if (!handle || chunks_ahead > MMLOG_PREFETCH_MAX) {
+        mmlog_errno = MMLOG_ERR_MMLOG_SET_PREFETCH_EINVAL;
+        return false;
+    }
+
+    mmlog_prefetch_t* prefetch = atomic_load(&handle->prefetch);
+    if (!prefetch) {
+        if (!chunks_ahead) {
+            return true;
+        }
+        prefetch = (mmlog_prefetch_t*)calloc(1, sizeof(mmlog_prefetch_t));
+        if (!prefetch) {
+            mmlog_errno = MMLOG_ERR_MMLOG_SET_PREFETCH_ENOMEM;
+            return false;
+        }
+        atomic_store(&handle->prefetch, prefetch);
+    }
+
+    // Stop the current helper, unless it was left behind in our parent
+    call_once(&mmlog_atfork_once, mmlog_atfork_register);
+    uint32_t fork_generation = atomic_load(&mmlog_fork_generation);
+    if (prefetch->ahead && prefetch->fork_generation == fork_generation) {
+        atomic_store(&prefetch->stop, true);
+        waitq_wake(&handle->chunks.rollover, false);
+        pthread_join(prefetch->thread, NULL);
+    }
+    prefetch->ahead = 0;
+    for (uint32_t i = 0; i < MMLOG_PREFETCH_MAX; i++) {
+        chunk_info_t* chunk = atomic_exchange(&prefetch->spare[i], NULL);
+        if (chunk) {
+            chunk_discard(&handle->chunks, chunk);
+        }
+    }
+    if (!chunks_ahead) {
+        return true;
+    }
+
+    atomic_store(&prefetch->stop, false);
+    prefetch->fork_generation = fork_generation;
+    prefetch->ahead = chunks_ahead;
+    if (0 != pthread_create(&prefetch->thread, NULL, prefetch_routine, handle)) {
+        prefetch->ahead = 0;
+        mmlog_errno = MMLOG_ERR_MMLOG_SET_PREFETCH_THREAD;
+        return false;
+    }
+    return true;
+}
+
+// Moves the durable watermark up to `end`, unless somebody already got it further
+static inline void advance_durable(log_metadata_t* metadata, uint64_t end)
+{
+    uint64_t durable = atomic_load(&metadata->durable);
+    while (durable < end && !atomic_compare_exchange_weak(&metadata->durable, &durable, end)) {
+    }
+    waitq_wake(&metadata->synced, true);
+}
+
+// Flushes everything committed so far.  A failed fdatasync() may have dropped dirty pages on the floor, so there's no
+// telling what made it to disk; the log can't promise anything from here on.
+static inline bool sync_committed(log_handle_t* handle)
+{
+    log_metadata_t* metadata = handle->metadata;
+    uint64_t committed = atomic_load(&metadata->committed);
+    uint64_t segment_size = metadata->segments.size;
+    bool ok = true;
+    if (!segment_size) {
+        ok = 0 == fdatasync(handle->data_fd);
+    } else if (committed) {
+        // Every segment written to since the last sync; the ones which have been retired since don't matter
+        for (uint64_t segment = atomic_load(&metadata->durable) / segment_size;
+             ok && segment <= (committed - 1) / segment_size; segment++) {
+            int fd = segment_open(handle->filename, segment, O_RDWR);
+            if (-1 == fd) {
+                ok = ENOENT == errno;
+                continue;
+            }
+            ok = 0 == fdatasync(fd);
+            close(fd);
+        }
+    }
+    if (!ok) {
+        atomic_store(&metadata->is_panicked, true);
+        waitq_wake(&metadata->synced, true);
+        return false;
+    }
+    advance_durable(metadata, committed);
+    return true;
+}
+
+typedef struct {
+    log_handle_t* handle;
+    mmlog_syncer_t* syncer;
+    uint64_t end;
+} syncer_args_t;
+
+static inline bool syncer_is_needed(void* arg)
+{
+    syncer_args_t* args = (syncer_args_t*)arg;
+    return atomic_load(&args->syncer->stop) ||
+           atomic_load(&args->syncer->requested) > atomic_load(&args->handle->metadata->durable);
+}
+
+static void* syncer_routine(void* arg)
+{
+    log_handle_t* handle = (log_handle_t*)arg;
+    log_metadata_t* metadata = handle->metadata;
+    syncer_args_t args = {handle, atomic_load(&handle->syncer), 0};
+    while (!atomic_load(&args.syncer->stop) && !atomic_load(&metadata->is_panicked)) {
+        if (atomic_load(&metadata->committed) > atomic_load(&metadata->durable)) {
+            sync_committed(handle);
+        }
+
+        // Everybody who asks while we're in fdatasync() shares the next one
+        waitq_wait_for_cond(syncer_is_needed, &args, &args.syncer->wake, false, args.syncer->interval_ms);
+    }
+    return NULL;
+}
+
+static inline bool syncer_is_running(log_handle_t* handle, mmlog_syncer_t* syncer)
+{
+    return syncer && MMLOG_DURABILITY_GROUP == atomic_load(&handle->durability) && !atomic_load(&syncer->stop) &&
+           syncer->fork_generation == atomic_load(&mmlog_fork_generation);
+}
+
+bool mmlog_set_durability(log_handle_t* handle, uint32_t durability, uint32_t interval_ms)
+{
+    // Picks how hard this handle works to get the log onto disk.  interval_ms only matters for MMLOG_DURABILITY_GROUP,
+    // where it bounds how long committed records can sit in the page cache.  Can be called while the handle is in use,
+    // but not concurrently with itself.
+    mmlog_errno = MMLOG_ERR_OK;
+    if (!handle || durability > MMLOG_DURABILITY_GROUP || (MMLOG_DURABILITY_GROUP == durability && !interval_ms)) {
+        mmlog_errno = MMLOG_ERR_MMLOG_SET_DURABILITY_EINVAL;
+        return false;
+    }
+
+    mmlog_syncer_t* syncer = atomic_load(&handle->syncer);
+    if (!syncer && MMLOG_DURABILITY_GROUP == durability) {
+        syncer = (mmlog_syncer_t*)calloc(1, sizeof(mmlog_syncer_t));
+        if (!syncer) {
+            mmlog_errno = MMLOG_ERR_MMLOG_SET_DURABILITY_ENOMEM;
+            return false;
+        }
+        atomic_store(&syncer->stop, true);
+        atomic_store(&handle->syncer, syncer);
+    }
+
+    // Stop the current sync thread, unless it was left behind in our parent
+    call_once(&mmlog_atfork_once, mmlog_atfork_register);
+    uint32_t fork_generation = atomic_load(&mmlog_fork_generation);
+    if (syncer && !atomic_load(&syncer->stop)) {
+        atomic_store(&syncer->stop, true);
+        if (syncer->fork_generation == fork_generation) {
+            waitq_wake(&syncer->wake, false);
+            pthread_join(syncer->thread, NULL);
+        }
+    }
+    atomic_store(&handle->durability, durability);
+    if (MMLOG_DURABILITY_GROUP != durability) {
+        return true;
+    }
+
+    syncer->fork_generation = fork_generation;
+    syncer->interval_ms = interval_ms;
+    atomic_store(&syncer->stop, false);
+    if (0 != pthread_create(&syncer->thread, NULL, syncer_routine, handle)) {
+        atomic_store(&syncer->stop, true);
+        atomic_store(&handle->durability, MMLOG_DURABILITY_NONE);
+        mmlog_errno = MMLOG_ERR_MMLOG_SET_DURABILITY_THREAD;
+        return false;
+    }
+    return true;
+}
+
+static inline bool is_durable(void* arg)
+{
+    syncer_args_t* args = (syncer_args_t*)arg;
+    log_metadata_t* metadata = args->handle->metadata;
+    return atomic_load(&metadata->durable) >= args->end || atomic_load(&metadata->is_panicked) ||
+           !syncer_is_running(args->handle, args->syncer);
+}
+
+bool mmlog_sync(log_handle_t* handle, uint64_t end)
+{
+    // Blocks until the log is on disk up to `end` (or MMLOG_SYNC_ALL, for everything committed so far), which has to
+    // have been committed already.  With MMLOG_DURABILITY_GROUP this waits on the sync thread, so concurrent callers
+    // share an fdatasync(); otherwise the caller does its own.
+    mmlog_errno = MMLOG_ERR_OK;
+    log_metadata_t* metadata = handle ? handle->metadata : NULL;
+    if (metadata && MMLOG_SYNC_ALL == end) {
+        end = atomic_load(&metadata->committed);
+    }
+    if (!metadata || end > atomic_load(&metadata->committed)) {
+        mmlog_errno = MMLOG_ERR_MMLOG_SYNC_EINVAL;
+        return false;
+    }
+
+    syncer_args_t args = {handle, atomic_load(&handle->syncer), end};
+    if (syncer_is_running(handle, args.syncer)) {
+        uint64_t requested = atomic_load(&args.syncer->requested);
+        while (requested < end && !atomic_compare_exchange_weak(&args.syncer->requested, &requested, end)) {
+        }
+        waitq_wake(&args.syncer->wake, false);
+        while (!is_durable(&args)) {
+            waitq_wait_for_cond(is_durable, &args, &metadata->synced, true, SLEEP_TIME_MAX_MS);
+        }
+    }
+
+    // Either there's no sync thread, or it went away while we were waiting
+    while (atomic_load(&metadata->durable) < end && !atomic_load(&metadata->is_panicked)) {
+        if (!sync_committed(handle)) {
+            mmlog_errno = MMLOG_ERR_MMLOG_SYNC_FDATASYNC;
+            return false;
+        }
+    }
+    if (atomic_load(&metadata->durable) < end) {
+        mmlog_errno = MMLOG_ERR_MMLOG_SYNC_PANICKED;
+        return false;
+    }
+    return true;
+}
+
+static inline bool write_all(int fd, const void* data, size_t size)
+{
+    for (size_t done = 0; done < size;) {
+        ssize_t written = write(fd, (const char*)data + done, size - done);
+        if (written < 0 && EINTR != errno) {
+            return false;
+        }
+        done += written > 0 ? written : 0;
+    }
+    return true;
+}
+
+// Compressed segments are cut into blocks of this size (the last one may be short), so readers can decompress just the
+// blocks they're reading
+static inline uint32_t compress_block_size(const log_metadata_t* metadata)
+{
+    return metadata->chunk_size < MMLOG_LZ4_BLOCK_MAX ? metadata->chunk_size : MMLOG_LZ4_BLOCK_MAX;
+}
+
+// Writes out a sealed segment as an LZ4 frame with a block per chunk, then swaps it in for the original.  Readers look
+// for the original first, so there's never a moment where neither is there.  The frame is followed by a skippable frame
+// (which LZ4 tools pass over) holding the file offset of each block, plus that of the end mark; its size follows from
+// the segment's, so readers find it by counting back from the end of the file.
+static inline bool compress_segment(log_handle_t* handle, uint64_t segment)
+{
+    log_metadata_t* metadata = handle->metadata;
+    uint64_t segment_size = metadata->segments.size;
+    uint32_t block_size = compress_block_size(metadata);
+    uint64_t blocks = (segment_size + block_size - 1) / block_size;
+    size_t index_size = 8 + 8 * (blocks + 1);
+    char raw_path[PATH_MAX];
+    char tmp_path[PATH_MAX];
+    char path[PATH_MAX];
+    if (!segment_path(raw_path, handle->filename, segment, "") ||
+        !segment_path(tmp_path, handle->filename, segment, ".lz4.tmp") ||
+        !segment_path(path, handle->filename, segment, ".lz4")) {
+        return false;
+    }
+
+    int fd = open(raw_path, O_RDONLY);
+    if (-1 == fd) {
+        return false;  // Already retired
+    }
+    const uint8_t* src = (const uint8_t*)mmap(NULL, segment_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == src) {
+        return false;
+    }
+    madvise((void*)src, segment_size, MADV_SEQUENTIAL);
+
+    uint8_t* index = (uint8_t*)malloc(index_size);
+    uint8_t* block = (uint8_t*)malloc(4 + block_size);
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool ok = index && block && -1 != fd;
+    uint64_t offset = 0;
+    if (ok) {
+        size_t header_size = lz4_frame_header(block, block_size, segment_size);
+        ok = write_all(fd, block, header_size);
+        offset += header_size;
+    }
+    for (uint64_t i = 0; ok && i < blocks; i++) {
+        uint64_t pos = i * block_size;
+        size_t size = segment_size - pos < block_size ? segment_size - pos : block_size;
+        size_t packed = lz4_compress_block(src + pos, size, block + 4, size - 1);
+        if (!packed) {
+            memcpy(block + 4, src + pos, size);
+        }
+        lz4_write32(block, packed ? (uint32_t)packed : (uint32_t)size | 0x80000000);
+        lz4_write32(index + 8 + 8 * i, (uint32_t)offset);
+        lz4_write32(index + 12 + 8 * i, (uint32_t)(offset >> 32));
+        ok = write_all(fd, block, 4 + (packed ? packed : size));
+        offset += 4 + (packed ? packed : size);
+    }
+    if (ok) {
+        lz4_write32(block, 0);
+        ok = write_all(fd, block, 4);
+        lz4_write32(index, MMLOG_LZ4_INDEX_MAGIC);
+        lz4_write32(index + 4, (uint32_t)(index_size - 8));
+        lz4_write32(index + 8 + 8 * blocks, (uint32_t)offset);
+        lz4_write32(index + 12 + 8 * blocks, (uint32_t)(offset >> 32));
+        ok = ok && write_all(fd, index, index_size);
+    }
+    if (ok && MMLOG_DURABILITY_NONE != atomic_load(&handle->durability)) {
+        ok = 0 == fdatasync(fd);
+    }
+    if (-1 != fd) {
+        close(fd);
+    }
+    free(block);
+    free(index);
+    munmap((void*)src, segment_size);
+
+    if (!ok || 0 != rename(tmp_path, path)) {
+        unlink(tmp_path);
+        return false;
+    }
+    unlink(raw_path);
+
+    // Retention may have gone through while we were at it
+    if (atomic_load(&metadata->first_segment) > segment) {
+        unlink(path);
+    }
+    return true;
+}
+
+// Claims the oldest segment which has been sealed and fully committed, but not compressed yet
+static inline bool compressor_claim(log_metadata_t* metadata, uint64_t* segment, bool claim)
+{
+    uint64_t next = atomic_load(&metadata->compress_next);
+    while (next < atomic_load(&metadata->segment) &&
+           atomic_load(&metadata->committed) >= (next + 1) * metadata->segments.size) {
+        if (!claim || atomic_compare_exchange_weak(&metadata->compress_next, &next, next + 1)) {
+            *segment = next;
+            return true;
+        }
+    }
+    return false;
+}
+
+typedef struct {
+    log_handle_t* handle;
+    mmlog_compressor_t* compressor;
+} compressor_args_t;
+
+static inline bool compressor_is_needed(void* arg)
+{
+    compressor_args_t* args = (compressor_args_t*)arg;
+    uint64_t segment;
+    return atomic_load(&args->compressor->stop) || compressor_claim(args->handle->metadata, &segment, false);
+}
+
+static void* compressor_routine(void* arg)
+{
+    log_handle_t* handle = (log_handle_t*)arg;
+    log_metadata_t* metadata = handle->metadata;
+    compressor_args_t args = {handle, atomic_load(&handle->compressor)};
+    while (!atomic_load(&args.compressor->stop)) {
+        uint64_t segment;
+        while (!atomic_load(&args.compressor->stop) && compressor_claim(metadata, &segment, true)) {
+            if (segment >= atomic_load(&metadata->first_segment)) {
+                compress_segment(handle, segment);  // If it fails, the segment just stays as it is
+            }
+        }
+
+        // Segments are sealed by whoever rolls the log over, which may well be another process
+        waitq_wait_for_cond(compressor_is_needed, &args, &args.compressor->wake, false, MMLOG_COMPRESS_INTERVAL_MS);
+    }
+    return NULL;
+}
+
+bool mmlog_set_compression(log_handle_t* handle, bool enabled)
+{
+    // Starts (or stops) a thread which compresses segments once they've been sealed and fully committed, so that only
+    // the newest ones take up their full size on disk.  Inserts are unaffected, and readers decompress older segments
+    // transparently.  It only takes one handle with compression on (in any process) to compress the whole log.
+    mmlog_errno = MMLOG_ERR_OK;
+    if (!handle || !handle->metadata->segments.size) {
+        mmlog_errno = MMLOG_ERR_MMLOG_SET_COMPRESSION_EINVAL;
+        return false;
+    }
+
+    mmlog_compressor_t* compressor = atomic_load(&handle->compressor);
+    if (!compressor && enabled) {
+        compressor = (mmlog_compressor_t*)calloc(1, sizeof(mmlog_compressor_t));
+        if (!compressor) {
+            mmlog_errno = MMLOG_ERR_MMLOG_SET_COMPRESSION_ENOMEM;
+            return false;
+        }
+        atomic_store(&compressor->stop, true);
+        atomic_store(&handle->compressor, compressor);
+    }
+
+    // Stop the current compressor thread, unless it was left behind in our parent
+    call_once(&mmlog_atfork_once, mmlog_atfork_register);
+    uint32_t fork_generation = atomic_load(&mmlog_fork_generation);
+    if (compressor && !atomic_load(&compressor->stop)) {
+        atomic_store(&compressor->stop, true);
+        if (compressor->fork_generation == fork_generation) {
+            waitq_wake(&compressor->wake, false);
+            pthread_join(compressor->thread, NULL);
+        }
+    }
+    if (!enabled) {
+        return true;
+    }
+
+    compressor->fork_generation = fork_generation;
+    atomic_store(&compressor->stop, false);
+    if (0 != pthread_create(&compressor->thread, NULL, compressor_routine, handle)) {
+        atomic_store(&compressor->stop, true);
+        mmlog_errno = MMLOG_ERR_MMLOG_SET_COMPRESSION_THREAD;
+        return false;
+    }
+    return true;
+}
+
+// Large records would waste too much of a slab, so they go straight to the shared cursor
+static inline uint64_t record_checkout(log_handle_t* handle, size_t size)
+{
+    return handle->slab_size && size <= handle->slab_size / 2 ? slab_checkout(handle, size)
+                                                              : mmlog_checkout(handle, size);
+}
+
+bool mmlog_insert(log_handle_t* handle, const void* data, size_t size)
+{
+    mmlog_errno = MMLOG_ERR_OK;
+
+    if (!handle || !data || size == 0) {
+        mmlog_errno = MMLOG_ERR_MMLOG_INSERT_EINVAL;
+        return false;
+    }
+
+    bool framed = handle->metadata->flags & MMLOG_FLAG_FRAMED;
+    if (framed && size > UINT32_MAX) {
+        mmlog_errno = MMLOG_ERR_MMLOG_INSERT_EINVAL;
+        return false;
+    }
+
+    uint64_t start = mmlog_cycles();
+    size_t span = framed ? mmlog_frame_size(size) : size;
+    uint64_t cursor = record_checkout(handle, span);
+    if (LOG_CURSOR_INVALID == cursor) {
+        // callee sets errno
+        return false;
+    }
+
+    uint64_t sequence = framed ? atomic_fetch_add(&handle->metadata->sequence, 1) : 0;
+    if (!(framed ? write_frame(handle, cursor, data, size, sequence) : write_range(handle, cursor, data, size))) {
+        // callee sets errno
+        abandon_range(handle, cursor, span);
+        return false;
+    }
+
+    if (!commit_range(handle, cursor, cursor + span)) {
+        // callee sets errno
+        return false;
+    }
+
+    // Check if we need to clean up chunks
+    clean_chunks(handle);
+
+    stats_insert(handle->metadata, 1, size, (mmlog_cycles() - start) | 1);
+    return true;
+}
+
+bool mmlog_insertv(log_handle_t* handle, const struct iovec* iov, int iovcnt)
+{
+    // Inserts the fragments as a single record, as if they'd been concatenated first.  Readers never see one without
+    // the others, and it only costs one checkout.
+    mmlog_errno = MMLOG_ERR_OK;
+
+    if (!handle || !iov || iovcnt <= 0) {
+        mmlog_errno = MMLOG_ERR_MMLOG_INSERTV_EINVAL;
+        return false;
+    }
+
+    size_t size = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if ((!iov[i].iov_base && iov[i].iov_len) || iov[i].iov_len > SIZE_MAX - size) {
+            mmlog_errno = MMLOG_ERR_MMLOG_INSERTV_EINVAL;
+            return false;
+        }
+        size += iov[i].iov_len;
+    }
+
+    bool framed = handle->metadata->flags & MMLOG_FLAG_FRAMED;
+    if (size == 0 || (framed && size > UINT32_MAX)) {
+        mmlog_errno = MMLOG_ERR_MMLOG_INSERTV_EINVAL;
+        return false;
+    }
+
+    uint64_t start = mmlog_cycles();
+    size_t span = framed ? mmlog_frame_size(size) : size;
+    uint64_t cursor = record_checkout(handle, span);
+    if (LOG_CURSOR_INVALID == cursor) {
+        // callee sets errno
+        return false;
+    }
+
+    if (!write_iov(handle, cursor, iov, iovcnt, size)) {
+        // callee sets errno
+        abandon_range(handle, cursor, span);
+        return false;
+    }
+
+    if (!commit_range(handle, cursor, cursor + span)) {
+        // callee sets errno
+        return false;
+    }
+
+    // Check if we need to clean up chunks
+    clean_chunks(handle);
+
+    stats_insert(handle->metadata, 1, size, (mmlog_cycles() - start) | 1);
+    return true;
+}
+
+bool mmlog_insert_batch(log_handle_t* handle, const struct iovec* records, size_t count)
+{
+    // Inserts each of the `count` buffers as a record of its own, in order and back to back.  The whole batch takes a
+    // single reservation, each chunk it lands in gets checked out once, and the ring is only cleaned up at the end.  In
+    // segmented logs a batch may have to be split across segments, in which case it takes a reservation per segment.
+    mmlog_errno = MMLOG_ERR_OK;
+
+    if (!handle || !records || count == 0) {
+        mmlog_errno = MMLOG_ERR_MMLOG_INSERT_BATCH_EINVAL;
+        return false;
+    }
+
+    bool framed = handle->metadata->flags & MMLOG_FLAG_FRAMED;
+    for (size_t i = 0; i < count; i++) {
+        if (!records[i].iov_base || !records[i].iov_len || (framed && records[i].iov_len > UINT32_MAX)) {
+            mmlog_errno = MMLOG_ERR_MMLOG_INSERT_BATCH_EINVAL;
+            return false;
+        }
+    }
+
+    uint64_t bytes = 0;
+    for (size_t i = 0; i < count; i++) {
+        bytes += records[i].iov_len;
+    }
+
+    uint64_t limit = handle->metadata->segments.size ? segment_capacity(handle->metadata) : UINT64_MAX;
+    for (size_t first = 0, last = 0; first < count; first = last) {
+        uint64_t span = 0;
+        for (; last < count; last++) {
+            uint64_t record = framed ? mmlog_frame_size(records[last].iov_len) : records[last].iov_len;
+            if (last > first && span + record > limit) {
+                break;
             }
+            span += record;
+        }
+
+        uint64_t cursor = record_checkout(handle, span);
+        if (LOG_CURSOR_INVALID == cursor) {
+            // callee sets errno
+            return false;
+        }
+
+        uint64_t sequence = framed ? atomic_fetch_add(&handle->metadata->sequence, last - first) : 0;
+        if (!write_batch(handle, cursor, records + first, last - first, sequence)) {
+            // callee sets errno; whatever did make it in is skipped along with the rest of this reservation
+            abandon_range(handle, cursor, span);
+            return false;
+        }
+
+        if (!commit_range(handle, cursor, cursor + span)) {
+            // callee sets errno
+            return false;
+        }
+    }
+
+    // Check if we need to clean up chunks
+    clean_chunks(handle);
+
+    stats_insert(handle->metadata, count, bytes, 0);
+    return true;
+}
+
+void* mmlog_reserve(log_handle_t* handle, size_t size, mmlog_reservation_t* reservation)
+{
+    // Reserves room for a record and returns a pointer to where its payload goes.  The chunk behind it can't be
+    // recycled until mmlog_commit(), so don't hang on to reservations.
+    mmlog_errno = MMLOG_ERR_OK;
+
+    if (!handle || !reservation || size == 0) {
+        mmlog_errno = MMLOG_ERR_MMLOG_RESERVE_EINVAL;
+        return NULL;
+    }
+
+    bool framed = handle->metadata->flags & MMLOG_FLAG_FRAMED;
+    if (framed && size > UINT32_MAX) {
+        mmlog_errno = MMLOG_ERR_MMLOG_RESERVE_EINVAL;
+        return NULL;
+    }
+
+    size_t span = framed ? mmlog_frame_size(size) : size;
+    uint64_t cursor = record_checkout(handle, span);
+    if (LOG_CURSOR_INVALID == cursor) {
+        // callee sets errno
+        return NULL;
+    }
+
+    // The caller needs the whole record to be contiguous, so if it doesn't fit in a chunk it gets a mapping of its own
+    uint32_t chunk_size = handle->metadata->chunk_size;
+    chunk_info_t* chunk = (cursor % chunk_size) + span <= chunk_size ? mmlog_rb_checkout(handle, cursor)
+                                                                      : create_untracked_span(handle, cursor, span);
+    if (!chunk) {
+        mmlog_errno = MMLOG_ERR_MMLOG_RESERVE_ECHUNK;
+        abandon_range(handle, cursor, span);
+        return NULL;
+    }
+
+    char* dst = (char*)chunk->mapping + (cursor - chunk->start_offset);
+    if (framed) {
+        // The length goes in right away, so that the record can be stepped over even if it's never committed
+        mmlog_frame_t* frame = (mmlog_frame_t*)dst;
+        frame->length = (uint32_t)size;
+        frame->sequence = atomic_fetch_add(&handle->metadata->sequence, 1);
+        dst = (char*)(frame + 1);
+    }
+
+    reservation->handle = handle;
+    reservation->chunk = chunk;
+    reservation->cursor = cursor;
+    reservation->size = size;
+    reservation->data = dst;
+    return dst;
+}
+
+bool mmlog_commit(mmlog_reservation_t* reservation)
+{
+    // Publishes a record obtained from mmlog_reserve()
+    mmlog_errno = MMLOG_ERR_OK;
+
+    if (!reservation || !reservation->chunk) {
+        mmlog_errno = MMLOG_ERR_MMLOG_COMMIT_EINVAL;
+        return false;
+    }
 
-            // Write to this chunk
-            if (!write_to_chunk(handle, current_cursor, (const char*)data + bytes_written, bytes_to_write)) {
-                // callee sets errno
-                return false;
-            }
+    log_handle_t* handle = reservation->handle;
+    size_t span = reservation->size;
+    if (handle->metadata->flags & MMLOG_FLAG_FRAMED) {
+        mmlog_frame_t* frame = (mmlog_frame_t*)reservation->data - 1;
+        frame->crc = mmlog_frame_crc(frame->sequence, frame->length, reservation->data);
+        atomic_store_explicit(&frame->magic, MMLOG_FRAME_MAGIC, memory_order_release);
+        span = mmlog_frame_size(reservation->size);
+    }
 
-            // Advance to next chunk
-            current_cursor += bytes_to_write;
-            bytes_written += bytes_to_write;
-        }
+    mmlog_rb_release(handle, reservation->chunk);
+    reservation->chunk = NULL;
+
+    if (!commit_range(handle, reservation->cursor, reservation->cursor + span)) {
+        // callee sets errno
+        return false;
     }
 
     // Check if we need to clean up chunks
-    clean_chunks(&handle->chunks);
+    clean_chunks(handle);
+
+    stats_insert(handle->metadata, 1, reservation->size, 0);
+    return true;
+}
+
+bool mmlog_abandon(mmlog_reservation_t* reservation)
+{
+    // Gives up on a record obtained from mmlog_reserve(), whatever state its payload is in.  It's turned into a skip
+    // record and committed, so readers step right over it.  In raw logs the bytes become a skip header followed by
+    // zeros, which is still what anybody reading the data files directly sees; readers go by the hole list instead.
+    mmlog_errno = MMLOG_ERR_OK;
+
+    if (!reservation || !reservation->chunk) {
+        mmlog_errno = MMLOG_ERR_MMLOG_ABANDON_EINVAL;
+        return false;
+    }
 
+    log_handle_t* handle = reservation->handle;
+    size_t span = reservation->size;
+    if (handle->metadata->flags & MMLOG_FLAG_FRAMED) {
+        // Skip records' length covers the whole record, header and padding included
+        span = mmlog_frame_size(reservation->size);
+        mmlog_frame_t* frame = (mmlog_frame_t*)reservation->data - 1;
+        frame->length = (uint32_t)span;
+        atomic_store_explicit(&frame->magic, MMLOG_SKIP_MAGIC, memory_order_release);
+    } else {
+        memset(reservation->data, 0, span);
+        if (span >= sizeof(mmlog_skip_t)) {
+            mmlog_skip_t skip = {MMLOG_SKIP_MAGIC, (uint32_t)span};
+            memcpy(reservation->data, &skip, sizeof(skip));
+        }
+    }
+
+    mmlog_rb_release(handle, reservation->chunk);
+    reservation->chunk = NULL;
+
+    note_hole(handle, reservation->cursor, reservation->cursor + span);
+    if (!commit_range(handle, reservation->cursor, reservation->cursor + span)) {
+        // callee sets errno
+        return false;
+    }
+
+    // Check if we need to clean up chunks
+    clean_chunks(handle);
     return true;
 }
 
@@ -820,13 +3569,593 @@ void mmlog_trim(log_handle_t* handle)
         return;
     }
 
+    // The prefetch helper would only grow the file right back
+    if (atomic_load(&handle->prefetch)) {
+        mmlog_set_prefetch(handle, 0);
+    }
+
     log_metadata_t* metadata = handle->metadata;
     uint64_t cursor = atomic_load(&metadata->cursor);
-    if (-1 == ftruncate(handle->data_fd, cursor)) {
+    if (metadata->segments.size && 0 == cursor % metadata->segments.size) {
+        return;  // The last segment is already exactly full, and the next one may not exist yet
+    }
+    uint64_t file_offset;
+    int fd = data_fd_get(handle, cursor, &file_offset);
+    int ret = -1 == fd ? -1 : ftruncate(fd, file_offset);
+    data_fd_put(handle, fd);
+    if (-1 == ret) {
         // Technically this is a failure, but I have no idea what to do since this is like an optional validation nobody
         // asked for
         mmlog_errno = MMLOG_ERR_MMLOG_TRIM_FTRUNCATE;
     }
 }
 
+// Waits out whoever still holds a reference on a ring chunk, then unmaps it.  References held by threads which didn't
+// survive a fork() will never be dropped, so inherited handles just take the mapping away.
+static inline void chunk_drain(chunk_info_t* chunk, bool inherited)
+{
+    if (atomic_load(&chunk->ref_count) == CHUNK_REF_RETIRED) {
+        return;
+    }
+    while (!inherited && atomic_load(&chunk->ref_count) != 0) {
+        sched_yield();
+    }
+    munmap(chunk->mapping, chunk->size);
+    chunk->mapping = NULL;
+    atomic_store(&chunk->ref_count, CHUNK_REF_RETIRED);
+}
+
+bool mmlog_close(log_handle_t* handle)
+{
+    // Stops the handle's helper threads, unmaps everything and closes its files; the log itself stays as it is.  With
+    // durability turned on, everything committed is synced first.  Other threads have to be done with the handle (and
+    // if they're still around, have called mmlog_slab_flush(), if slabs are on) before this is called.  Returns false if the final sync failed,
+    // but the handle is gone either way.
+    mmlog_errno = MMLOG_ERR_OK;
+    if (!handle) {
+        mmlog_errno = MMLOG_ERR_MMLOG_CLOSE_EINVAL;
+        return false;
+    }
+    bool inherited = handle->fork_generation != atomic_load(&mmlog_fork_generation);
+
+    if (handle->slab_size) {
+        mmlog_slab_flush(handle);
+        free(tss_get(handle->slab_key));
+        tss_set(handle->slab_key, NULL);
+        tss_delete(handle->slab_key);
+    }
+
+    // The helpers all hold on to the handle
+    uint32_t durability = atomic_load(&handle->durability);
+    mmlog_set_prefetch(handle, 0);
+    if (atomic_load(&handle->compressor)) {
+        mmlog_set_compression(handle, false);
+    }
+    mmlog_set_durability(handle, MMLOG_DURABILITY_NONE, 0);
+
+    // Drop the ring's reference on the head, then drain every slot
+    chunk_buffer_t* chunks = &handle->chunks;
+    chunk_info_t** buffer = atomic_load(&chunks->buffer);
+    uint64_t head = atomic_load(&chunks->head);
+    chunk_info_t* head_chunk = atomic_load(chunk_slot(chunks, head));
+    if (head && head_chunk != CHUNK_PENDING && atomic_load(&head_chunk->ref_count) != CHUNK_REF_RETIRED) {
+        atomic_fetch_sub(&head_chunk->ref_count, 1);
+    }
+    for (size_t i = 0; i < chunks->capacity; i++) {
+        chunk_info_t* chunk;
+        while (!inherited && CHUNK_PENDING == (chunk = atomic_load(chunk_slot(chunks, i)))) {
+            sched_yield();  // Somebody is still installing a chunk
+        }
+        chunk = atomic_load(chunk_slot(chunks, i));
+        if (chunk != CHUNK_PENDING) {
+            chunk_drain(chunk, inherited);
+        }
+    }
+
+    bool ok = true;
+    if (MMLOG_DURABILITY_NONE != durability && !inherited && !mmlog_sync(handle, MMLOG_SYNC_ALL)) {
+        mmlog_errno = MMLOG_ERR_MMLOG_CLOSE_SYNC;
+        ok = false;
+    }
+
+    // Unmapping the metadata matters as much as closing the fd: the mapping keeps the file description (and with it,
+    // our lock on the log) alive
+    munmap(handle->metadata, sizeof(log_metadata_t));
+    close(handle->metadata_fd);
+    if (-1 != handle->data_fd) {
+        close(handle->data_fd);
+    }
+    free(atomic_load(&handle->prefetch));
+    free(atomic_load(&handle->syncer));
+    free(atomic_load(&handle->compressor));
+    free(buffer);
+    free(chunks->pool);
+    free(handle->filename);
+    free(handle);
+    return ok;
+}
+
+bool mmlog_stats(log_handle_t* handle, mmlog_stats_t* stats)
+{
+    // Adds up the counters of every process writing to the log, not just this handle's
+    mmlog_errno = MMLOG_ERR_OK;
+    if (!handle || !stats) {
+        mmlog_errno = MMLOG_ERR_MMLOG_STATS_EINVAL;
+        return false;
+    }
+    stats_sum(handle->metadata, stats);
+    return true;
+}
+
+// Forgets the compressed segment being read, if any; its view is unmapped along with any other
+static inline void reader_close_compressed(mmlog_reader_t* reader)
+{
+    if (-1 != reader->lz4_fd) {
+        close(reader->lz4_fd);
+        reader->lz4_fd = -1;
+    }
+    free(reader->lz4_index);
+    reader->lz4_index = NULL;
+}
+
+static inline void reader_release(mmlog_reader_t* reader)
+{
+    reader_close_compressed(reader);
+    free(reader->lz4_block);
+    free(reader->holes);
+    if (reader->mapping) {
+        munmap((void*)reader->mapping, reader->mapping_size);
+    }
+    if (reader->metadata) {
+        munmap(reader->metadata, sizeof(log_metadata_t));
+    }
+    if (-1 != reader->data_fd) {
+        close(reader->data_fd);
+    }
+    if (-1 != reader->metadata_fd) {
+        close(reader->metadata_fd);
+    }
+    free(reader->filename);
+    free(reader);
+}
+
+mmlog_reader_t* mmlog_reader_open(const char* filename)
+{
+    // Opens an existing log for reading, starting at the beginning
+    mmlog_errno = MMLOG_ERR_OK;
+    if (!filename || !*filename) {
+        mmlog_errno = MMLOG_ERR_MMLOG_READER_OPEN_EINVAL;
+        return NULL;
+    }
+
+    static const char* suffix = ".mmlog";
+    size_t meta_filename_len = strlen(filename) + strlen(suffix) + 1;
+    char* meta_filename = (char*)malloc(meta_filename_len);
+    mmlog_reader_t* reader = (mmlog_reader_t*)calloc(1, sizeof(mmlog_reader_t));
+    if (!meta_filename || !reader) {
+        mmlog_errno = MMLOG_ERR_MMLOG_READER_OPEN_ENOMEM;
+        free(meta_filename);
+        free(reader);
+        return NULL;
+    }
+    reader->metadata_fd = -1;
+    reader->data_fd = -1;
+    reader->lz4_fd = -1;
+    snprintf(meta_filename, meta_filename_len, "%s%s", filename, suffix);
+
+    struct stat st;
+    reader->metadata_fd = open(meta_filename, O_RDONLY);
+    if (-1 == reader->metadata_fd || 0 != fstat(reader->metadata_fd, &st) ||
+        (size_t)st.st_size < sizeof(log_metadata_t)) {
+        mmlog_errno = MMLOG_ERR_MMLOG_READER_OPEN_MDATA;
+        goto mmlog_reader_open_cleanup;
+    }
+
+    reader->metadata =
+        (log_metadata_t*)mmap(NULL, sizeof(log_metadata_t), PROT_READ, MAP_SHARED, reader->metadata_fd, 0);
+    if (MAP_FAILED == reader->metadata) {
+        reader->metadata = NULL;
+        mmlog_errno = MMLOG_ERR_MMLOG_READER_OPEN_MDATA;
+        goto mmlog_reader_open_cleanup;
+    }
+
+    if (!atomic_load(&reader->metadata->is_ready) || reader->metadata->version != MMLOG_VERSION) {
+        mmlog_errno = MMLOG_ERR_MMLOG_READER_OPEN_VERSION;
+        goto mmlog_reader_open_cleanup;
+    }
+
+    // Segments are opened one at a time as the reader gets to them
+    reader->filename = strdup(filename);
+    if (!reader->filename) {
+        mmlog_errno = MMLOG_ERR_MMLOG_READER_OPEN_ENOMEM;
+        goto mmlog_reader_open_cleanup;
+    }
+    if (!reader->metadata->segments.size && -1 == (reader->data_fd = open(filename, O_RDONLY))) {
+        mmlog_errno = MMLOG_ERR_MMLOG_READER_OPEN_DATA;
+        goto mmlog_reader_open_cleanup;
+    }
+
+    free(meta_filename);
+    return reader;
+
+mmlog_reader_open_cleanup:
+    free(meta_filename);
+    reader_release(reader);
+    return NULL;
+}
+
+void mmlog_reader_close(mmlog_reader_t* reader)
+{
+    mmlog_errno = MMLOG_ERR_OK;
+    if (reader) {
+        reader_release(reader);
+    }
+}
+
+bool mmlog_reader_stats(mmlog_reader_t* reader, mmlog_stats_t* stats)
+{
+    // Like mmlog_stats(), for tools which only want to watch a log
+    mmlog_errno = MMLOG_ERR_OK;
+    if (!reader || !stats) {
+        mmlog_errno = MMLOG_ERR_MMLOG_READER_STATS_EINVAL;
+        return false;
+    }
+    stats_sum(reader->metadata, stats);
+    return true;
+}
+
+// Opens a compressed segment and reads in its block index, from the end of the file.  Returns an anonymous mapping the size of a segment for the
+// blocks to be decompressed into as they're read (see reader_inflate()), or NULL.
+static inline void* reader_open_compressed(mmlog_reader_t* reader, uint64_t segment, uint64_t segment_size)
+{
+    uint32_t block_size = compress_block_size(reader->metadata);
+    uint64_t blocks = (segment_size + block_size - 1) / block_size;
+    size_t index_size = 8 + 8 * (blocks + 1);
+    char path[PATH_MAX];
+    int fd = segment_path(path, reader->filename, segment, ".lz4") ? open(path, O_RDONLY) : -1;
+    uint8_t* index = (uint8_t*)malloc(index_size);
+    reader->lz4_index = (uint64_t*)malloc(sizeof(uint64_t) * (blocks + 1));
+    if (!reader->lz4_block) {
+        reader->lz4_block = (uint8_t*)malloc(4 + block_size);
+    }
+
+    void* mapping = MAP_FAILED;
+    struct stat st;
+    if (-1 != fd && index && reader->lz4_index && reader->lz4_block && 0 == fstat(fd, &st) &&
+        (uint64_t)st.st_size >= index_size &&
+        (ssize_t)index_size == pread(fd, index, index_size, st.st_size - (off_t)index_size) &&
+        MMLOG_LZ4_INDEX_MAGIC == lz4_read32(index) && index_size - 8 == lz4_read32(index + 4)) {
+        for (uint64_t i = 0; i <= blocks; i++) {
+            reader->lz4_index[i] = lz4_read32(index + 8 + 8 * i) | (uint64_t)lz4_read32(index + 12 + 8 * i) << 32;
+        }
+        mapping = mmap(NULL, segment_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    }
+    free(index);
+    reader->lz4_fd = fd;
+    if (MAP_FAILED == mapping) {
+        reader_close_compressed(reader);
+        return NULL;
+    }
+    return mapping;
+}
+
+// Makes sure the view holds [start, end) of a compressed segment, decompressing the blocks which cover it and dropping
+// the ones before them.  Nothing to do for segments which aren't compressed.
+static inline bool reader_inflate(mmlog_reader_t* reader, uint64_t start, uint64_t end)
+{
+    if (-1 == reader->lz4_fd || (start >= reader->inflated_start && end <= reader->inflated_end)) {
+        return true;
+    }
+
+    uint64_t segment_size = reader->metadata->segments.size;
+    uint32_t block_size = compress_block_size(reader->metadata);
+    uint8_t* view = (uint8_t*)reader->mapping;
+    uint64_t first = start - (start - reader->base) % block_size;
+    uint64_t drop_end = first;
+    if (first < reader->inflated_start || first > reader->inflated_end) {
+        drop_end = reader->inflated_end;  // Not where we left off, so start again from here
+        reader->inflated_end = first;
+    }
+    madvise(view + (reader->inflated_start - reader->base), drop_end - reader->inflated_start, MADV_DONTNEED);
+    reader->inflated_start = first;
+
+    while (reader->inflated_end < end) {
+        uint64_t pos = reader->inflated_end - reader->base;
+        uint64_t i = pos / block_size;
+        size_t size = segment_size - pos < block_size ? segment_size - pos : block_size;
+        uint64_t stored = reader->lz4_index[i + 1] - reader->lz4_index[i];
+        size_t produced = 0;
+        bool ok = stored >= 4 && stored <= 4 + (uint64_t)size &&
+                  (ssize_t)stored == pread(reader->lz4_fd, reader->lz4_block, stored, reader->lz4_index[i]) &&
+                  (lz4_read32(reader->lz4_block) & 0x7fffffff) == stored - 4;
+        if (ok && (lz4_read32(reader->lz4_block) & 0x80000000)) {
+            memcpy(view + pos, reader->lz4_block + 4, stored - 4);
+            produced = stored - 4;
+        } else if (ok) {
+            ok = lz4_decompress_block(reader->lz4_block + 4, stored - 4, view + pos, size, &produced);
+        }
+        if (!ok || produced != size) {
+            mmlog_errno = MMLOG_ERR_READER_INFLATE_BLOCK;
+            return false;
+        }
+        reader->inflated_end += size;
+    }
+    return true;
+}
+
+// Maps the whole segment containing the reader's position, first skipping ahead if it has been retired.  Compressed
+// segments get an empty view instead, which reader_inflate() fills in a block at a time.
+static inline bool reader_map_segment(mmlog_reader_t* reader)
+{
+    log_metadata_t* metadata = reader->metadata;
+    uint64_t segment_size = metadata->segments.size;
+    while (true) {
+        uint64_t first = atomic_load(&metadata->first_segment) * segment_size;
+        if (reader->pos < first) {
+            reader->pos = first;
+        }
+        uint64_t base = reader->pos - reader->pos % segment_size;
+        if (reader->mapping && reader->base == base) {
+            return true;
+        }
+
+        reader_close_compressed(reader);
+        int fd = segment_open(reader->filename, base / segment_size, O_RDONLY);
+        void* mapping = NULL;
+        if (-1 == fd) {
+            if (ENOENT != errno) {
+                mmlog_errno = MMLOG_ERR_READER_MAP_SEGMENT_OPEN;
+                return false;
+            }
+            mapping = reader_open_compressed(reader, base / segment_size, segment_size);
+            if (!mapping) {
+                if (atomic_load(&metadata->first_segment) * segment_size > base) {
+                    continue;  // Retired out from under us
+                }
+                mmlog_errno = MMLOG_ERR_READER_MAP_SEGMENT_INFLATE;
+                return false;
+            }
+        } else {
+            mapping = mmap(NULL, segment_size, PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);
+            if (MAP_FAILED == mapping) {
+                mmlog_errno = MMLOG_ERR_READER_MAP_MMAP;
+                return false;
+            }
+        }
+        if (reader->mapping) {
+            munmap((void*)reader->mapping, reader->mapping_size);
+        }
+        reader->mapping = (const char*)mapping;
+        reader->mapping_size = segment_size;
+        reader->base = base;
+        reader->data_end = 0;
+        reader->inflated_start = reader->inflated_end = base;
+        return true;
+    }
+}
+
+// Where the data in the raw segment being read ends, which its trailer says once the log has moved on from it.  A
+// segment whose trailer never got written (because the writer who sealed it crashed) is taken to be all data.
+static inline bool reader_data_end(mmlog_reader_t* reader, uint64_t* end)
+{
+    if (!reader->data_end) {
+        uint64_t capacity = segment_capacity(reader->metadata);
+        uint64_t trailer_pos = reader->base + capacity;
+        if (!reader_inflate(reader, trailer_pos, trailer_pos + MMLOG_SEGMENT_TRAILER)) {
+            // callee sets errno
+            return false;
+        }
+        uint64_t trailer;
+        memcpy(&trailer, reader->mapping + capacity, sizeof(trailer));
+        reader->data_end = reader->base + (trailer && trailer <= capacity ? trailer : capacity);
+    }
+    *end = reader->data_end;
+    return true;
+}
+
+// Adds padding to what the reader knows about, keeping it in order.  Entries may be seen more than once.
+static inline bool reader_add_hole(mmlog_reader_t* reader, mmlog_hole_t hole)
+{
+    size_t i = reader->hole_count;
+    for (; i && reader->holes[i - 1].start >= hole.start; i--) {
+        if (reader->holes[i - 1].start == hole.start) {
+            return true;
+        }
+    }
+    if (reader->hole_count == reader->hole_capacity) {
+        size_t capacity = reader->hole_capacity ? 2 * reader->hole_capacity : 16;
+        mmlog_hole_t* holes = (mmlog_hole_t*)realloc(reader->holes, capacity * sizeof(mmlog_hole_t));
+        if (!holes) {
+            return false;
+        }
+        reader->holes = holes;
+        reader->hole_capacity = capacity;
+    }
+    memmove(&reader->holes[i + 1], &reader->holes[i], (reader->hole_count - i) * sizeof(mmlog_hole_t));
+    reader->holes[i] = hole;
+    reader->hole_count++;
+    return true;
+}
+
+// Picks up whatever has been added to a raw log's hole list since last time.  An entry which is still blank gets looked
+// at again next time, along with everything after it (writers fill in their entries in any order).
+static inline bool reader_load_holes(mmlog_reader_t* reader)
+{
+    uint64_t count = atomic_load_explicit(&reader->metadata->holes, memory_order_acquire);
+    uint64_t blank = count;
+    mmlog_hole_t batch[64];
+    for (uint64_t i = reader->holes_seen; i < count;) {
+        size_t n = count - i < 64 ? count - i : 64;
+        ssize_t got =
+            pread(reader->metadata_fd, batch, n * sizeof(mmlog_hole_t), sizeof(log_metadata_t) + i * sizeof(mmlog_hole_t));
+        if (-1 == got) {
+            mmlog_errno = MMLOG_ERR_READER_LOAD_HOLES_READ;
+            return false;
+        }
+        n = (size_t)got / sizeof(mmlog_hole_t);
+        if (!n) {
+            blank = blank < i ? blank : i;  // Past the end of the file, so nothing there has been written yet
+            break;
+        }
+        for (size_t j = 0; j < n; j++) {
+            if (!batch[j].end) {
+                blank = blank < i + j ? blank : i + j;
+            } else if (batch[j].end > reader->pos && !reader_add_hole(reader, batch[j])) {
+                mmlog_errno = MMLOG_ERR_READER_LOAD_HOLES_ENOMEM;
+                return false;
+            }
+        }
+        i += n;
+    }
+    reader->holes_seen = blank;
+    return true;
+}
+
+// Makes sure the view covers [0, end).  The view is sized well past that, since mapping pages beyond the end of the file
+// is fine as long as nobody touches them, and that way we don't have to remap every time the log grows.
+static inline bool reader_map(mmlog_reader_t* reader, uint64_t end)
+{
+    if (reader->metadata->segments.size) {
+        return reader_map_segment(reader);
+    }
+    if (end <= reader->mapping_size) {
+        return true;
+    }
+
+    uint64_t size = ALIGN(2 * end, (uint64_t)reader->metadata->chunk_size);
+    void* mapping = mmap(NULL, size, PROT_READ, MAP_SHARED, reader->data_fd, 0);
+    if (MAP_FAILED == mapping) {
+        mmlog_errno = MMLOG_ERR_READER_MAP_MMAP;
+        return false;
+    }
+    if (reader->mapping) {
+        munmap((void*)reader->mapping, reader->mapping_size);
+    }
+    reader->mapping = (const char*)mapping;
+    reader->mapping_size = size;
+    return true;
+}
+
+bool mmlog_reader_next(mmlog_reader_t* reader, const void** data, size_t* size)
+{
+    // Gets the next record in a framed log, or everything committed since the last call otherwise (only as far as the
+    // end of the segment, or of the block in a compressed one).  Returns false if there's nothing new (mmlog_errno is
+    // MMLOG_ERR_OK) or on error.  The data is only valid until the next call.
+    mmlog_errno = MMLOG_ERR_OK;
+    if (!reader || !data || !size) {
+        mmlog_errno = MMLOG_ERR_MMLOG_READER_NEXT_EINVAL;
+        return false;
+    }
+
+    log_metadata_t* metadata = reader->metadata;
+    uint64_t committed = atomic_load_explicit(&metadata->committed, memory_order_acquire);
+    if (reader->pos >= committed) {
+        return false;
+    }
+    if (!reader_map(reader, committed)) {
+        // callee sets errno
+        return false;
+    }
+
+    if (!(metadata->flags & MMLOG_FLAG_FRAMED) && !reader_load_holes(reader)) {
+        // callee sets errno
+        return false;
+    }
+
+    // In segmented logs, the view only goes up to the end of the current segment, and sealed segments only up to the
+    // end of their data
+    while (!(metadata->flags & MMLOG_FLAG_FRAMED) && reader->pos < committed) {
+        if (!reader_map(reader, committed)) {
+            // callee sets errno
+            return false;
+        }
+        uint64_t end = reader->base + reader->mapping_size;
+        bool is_sealed = metadata->segments.size && committed >= end;
+        if (is_sealed && !reader_data_end(reader, &end)) {
+            // callee sets errno
+            return false;
+        }
+        if (committed < end) {
+            end = committed;
+        }
+
+        // Step over padding, and stop short of the next
+        size_t passed = 0;
+        while (passed < reader->hole_count && reader->holes[passed].end <= reader->pos) {
+            passed++;
+        }
+        if (passed) {
+            reader->hole_count -= passed;
+            memmove(reader->holes, reader->holes + passed, reader->hole_count * sizeof(mmlog_hole_t));
+        }
+        if (reader->hole_count && reader->holes[0].start <= reader->pos) {
+            reader->pos = reader->holes[0].end;
+            continue;
+        }
+        if (reader->hole_count && reader->holes[0].start < end) {
+            end = reader->holes[0].start;
+        }
+
+        if (reader->pos >= end) {
+            reader->pos = reader->base + reader->mapping_size;  // Nothing left in this segment but padding
+            continue;
+        }
+
+        // Compressed segments are handed out a block at a time
+        if (!reader_inflate(reader, reader->pos, reader->pos + 1)) {
+            // callee sets errno
+            return false;
+        }
+        if (-1 != reader->lz4_fd && reader->inflated_end < end) {
+            end = reader->inflated_end;
+        }
+        *data = reader->mapping + (reader->pos - reader->base);
+        *size = end - reader->pos;
+        reader->pos = end;
+        return true;
+    }
+
+    while (reader->pos < committed) {
+        if (!reader_map(reader, committed)) {
+            // callee sets errno
+            return false;
+        }
+        if (reader->pos >= committed) {
+            break;
+        }
+        if (!reader_inflate(reader, reader->pos, reader->pos + sizeof(mmlog_skip_t))) {
+            // callee sets errno
+            return false;
+        }
+        const mmlog_frame_t* frame = (const mmlog_frame_t*)(reader->mapping + (reader->pos - reader->base));
+        uint64_t span = mmlog_frame_span(frame);
+        if (!span || reader->pos + span > committed || reader->pos + span > reader->base + reader->mapping_size) {
+            // Everything below the watermark is supposed to be complete, so there's no way to go on from here
+            mmlog_errno = MMLOG_ERR_MMLOG_READER_NEXT_CORRUPT;
+            return false;
+        }
+
+        // Skips can be long, and there's no need to decompress what they cover
+        if (MMLOG_SKIP_MAGIC == atomic_load(&frame->magic)) {
+            reader->pos += span;
+            continue;
+        }
+        if (!reader_inflate(reader, reader->pos, reader->pos + span)) {
+            // callee sets errno
+            return false;
+        }
+        reader->pos += span;
+        if (!mmlog_frame_is_valid(frame)) {
+            // We've stepped over it, so the caller can carry on if they like
+            mmlog_errno = MMLOG_ERR_MMLOG_READER_NEXT_CRC;
+            return false;
+        }
+        *data = frame + 1;
+        *size = frame->length;
+        return true;
+    }
+    return false;
+}
+
 #undef SLEEP_TIME_MAX_MS
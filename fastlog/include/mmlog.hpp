@@ -0,0 +1,249 @@
+// C++17 wrapper around the FFI bindings.  mmlog.h itself is C11 and can't be included from C++, so this builds on
+// libmmlog.h and needs the mmlog static library.
+#pragma once
+#include <charconv>
+#include <cstring>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+#include "libmmlog.h"
+
+namespace mmlog {
+
+namespace detail {
+
+// Formats a single argument into `out`, or just measures it if `out` is null.  Numbers go through std::to_chars, so
+// there's no locale and no allocation.
+template <typename T>
+size_t format_arg(char* out, const T& value)
+{
+    std::string_view text;
+    char buffer[64];  // Enough for any integer, and for the shortest round-trip form of any double
+    if constexpr (std::is_same_v<T, bool>) {
+        text = value ? "true" : "false";
+    } else if constexpr (std::is_same_v<T, char>) {
+        text = std::string_view(&value, 1);
+    } else if constexpr (std::is_integral_v<T> || std::is_floating_point_v<T>) {
+        auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+        text = std::string_view(buffer, result.ptr - buffer);
+    } else {
+        static_assert(std::is_convertible_v<const T&, std::string_view>,
+                      "mmlog::Log::log() can only format numbers, bools, chars and strings");
+        text = value;
+    }
+    if (out) {
+        std::memcpy(out, text.data(), text.size());
+    }
+    return text.size();
+}
+
+template <typename T>
+size_t format_erased(char* out, const void* value)
+{
+    return format_arg(out, *static_cast<const T*>(value));
+}
+
+// A small subset of the fmt/std::format syntax: each "{}" takes the next argument, "{{" and "}}" are literal braces.
+// Placeholders beyond the last argument are left as they are.  Returns the formatted length; with a null `out`, that's
+// all it does.
+template <typename... Args>
+size_t format(char* out, std::string_view fmt, const Args&... args)
+{
+    using formatter_t = size_t (*)(char*, const void*);
+    const void* values[] = {&args..., nullptr};
+    formatter_t formatters[] = {&format_erased<Args>..., nullptr};
+
+    size_t size = 0;
+    size_t next = 0;
+    for (size_t i = 0; i < fmt.size(); i++) {
+        char c = fmt[i];
+        if ((c == '{' || c == '}') && i + 1 < fmt.size() && fmt[i + 1] == c) {
+            i++;
+        } else if (c == '{' && i + 1 < fmt.size() && fmt[i + 1] == '}' && next < sizeof...(Args)) {
+            size += formatters[next](out ? out + size : nullptr, values[next]);
+            next++;
+            i++;
+            continue;
+        }
+        if (out) {
+            out[size] = c;
+        }
+        size++;
+    }
+    return size;
+}
+
+}  // namespace detail
+
+// A record reserved with Log::reserve().  The chunk behind it can't be recycled until it's committed, and readers
+// can't get past it either.  Only commit() publishes it; one which is dropped without being committed is abandoned, so
+// that readers skip it rather than see a half-filled record.  In raw logs, the abandoned bytes stay in the data file as
+// a skip header and zeros; mmlog_reader_next() steps over them, but anything reading the file directly doesn't.
+class Reservation
+{
+  public:
+    Reservation() = default;
+
+    Reservation(const Reservation&) = delete;
+    Reservation& operator=(const Reservation&) = delete;
+
+    Reservation(Reservation&& other) noexcept
+        : reservation_(other.reservation_), data_(std::exchange(other.data_, nullptr))
+    {
+    }
+
+    Reservation& operator=(Reservation&& other) noexcept
+    {
+        if (this != &other) {
+            abandon();
+            reservation_ = other.reservation_;
+            data_ = std::exchange(other.data_, nullptr);
+        }
+        return *this;
+    }
+
+    ~Reservation()
+    {
+        abandon();
+    }
+
+    explicit operator bool() const
+    {
+        return data_ != nullptr;
+    }
+
+    char* data() const
+    {
+        return static_cast<char*>(data_);
+    }
+
+    size_t size() const
+    {
+        return data_ ? reservation_.size : 0;
+    }
+
+    // Publishes the record.  Does nothing (and returns false) if there's nothing to commit.
+    bool commit()
+    {
+        return std::exchange(data_, nullptr) && mmlog_commit(&reservation_);
+    }
+
+    // Gives up on the record, so readers skip it.  Does nothing (and returns false) if there's nothing to abandon.
+    bool abandon()
+    {
+        return std::exchange(data_, nullptr) && mmlog_abandon(&reservation_);
+    }
+
+  private:
+    friend class Log;
+
+    mmlog_reservation_t reservation_ = {};
+    void* data_ = nullptr;
+};
+
+// Owns a log handle.  Failures are reported the same way as in the C API: a false (or empty) return, with the reason
+// in error().
+class Log
+{
+  public:
+    Log() = default;
+
+    Log(const char* filename, size_t chunk_size, uint32_t chunk_count, uint32_t flags = 0)
+        : handle_(mmlog_open_ex(filename, chunk_size, chunk_count, flags))
+    {
+    }
+
+    Log(const Log&) = delete;
+    Log& operator=(const Log&) = delete;
+
+    Log(Log&& other) noexcept : handle_(std::exchange(other.handle_, nullptr))
+    {
+    }
+
+    Log& operator=(Log&& other) noexcept
+    {
+        if (this != &other) {
+            close();
+            handle_ = std::exchange(other.handle_, nullptr);
+        }
+        return *this;
+    }
+
+    ~Log()
+    {
+        close();
+    }
+
+    explicit operator bool() const
+    {
+        return handle_ != nullptr;
+    }
+
+    // For the parts of the C API which aren't wrapped
+    log_handle_t* handle() const
+    {
+        return handle_;
+    }
+
+    static const char* error()
+    {
+        return mmlog_strerror_cur();
+    }
+
+    // False if the final sync failed; the handle is gone either way
+    bool close()
+    {
+        return !handle_ || mmlog_close(std::exchange(handle_, nullptr));
+    }
+
+    bool insert(const void* data, size_t size)
+    {
+        return mmlog_insert(handle_, data, size);
+    }
+
+    bool insert(std::string_view record)
+    {
+        return mmlog_insert(handle_, record.data(), record.size());
+    }
+
+    // Inserts the parts as a single record
+    template <typename... Parts>
+    bool insert_parts(const Parts&... parts)
+    {
+        static_assert(sizeof...(Parts) > 0, "a record needs at least one part");
+        std::string_view views[] = {std::string_view(parts)...};
+        struct iovec iov[sizeof...(Parts)];
+        for (size_t i = 0; i < sizeof...(Parts); i++) {
+            iov[i] = {const_cast<char*>(views[i].data()), views[i].size()};
+        }
+        return mmlog_insertv(handle_, iov, static_cast<int>(sizeof...(Parts)));
+    }
+
+    Reservation reserve(size_t size)
+    {
+        Reservation reservation;
+        reservation.data_ = mmlog_reserve(handle_, size, &reservation.reservation_);
+        return reservation;
+    }
+
+    // Formats straight into the log, e.g. log("{} took {}ms", name, elapsed).  See detail::format() for the syntax.
+    // The arguments are formatted twice, once to size the record and once to fill it in, which is still cheaper than
+    // building a string first.
+    template <typename... Args>
+    bool log(std::string_view fmt, const Args&... args)
+    {
+        size_t size = detail::format(nullptr, fmt, args...);
+        Reservation reservation = reserve(size);
+        if (!reservation) {
+            return false;
+        }
+        detail::format(reservation.data(), fmt, args...);
+        return reservation.commit();
+    }
+
+  private:
+    log_handle_t* handle_ = nullptr;
+};
+
+}  // namespace mmlog
@@ -1 +1,79 @@
 #include "mmlog.h"
+
+// libmmlog.h redeclares what the FFI needs from mmlog.h rather than including it, so check here that the two still
+// agree.  Its macros are captured and dropped first, and its types are pulled in under other names.
+enum {
+    h_flag_framed = MMLOG_FLAG_FRAMED,
+    h_flag_hugepages = MMLOG_FLAG_HUGEPAGES,
+    h_huge_page_size = MMLOG_HUGE_PAGE_SIZE,
+    h_durability_none = MMLOG_DURABILITY_NONE,
+    h_durability_async = MMLOG_DURABILITY_ASYNC,
+    h_durability_group = MMLOG_DURABILITY_GROUP,
+    h_stats_buckets = MMLOG_STATS_BUCKETS,
+};
+_Static_assert(MMLOG_SYNC_ALL == UINT64_MAX, "MMLOG_SYNC_ALL changed; update the check below");
+
+#undef MMLOG_FLAG_FRAMED
+#undef MMLOG_FLAG_HUGEPAGES
+#undef MMLOG_HUGE_PAGE_SIZE
+#undef MMLOG_DURABILITY_NONE
+#undef MMLOG_DURABILITY_ASYNC
+#undef MMLOG_DURABILITY_GROUP
+#undef MMLOG_SYNC_ALL
+#undef MMLOG_STATS_BUCKETS
+
+#define MMLOG_FFI_TYPES_ONLY
+#define log_metadata_t ffi_log_metadata_t
+#define chunk_info_t ffi_chunk_info_t
+#define log_handle_t ffi_log_handle_t
+#define log_range_t ffi_log_range_t
+#define mmlog_reader_t ffi_mmlog_reader_t
+#define mmlog_segments_t ffi_mmlog_segments_t
+#define mmlog_stats_t ffi_mmlog_stats_t
+#define mmlog_reservation_t ffi_mmlog_reservation_t
+#include "libmmlog.h"
+#undef log_metadata_t
+#undef chunk_info_t
+#undef log_handle_t
+#undef log_range_t
+#undef mmlog_reader_t
+#undef mmlog_segments_t
+#undef mmlog_stats_t
+#undef mmlog_reservation_t
+
+_Static_assert(MMLOG_FLAG_FRAMED == h_flag_framed, "libmmlog.h: MMLOG_FLAG_FRAMED");
+_Static_assert(MMLOG_FLAG_HUGEPAGES == h_flag_hugepages, "libmmlog.h: MMLOG_FLAG_HUGEPAGES");
+_Static_assert(MMLOG_HUGE_PAGE_SIZE == h_huge_page_size, "libmmlog.h: MMLOG_HUGE_PAGE_SIZE");
+_Static_assert(MMLOG_DURABILITY_NONE == h_durability_none, "libmmlog.h: MMLOG_DURABILITY_NONE");
+_Static_assert(MMLOG_DURABILITY_ASYNC == h_durability_async, "libmmlog.h: MMLOG_DURABILITY_ASYNC");
+_Static_assert(MMLOG_DURABILITY_GROUP == h_durability_group, "libmmlog.h: MMLOG_DURABILITY_GROUP");
+_Static_assert(MMLOG_SYNC_ALL == UINT64_MAX, "libmmlog.h: MMLOG_SYNC_ALL");
+_Static_assert(MMLOG_STATS_BUCKETS == h_stats_buckets, "libmmlog.h: MMLOG_STATS_BUCKETS");
+
+// Same size, and each field at the same offset with the same size
+#define CHECK_SIZE(type) _Static_assert(sizeof(type) == sizeof(ffi_##type), "libmmlog.h: sizeof(" #type ")")
+#define CHECK_FIELD(type, field)                                                                                \
+    _Static_assert(offsetof(type, field) == offsetof(ffi_##type, field) &&                                      \
+                       sizeof(((type*)0)->field) == sizeof(((ffi_##type*)0)->field),                            \
+                   "libmmlog.h: " #type "." #field)
+
+CHECK_SIZE(mmlog_segments_t);
+CHECK_FIELD(mmlog_segments_t, size);
+CHECK_FIELD(mmlog_segments_t, max_age_ms);
+CHECK_FIELD(mmlog_segments_t, retain);
+
+CHECK_SIZE(mmlog_stats_t);
+CHECK_FIELD(mmlog_stats_t, inserts);
+CHECK_FIELD(mmlog_stats_t, bytes);
+CHECK_FIELD(mmlog_stats_t, head_spins);
+CHECK_FIELD(mmlog_stats_t, expand_lock_failures);
+CHECK_FIELD(mmlog_stats_t, ring_full);
+CHECK_FIELD(mmlog_stats_t, pwrite_fallbacks);
+CHECK_FIELD(mmlog_stats_t, latency);
+
+CHECK_SIZE(mmlog_reservation_t);
+CHECK_FIELD(mmlog_reservation_t, handle);
+CHECK_FIELD(mmlog_reservation_t, chunk);
+CHECK_FIELD(mmlog_reservation_t, cursor);
+CHECK_FIELD(mmlog_reservation_t, size);
+CHECK_FIELD(mmlog_reservation_t, data);
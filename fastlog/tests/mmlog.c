@@ -1,9 +1,11 @@
+#include <dirent.h>
 #include <errno.h>
 #include <pthread.h>
 #include <sys/wait.h>
 #include <assert.h>
 #include <unistd.h>
 #include <signal.h>
+#include <sys/time.h>
 #include "unity.h"
 #include "mmlog.h"  // The header we're testing
 
@@ -27,6 +29,18 @@ void cleanup_test_files(void) {
     char meta_filename[256];
     snprintf(meta_filename, sizeof(meta_filename), "%s.mmlog", TEST_LOG_FILENAME);
     unlink(meta_filename);
+    for (uint64_t segment = 0; segment < 8; segment++) {
+        segment_unlink(TEST_LOG_FILENAME, segment);
+    }
+}
+
+static bool segment_exists(uint64_t segment) {
+    int fd = segment_open(TEST_LOG_FILENAME, segment, O_RDONLY);
+    if (-1 == fd) {
+        return false;
+    }
+    close(fd);
+    return true;
 }
 
 void test_mmlog_open_and_close(void) {
@@ -50,8 +64,7 @@ void test_mmlog_open_and_close(void) {
     TEST_ASSERT_TRUE(atomic_load(&handle->metadata->is_ready));
 
     // Clean up
-    free(handle->chunks.buffer);
-    free(handle);
+    mmlog_close(handle);
 
     cleanup_test_files();
 }
@@ -86,8 +99,7 @@ void test_mmlog_insert_and_checkout(void) {
     atomic_fetch_sub(&chunk->ref_count, 1);
 
     // Clean up
-    free(handle->chunks.buffer);
-    free(handle);
+    mmlog_close(handle);
 
     cleanup_test_files();
 }
@@ -128,8 +140,7 @@ void test_mmlog_multiple_inserts(void) {
     }
 
     // Clean up
-    free(handle->chunks.buffer);
-    free(handle);
+    mmlog_close(handle);
 
     cleanup_test_files();
 }
@@ -184,8 +195,47 @@ void test_mmlog_large_insert(void) {
     }
 
     free(large_buffer);
-    free(handle->chunks.buffer);
-    free(handle);
+    mmlog_close(handle);
+
+    cleanup_test_files();
+}
+
+static void ignore_signal(int sig) {
+    (void)sig;
+}
+
+void test_mmlog_large_insert_signals(void) {
+    cleanup_test_files();
+
+    log_handle_t* handle = mmlog_open(TEST_LOG_FILENAME, TEST_CHUNK_SIZE, TEST_CHUNK_COUNT);
+    TEST_ASSERT_NOT_NULL(handle);
+
+    // Records spanning several chunks are written straight to the file; keep interrupting that, without SA_RESTART
+    struct sigaction action = {0};
+    struct sigaction old_action;
+    action.sa_handler = ignore_signal;
+    TEST_ASSERT_EQUAL_INT(0, sigaction(SIGALRM, &action, &old_action));
+    struct itimerval timer = {{0, 50}, {0, 50}};
+    TEST_ASSERT_EQUAL_INT(0, setitimer(ITIMER_REAL, &timer, NULL));
+
+    static char records[64][4 * 4096 + 100];
+    for (size_t i = 0; i < 64; i++) {
+        memset(records[i], 'a' + i % 26, sizeof(records[i]));
+        TEST_ASSERT_TRUE(mmlog_insert(handle, records[i], sizeof(records[i])));
+    }
+
+    struct itimerval stop = {{0, 0}, {0, 0}};
+    setitimer(ITIMER_REAL, &stop, NULL);
+    sigaction(SIGALRM, &old_action, NULL);
+
+    // Every record made it in whole
+    static char check[sizeof(records[0])];
+    for (size_t i = 0; i < 64; i++) {
+        TEST_ASSERT_TRUE(sizeof(check) == pread(handle->data_fd, check, sizeof(check), i * sizeof(check)));
+        TEST_ASSERT_EQUAL_MEMORY(records[i], check, sizeof(check));
+    }
+
+    mmlog_close(handle);
 
     cleanup_test_files();
 }
@@ -264,8 +314,59 @@ void test_mmlog_concurrent_inserts(void) {
     TEST_ASSERT_EQUAL_UINT64(expected_cursor, atomic_load(&handle->metadata->cursor));
 
     // Clean up
-    free(handle->chunks.buffer);
-    free(handle);
+    mmlog_close(handle);
+
+    cleanup_test_files();
+}
+
+void test_mmlog_concurrent_rollover(void) {
+    cleanup_test_files();
+
+    // Many threads sharing a single handle, with small records that force frequent chunk rollovers
+    log_handle_t* handle = mmlog_open(TEST_LOG_FILENAME, TEST_CHUNK_SIZE, TEST_CHUNK_COUNT);
+    TEST_ASSERT_NOT_NULL(handle);
+
+    const int NUM_THREADS = 8;
+    const int ITERATIONS = 500;
+    const size_t DATA_SIZE = 100;
+
+    pthread_t threads[NUM_THREADS];
+    thread_test_args_t args[NUM_THREADS];
+
+    for (int i = 0; i < NUM_THREADS; i++) {
+        args[i].handle = handle;
+        args[i].thread_id = i;
+        args[i].iterations = ITERATIONS;
+        args[i].data_size = DATA_SIZE;
+        args[i].results = (char*)calloc(ITERATIONS, 1);
+    }
+
+    for (int i = 0; i < NUM_THREADS; i++) {
+        pthread_create(&threads[i], NULL, thread_insert_routine, &args[i]);
+    }
+
+    for (int i = 0; i < NUM_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        for (int j = 0; j < ITERATIONS; j++) {
+            TEST_ASSERT_EQUAL_INT(1, args[i].results[j]);
+        }
+        free(args[i].results);
+    }
+
+    uint64_t expected_cursor = NUM_THREADS * ITERATIONS * DATA_SIZE;
+    TEST_ASSERT_EQUAL_UINT64(expected_cursor, atomic_load(&handle->metadata->cursor));
+
+    // Every record is DATA_SIZE bytes, so each one must be a single, untorn copy of some thread's pattern
+    char record[100];
+    for (uint64_t offset = 0; offset < expected_cursor; offset += DATA_SIZE) {
+        TEST_ASSERT_EQUAL_INT(DATA_SIZE, pread(handle->data_fd, record, DATA_SIZE, offset));
+        for (size_t i = 0; i < DATA_SIZE; i++) {
+            TEST_ASSERT_EQUAL_UINT8(record[0] + (i % 10), record[i]);
+        }
+    }
+
+    // Clean up
+    mmlog_close(handle);
 
     cleanup_test_files();
 }
@@ -289,8 +390,7 @@ void test_mmlog_fork_basic(void) {
         mmlog_insert(handle, child_data, strlen(child_data) + 1);
 
         // Cleanup in child
-        free(handle->chunks.buffer);
-        free(handle);
+        mmlog_close(handle);
         exit(0);
     } else {
         // Parent process
@@ -319,8 +419,7 @@ void test_mmlog_fork_basic(void) {
         atomic_fetch_sub(&chunk->ref_count, 1);
 
         // Clean up in parent
-        free(handle->chunks.buffer);
-        free(handle);
+        mmlog_close(handle);
     }
 
     cleanup_test_files();
@@ -355,8 +454,7 @@ void test_mmlog_multiple_forks(void) {
             }
 
             // Cleanup in child
-            free(handle->chunks.buffer);
-            free(handle);
+            mmlog_close(handle);
             exit(0);
         }
     }
@@ -377,8 +475,7 @@ void test_mmlog_multiple_forks(void) {
     TEST_ASSERT_TRUE(actual_cursor >= parent_marker_size + (NUM_CHILDREN * 3 * 8));  // At least this many bytes
 
     // Clean up in parent
-    free(handle->chunks.buffer);
-    free(handle);
+    mmlog_close(handle);
 
     cleanup_test_files();
 }
@@ -408,8 +505,7 @@ void test_mmlog_fork_large_data(void) {
 
         // Cleanup in child
         free(large_buffer);
-        free(handle->chunks.buffer);
-        free(handle);
+        mmlog_close(handle);
         exit(0);
     } else {
         // Parent process
@@ -452,8 +548,7 @@ void test_mmlog_fork_large_data(void) {
 
         // Clean up in parent
         free(large_buffer);
-        free(handle->chunks.buffer);
-        free(handle);
+        mmlog_close(handle);
     }
 
     cleanup_test_files();
@@ -516,8 +611,7 @@ void test_mmlog_fork_then_thread(void) {
         mmlog_insert(handle, child_end_marker, strlen(child_end_marker) + 1);
 
         // Cleanup in child
-        free(handle->chunks.buffer);
-        free(handle);
+        mmlog_close(handle);
         exit(0);
     } else {
         // Parent process
@@ -536,8 +630,7 @@ void test_mmlog_fork_then_thread(void) {
         atomic_fetch_sub(&chunk->ref_count, 1);
 
         // Clean up in parent
-        free(handle->chunks.buffer);
-        free(handle);
+        mmlog_close(handle);
     }
 
     cleanup_test_files();
@@ -605,8 +698,7 @@ void test_mmlog_thread_then_fork(void) {
         }
 
         // Cleanup in child
-        free(handle->chunks.buffer);
-        free(handle);
+        mmlog_close(handle);
         exit(0);
     } else {
         // Parent process
@@ -626,8 +718,7 @@ void test_mmlog_thread_then_fork(void) {
         atomic_fetch_sub(&chunk->ref_count, 1);
 
         // Clean up in parent
-        free(handle->chunks.buffer);
-        free(handle);
+        mmlog_close(handle);
     }
 
     cleanup_test_files();
@@ -688,8 +779,7 @@ void test_mmlog_stress_test(void) {
             mmlog_insert(handle, process_marker, strlen(process_marker) + 1);
 
             // Cleanup in child
-            free(handle->chunks.buffer);
-            free(handle);
+            mmlog_close(handle);
             exit(0);
         }
     }
@@ -707,8 +797,7 @@ void test_mmlog_stress_test(void) {
     TEST_ASSERT_TRUE(cursor > 3 * 3 * 10 * 50);
 
     // Clean up
-    free(handle->chunks.buffer);
-    free(handle);
+    mmlog_close(handle);
 
     cleanup_test_files();
 }
@@ -786,8 +875,7 @@ void test_mmlog_data_integrity(void) {
     atomic_fetch_sub(&chunk->ref_count, 1);
 
     // Clean up
-    free(handle->chunks.buffer);
-    free(handle);
+    mmlog_close(handle);
 
     cleanup_test_files();
 }
@@ -814,11 +902,11 @@ void test_mmlog_random_data(void) {
             random_data[j] = (uint8_t)(rand() % 256);
         }
         TEST_ASSERT_TRUE(mmlog_insert(handle, random_data, ENTRY_SIZE));
+        free(random_data);
     }
 
     // Clean up
-    free(handle->chunks.buffer);
-    free(handle);
+    mmlog_close(handle);
 
     cleanup_test_files();
 }
@@ -867,12 +955,1541 @@ void test_mmlog_trim_validation(void) {
     atomic_fetch_sub(&chunk->ref_count, 1);
 
     // Clean up
+    mmlog_close(handle);
+
+    cleanup_test_files();
+}
+
+static void* slab_insert_routine(void* arg) {
+    log_handle_t* handle = (log_handle_t*)arg;
+    char record[100];
+    memset(record, 'b', sizeof(record));
+    bool ok = mmlog_insert(handle, record, sizeof(record));
+    mmlog_slab_flush(handle);
+    return ok ? handle : NULL;
+}
+
+void test_mmlog_slab_reservation(void) {
+    cleanup_test_files();
+
+    log_handle_t* handle = mmlog_open(TEST_LOG_FILENAME, TEST_CHUNK_SIZE, TEST_CHUNK_COUNT);
+    TEST_ASSERT_NOT_NULL(handle);
+    TEST_ASSERT_TRUE(mmlog_set_slab_size(handle, 1024));
+
+    // Reservations happen a slab at a time
+    char record[100];
+    memset(record, 'a', sizeof(record));
+    TEST_ASSERT_TRUE(mmlog_insert(handle, record, sizeof(record)));
+    TEST_ASSERT_EQUAL_UINT64(1024, atomic_load(&handle->metadata->cursor));
+
+    // Another thread gets its own slab; since it's still at the end of the log when flushed, the tail is handed back
+    pthread_t thread;
+    void* thread_ret = NULL;
+    pthread_create(&thread, NULL, slab_insert_routine, handle);
+    pthread_join(thread, &thread_ret);
+    TEST_ASSERT_NOT_NULL(thread_ret);
+    TEST_ASSERT_EQUAL_UINT64(1024 + 100, atomic_load(&handle->metadata->cursor));
+
+    // Meanwhile we keep filling our own slab, which now has to be padded out with a skip record
+    memset(record, 'c', sizeof(record));
+    TEST_ASSERT_TRUE(mmlog_insert(handle, record, sizeof(record)));
+    mmlog_slab_flush(handle);
+    TEST_ASSERT_EQUAL_UINT64(1024 + 100, atomic_load(&handle->metadata->cursor));
+
+    const struct {
+        uint64_t offset;
+        char value;
+    } expected[] = {{0, 'a'}, {100, 'c'}, {1024, 'b'}};
+    for (int i = 0; i < 3; i++) {
+        TEST_ASSERT_EQUAL_INT(sizeof(record), pread(handle->data_fd, record, sizeof(record), expected[i].offset));
+        TEST_ASSERT_EQUAL_UINT8(expected[i].value, record[0]);
+        TEST_ASSERT_EQUAL_UINT8(expected[i].value, record[sizeof(record) - 1]);
+    }
+
+    mmlog_skip_t skip;
+    TEST_ASSERT_EQUAL_INT(sizeof(skip), pread(handle->data_fd, &skip, sizeof(skip), 200));
+    TEST_ASSERT_EQUAL_UINT32(MMLOG_SKIP_MAGIC, skip.magic);
+    TEST_ASSERT_EQUAL_UINT32(1024 - 200, skip.length);
+
+    // Clean up
+    mmlog_close(handle);
+
+    cleanup_test_files();
+}
+
+static pthread_barrier_t slab_exit_barrier;
+
+static void* slab_exit_routine(void* arg) {
+    // Writes a record, waits for the main thread to write one of its own, writes another and leaves without flushing
+    log_handle_t* handle = (log_handle_t*)arg;
+    char record[100];
+    memset(record, 'b', sizeof(record));
+    bool ok = mmlog_insert(handle, record, sizeof(record));
+    pthread_barrier_wait(&slab_exit_barrier);
+    pthread_barrier_wait(&slab_exit_barrier);
+    ok = ok && mmlog_insert(handle, record, sizeof(record));
+    return ok ? handle : NULL;
+}
+
+void test_mmlog_slab_commit(void) {
+    cleanup_test_files();
+
+    log_handle_t* handle = mmlog_open(TEST_LOG_FILENAME, TEST_CHUNK_SIZE, TEST_CHUNK_COUNT);
+    TEST_ASSERT_NOT_NULL(handle);
+    TEST_ASSERT_TRUE(mmlog_set_slab_size(handle, 1024));
+    pthread_barrier_init(&slab_exit_barrier, NULL, 2);
+
+    // Records are committed as they're written, even though the slab they're in is still open
+    pthread_t thread;
+    pthread_create(&thread, NULL, slab_exit_routine, handle);
+    pthread_barrier_wait(&slab_exit_barrier);
+    TEST_ASSERT_EQUAL_UINT64(100, atomic_load(&handle->metadata->committed));
+
+    // Ours goes in a slab of its own, which is stuck behind the unused part of the other thread's
+    char record[100];
+    memset(record, 'a', sizeof(record));
+    TEST_ASSERT_TRUE(mmlog_insert(handle, record, sizeof(record)));
+    TEST_ASSERT_EQUAL_UINT64(100, atomic_load(&handle->metadata->committed));
+
+    // Until the other thread exits, which retires its slab whether or not it flushed
+    pthread_barrier_wait(&slab_exit_barrier);
+    void* thread_ret = NULL;
+    pthread_join(thread, &thread_ret);
+    TEST_ASSERT_NOT_NULL(thread_ret);
+    TEST_ASSERT_EQUAL_UINT64(1024 + 100, atomic_load(&handle->metadata->committed));
+
+    mmlog_skip_t skip;
+    TEST_ASSERT_EQUAL_INT(sizeof(skip), pread(handle->data_fd, &skip, sizeof(skip), 200));
+    TEST_ASSERT_EQUAL_UINT32(MMLOG_SKIP_MAGIC, skip.magic);
+    TEST_ASSERT_EQUAL_UINT32(1024 - 200, skip.length);
+
+    // Clean up
+    pthread_barrier_destroy(&slab_exit_barrier);
+    mmlog_close(handle);
+
+    cleanup_test_files();
+}
+
+void test_mmlog_slab_fork(void) {
+    cleanup_test_files();
+
+    log_handle_t* handle = mmlog_open(TEST_LOG_FILENAME, TEST_CHUNK_SIZE, TEST_CHUNK_COUNT);
+    TEST_ASSERT_NOT_NULL(handle);
+    TEST_ASSERT_TRUE(mmlog_set_slab_size(handle, 1024));
+
+    const char parent_data[] = "Parent slab data";
+    TEST_ASSERT_TRUE(mmlog_insert(handle, parent_data, sizeof(parent_data)));
+
+    pid_t pid = fork();
+    TEST_ASSERT_NOT_EQUAL(-1, pid);
+
+    if (pid == 0) {
+        // The child must not keep filling the slab it inherited from the parent
+        const char child_data[] = "Child slab data";
+        bool ok = mmlog_insert(handle, child_data, sizeof(child_data));
+        mmlog_slab_flush(handle);
+        exit(ok ? 0 : 1);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    TEST_ASSERT_EQUAL_INT(0, WEXITSTATUS(status));
+
+    // Parent keeps going in its own slab
+    const char parent_more[] = "More parent data";
+    TEST_ASSERT_TRUE(mmlog_insert(handle, parent_more, sizeof(parent_more)));
+    mmlog_slab_flush(handle);
+
+    char buf[32];
+    TEST_ASSERT_EQUAL_INT(sizeof(parent_data), pread(handle->data_fd, buf, sizeof(parent_data), 0));
+    TEST_ASSERT_EQUAL_STRING(parent_data, buf);
+    TEST_ASSERT_EQUAL_INT(sizeof(parent_more), pread(handle->data_fd, buf, sizeof(parent_more), sizeof(parent_data)));
+    TEST_ASSERT_EQUAL_STRING(parent_more, buf);
+    TEST_ASSERT_EQUAL_INT(16, pread(handle->data_fd, buf, 16, 1024));
+    TEST_ASSERT_EQUAL_STRING("Child slab data", buf);
+
+    // Clean up
+    mmlog_close(handle);
+
+    cleanup_test_files();
+}
+
+void test_mmlog_crc32c(void) {
+    // Standard check value for CRC32C
+    TEST_ASSERT_EQUAL_UINT32(0xe3069283, mmlog_crc32c(0, "123456789", 9));
+    TEST_ASSERT_EQUAL_UINT32(0xe3069283, mmlog_crc32c(mmlog_crc32c(0, "1234", 4), "56789", 5));
+
+    // Whatever implementation was picked has to agree with the table
+    unsigned char data[1027];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (unsigned char)(i * 131 + 7);
+    }
+    for (size_t offset = 0; offset < 8; offset++) {
+        uint32_t expected = ~mmlog_crc32c_sw(~0u, data + offset, sizeof(data) - offset);
+        TEST_ASSERT_EQUAL_UINT32(expected, mmlog_crc32c(0, data + offset, sizeof(data) - offset));
+    }
+}
+
+void test_mmlog_framed_records(void) {
+    cleanup_test_files();
+
+    log_handle_t* handle = mmlog_open_ex(TEST_LOG_FILENAME, TEST_CHUNK_SIZE, TEST_CHUNK_COUNT, MMLOG_FLAG_FRAMED);
+    TEST_ASSERT_NOT_NULL(handle);
+
+    // A small record, one which crosses a chunk boundary, one which spans several chunks, and a tiny one
+    static char payload[3 * 4096];
+    const size_t sizes[] = {13, 4070, sizeof(payload), 1};
+    const int count = sizeof(sizes) / sizeof(sizes[0]);
+    for (int i = 0; i < count; i++) {
+        memset(payload, 'a' + i, sizes[i]);
+        TEST_ASSERT_TRUE(mmlog_insert(handle, payload, sizes[i]));
+    }
+
+    // Walk the log
+    uint64_t end = atomic_load(&handle->metadata->cursor);
+    char* log = (char*)mmap(NULL, end, PROT_READ | PROT_WRITE, MAP_SHARED, handle->data_fd, 0);
+    TEST_ASSERT_NOT_EQUAL(MAP_FAILED, log);
+    uint64_t pos = 0;
+    for (int i = 0; i < count; i++) {
+        mmlog_frame_t* frame = (mmlog_frame_t*)(log + pos);
+        TEST_ASSERT_TRUE(mmlog_frame_is_valid(frame));
+        TEST_ASSERT_EQUAL_UINT64(i, frame->sequence);
+        TEST_ASSERT_EQUAL_UINT32(sizes[i], frame->length);
+        TEST_ASSERT_EQUAL_UINT8('a' + i, ((char*)(frame + 1))[sizes[i] - 1]);
+        pos += mmlog_frame_span(frame);
+    }
+    TEST_ASSERT_EQUAL_UINT64(end, pos);
+
+    // A damaged record fails its CRC, and a torn one was never committed, but both can be stepped over
+    mmlog_frame_t* frame = (mmlog_frame_t*)log;
+    ((char*)(frame + 1))[0] ^= 1;
+    TEST_ASSERT_FALSE(mmlog_frame_is_valid(frame));
+    atomic_store(&frame->magic, 0);
+    TEST_ASSERT_FALSE(mmlog_frame_is_valid(frame));
+    TEST_ASSERT_EQUAL_UINT64(mmlog_frame_size(sizes[0]), mmlog_frame_span(frame));
+
+    // Clean up
+    munmap(log, end);
+    mmlog_close(handle);
+
+    cleanup_test_files();
+}
+
+void test_mmlog_framed_slab_skip(void) {
+    cleanup_test_files();
+
+    log_handle_t* handle = mmlog_open_ex(TEST_LOG_FILENAME, TEST_CHUNK_SIZE, TEST_CHUNK_COUNT, MMLOG_FLAG_FRAMED);
+    TEST_ASSERT_NOT_NULL(handle);
+    TEST_ASSERT_FALSE(mmlog_set_slab_size(handle, 1001));  // Slabs have to keep frames aligned
+    TEST_ASSERT_TRUE(mmlog_set_slab_size(handle, 1024));
+
+    // Same dance as the unframed case: the other thread's slab is handed back, ours gets padded
+    char record[100];
+    memset(record, 'a', sizeof(record));
+    TEST_ASSERT_TRUE(mmlog_insert(handle, record, sizeof(record)));
+    pthread_t thread;
+    void* thread_ret = NULL;
+    pthread_create(&thread, NULL, slab_insert_routine, handle);
+    pthread_join(thread, &thread_ret);
+    TEST_ASSERT_NOT_NULL(thread_ret);
+    TEST_ASSERT_TRUE(mmlog_insert(handle, record, sizeof(record)));
+    mmlog_slab_flush(handle);
+
+    const uint64_t frame_size = mmlog_frame_size(sizeof(record));
+    uint64_t end = atomic_load(&handle->metadata->cursor);
+    TEST_ASSERT_EQUAL_UINT64(1024 + frame_size, end);
+
+    char* log = (char*)mmap(NULL, end, PROT_READ, MAP_SHARED, handle->data_fd, 0);
+    TEST_ASSERT_NOT_EQUAL(MAP_FAILED, log);
+    const struct {
+        uint64_t offset;
+        uint64_t sequence;
+    } expected[] = {{0, 0}, {frame_size, 2}, {1024, 1}};
+    for (int i = 0; i < 3; i++) {
+        mmlog_frame_t* frame = (mmlog_frame_t*)(log + expected[i].offset);
+        TEST_ASSERT_TRUE(mmlog_frame_is_valid(frame));
+        TEST_ASSERT_EQUAL_UINT64(expected[i].sequence, frame->sequence);
+    }
+    mmlog_frame_t* skip = (mmlog_frame_t*)(log + 2 * frame_size);
+    TEST_ASSERT_EQUAL_UINT32(MMLOG_SKIP_MAGIC, atomic_load(&skip->magic));
+    TEST_ASSERT_EQUAL_UINT64(1024 - 2 * frame_size, mmlog_frame_span(skip));
+
+    // Clean up
+    munmap(log, end);
+    mmlog_close(handle);
+
+    cleanup_test_files();
+}
+
+void test_mmlog_reserve_commit(void) {
+    cleanup_test_files();
+
+    log_handle_t* handle = mmlog_open(TEST_LOG_FILENAME, TEST_CHUNK_SIZE, TEST_CHUNK_COUNT);
+    TEST_ASSERT_NOT_NULL(handle);
+
+    // One reservation inside the first chunk, and one which has to cross into the second
+    mmlog_reservation_t small, crossing;
+    char* small_data = (char*)mmlog_reserve(handle, 100, &small);
+    char* crossing_data = (char*)mmlog_reserve(handle, 4000, &crossing);
+    TEST_ASSERT_NOT_NULL(small_data);
+    TEST_ASSERT_NOT_NULL(crossing_data);
+    TEST_ASSERT_EQUAL_UINT64(100, crossing.cursor);
+
+    // Fill them in place, and commit out of order
+    memset(crossing_data, 'y', 4000);
+    memset(small_data, 'x', 100);
+    TEST_ASSERT_TRUE(mmlog_commit(&crossing));
+    TEST_ASSERT_TRUE(mmlog_commit(&small));
+    TEST_ASSERT_FALSE(mmlog_commit(&small));  // Already committed
+
+    char buf[4100];
+    TEST_ASSERT_EQUAL_INT(sizeof(buf), pread(handle->data_fd, buf, sizeof(buf), 0));
+    for (size_t i = 0; i < sizeof(buf); i++) {
+        TEST_ASSERT_EQUAL_UINT8(i < 100 ? 'x' : 'y', buf[i]);
+    }
+
+    // Clean up
+    mmlog_close(handle);
+
+    cleanup_test_files();
+}
+
+void test_mmlog_framed_reserve_commit(void) {
+    cleanup_test_files();
+
+    log_handle_t* handle = mmlog_open_ex(TEST_LOG_FILENAME, TEST_CHUNK_SIZE, TEST_CHUNK_COUNT, MMLOG_FLAG_FRAMED);
+    TEST_ASSERT_NOT_NULL(handle);
+
+    mmlog_reservation_t reservation;
+    const char message[] = "formatted in place";
+    char* data = (char*)mmlog_reserve(handle, sizeof(message), &reservation);
+    TEST_ASSERT_NOT_NULL(data);
+    memcpy(data, message, sizeof(message));
+
+    // Until it's committed, readers can step over the record but not trust it
+    mmlog_frame_t* frame = (mmlog_frame_t*)mmap(NULL, TEST_CHUNK_SIZE, PROT_READ, MAP_SHARED, handle->data_fd, 0);
+    TEST_ASSERT_NOT_EQUAL(MAP_FAILED, frame);
+    TEST_ASSERT_FALSE(mmlog_frame_is_valid(frame));
+    TEST_ASSERT_EQUAL_UINT64(mmlog_frame_size(sizeof(message)), mmlog_frame_span(frame));
+
+    TEST_ASSERT_TRUE(mmlog_commit(&reservation));
+    TEST_ASSERT_TRUE(mmlog_frame_is_valid(frame));
+    TEST_ASSERT_EQUAL_STRING(message, (const char*)(frame + 1));
+
+    // Clean up
+    munmap(frame, TEST_CHUNK_SIZE);
+    mmlog_close(handle);
+
+    cleanup_test_files();
+}
+
+void test_mmlog_abandon(void) {
+    cleanup_test_files();
+
+    log_handle_t* handle = mmlog_open_ex(TEST_LOG_FILENAME, TEST_CHUNK_SIZE, TEST_CHUNK_COUNT, MMLOG_FLAG_FRAMED);
+    TEST_ASSERT_NOT_NULL(handle);
+    mmlog_reader_t* reader = mmlog_reader_open(TEST_LOG_FILENAME);
+    TEST_ASSERT_NOT_NULL(reader);
+
+    // A reservation which is only half filled in is given up on, and the one after it is committed
+    mmlog_reservation_t abandoned, committed;
+    char* data = (char*)mmlog_reserve(handle, 100, &abandoned);
+    TEST_ASSERT_NOT_NULL(data);
+    memset(data, 'x', 50);
+    TEST_ASSERT_NOT_NULL(mmlog_reserve(handle, 10, &committed));
+    memset(committed.data, 'y', 10);
+    TEST_ASSERT_TRUE(mmlog_commit(&committed));
+    TEST_ASSERT_TRUE(mmlog_abandon(&abandoned));
+    TEST_ASSERT_FALSE(mmlog_abandon(&abandoned));  // Already done with
+    TEST_ASSERT_FALSE(mmlog_commit(&abandoned));
+
+    // Readers only ever see the committed one
+    const void* record;
+    size_t size;
+    TEST_ASSERT_TRUE(mmlog_reader_next(reader, &record, &size));
+    TEST_ASSERT_EQUAL_UINT64(10, size);
+    TEST_ASSERT_EQUAL_UINT8('y', ((const char*)record)[0]);
+    TEST_ASSERT_FALSE(mmlog_reader_next(reader, &record, &size));
+    TEST_ASSERT_EQUAL_INT(MMLOG_ERR_OK, mmlog_errno);
+    mmlog_reader_close(reader);
+    mmlog_close(handle);
+
+    // Raw logs have no frames to mark, so the record is wiped and gets a skip header
+    cleanup_test_files();
+    handle = mmlog_open(TEST_LOG_FILENAME, TEST_CHUNK_SIZE, TEST_CHUNK_COUNT);
+    TEST_ASSERT_NOT_NULL(handle);
+    data = (char*)mmlog_reserve(handle, 100, &abandoned);
+    TEST_ASSERT_NOT_NULL(data);
+    memset(data, 'x', 100);
+    TEST_ASSERT_TRUE(mmlog_abandon(&abandoned));
+    TEST_ASSERT_EQUAL_UINT64(100, atomic_load(&handle->metadata->committed));
+    char buf[100];
+    TEST_ASSERT_EQUAL_INT(sizeof(buf), pread(handle->data_fd, buf, sizeof(buf), 0));
+    mmlog_skip_t skip;
+    memcpy(&skip, buf, sizeof(skip));
+    TEST_ASSERT_EQUAL_UINT32(MMLOG_SKIP_MAGIC, skip.magic);
+    TEST_ASSERT_EQUAL_UINT32(100, skip.length);
+    for (size_t i = sizeof(skip); i < sizeof(buf); i++) {
+        TEST_ASSERT_EQUAL_UINT8(0, buf[i]);
+    }
+
+    // Clean up
+    mmlog_close(handle);
+
+    cleanup_test_files();
+}
+
+void test_mmlog_raw_padding(void) {
+    cleanup_test_files();
+
+    log_handle_t* handle = mmlog_open(TEST_LOG_FILENAME, TEST_CHUNK_SIZE, TEST_CHUNK_COUNT);
+    TEST_ASSERT_NOT_NULL(handle);
+
+    // An abandoned reservation, then the unused tail of a slab which something else has been reserved after
+    mmlog_reservation_t abandoned;
+    TEST_ASSERT_NOT_NULL(mmlog_reserve(handle, 16, &abandoned));
+    TEST_ASSERT_TRUE(mmlog_abandon(&abandoned));
+    TEST_ASSERT_TRUE(mmlog_insert(handle, "hello\n", 6));
+    TEST_ASSERT_TRUE(mmlog_set_slab_size(handle, 1024));
+    TEST_ASSERT_TRUE(mmlog_insert(handle, "slab\n", 5));
+    char big[600];
+    memset(big, 'b', sizeof(big));
+    TEST_ASSERT_TRUE(mmlog_insert(handle, big, sizeof(big)));  // Too big for the slab, so it goes after it
+    mmlog_slab_flush(handle);
+    TEST_ASSERT_TRUE(mmlog_insert(handle, "bye\n", 4));
+    TEST_ASSERT_EQUAL_UINT64(2, atomic_load(&handle->metadata->holes));
+
+    // The padding is in the log, but readers only get the records
+    char expected[6 + 5 + sizeof(big) + 4];
+    memcpy(expected, "hello\nslab\n", 11);
+    memcpy(expected + 11, big, sizeof(big));
+    memcpy(expected + 11 + sizeof(big), "bye\n", 4);
+    char got[sizeof(expected)];
+    size_t done = 0;
+    mmlog_reader_t* reader = mmlog_reader_open(TEST_LOG_FILENAME);
+    TEST_ASSERT_NOT_NULL(reader);
+    const void* data;
+    size_t size;
+    while (mmlog_reader_next(reader, &data, &size)) {
+        TEST_ASSERT_TRUE(done + size <= sizeof(got));
+        memcpy(got + done, data, size);
+        done += size;
+    }
+    TEST_ASSERT_EQUAL_INT(MMLOG_ERR_OK, mmlog_errno);
+    TEST_ASSERT_EQUAL_UINT64(sizeof(expected), done);
+    TEST_ASSERT_EQUAL_MEMORY(expected, got, sizeof(expected));
+    mmlog_reader_close(reader);
+
+    // Clean up
+    mmlog_close(handle);
+
+    cleanup_test_files();
+}
+
+void test_mmlog_insertv(void) {
+    cleanup_test_files();
+
+    log_handle_t* handle = mmlog_open_ex(TEST_LOG_FILENAME, TEST_CHUNK_SIZE, TEST_CHUNK_COUNT, MMLOG_FLAG_FRAMED);
+    TEST_ASSERT_NOT_NULL(handle);
+
+    struct iovec empty[] = {{NULL, 0}, {NULL, 0}};
+    TEST_ASSERT_FALSE(mmlog_insertv(handle, empty, 2));
+    TEST_ASSERT_EQUAL_INT(MMLOG_ERR_MMLOG_INSERTV_EINVAL, mmlog_errno);
+    struct iovec missing[] = {{NULL, 1}};
+    TEST_ASSERT_FALSE(mmlog_insertv(handle, missing, 1));
+    TEST_ASSERT_EQUAL_INT(MMLOG_ERR_MMLOG_INSERTV_EINVAL, mmlog_errno);
+
+    // Empty fragments are fine; the record is whatever the rest add up to
+    char message[] = "a record in parts";
+    char newline[] = "\n";
+    struct iovec parts[] = {{message, 9}, {NULL, 0}, {message + 9, sizeof(message) - 10}, {newline, 1}};
+    TEST_ASSERT_TRUE(mmlog_insertv(handle, parts, 4));
+
+    // One which has to straddle a chunk boundary
+    static char big[3000];
+    memset(big, 'x', sizeof(big));
+    struct iovec halves[] = {{big, sizeof(big) / 2}, {big + sizeof(big) / 2, sizeof(big) / 2}};
+    TEST_ASSERT_TRUE(mmlog_insertv(handle, halves, 2));
+    TEST_ASSERT_TRUE(mmlog_insertv(handle, halves, 2));
+
+    // Readers check the CRC, so this also covers it being computed across the fragments
+    mmlog_reader_t* reader = mmlog_reader_open(TEST_LOG_FILENAME);
+    TEST_ASSERT_NOT_NULL(reader);
+    const void* data;
+    size_t size;
+    TEST_ASSERT_TRUE(mmlog_reader_next(reader, &data, &size));
+    TEST_ASSERT_EQUAL_UINT64(strlen("a record in parts\n"), size);
+    TEST_ASSERT_EQUAL_MEMORY("a record in parts\n", data, size);
+    for (int i = 0; i < 2; i++) {
+        TEST_ASSERT_TRUE(mmlog_reader_next(reader, &data, &size));
+        TEST_ASSERT_EQUAL_UINT64(sizeof(big), size);
+        TEST_ASSERT_EQUAL_MEMORY(big, data, size);
+    }
+    TEST_ASSERT_FALSE(mmlog_reader_next(reader, &data, &size));
+    TEST_ASSERT_EQUAL_INT(MMLOG_ERR_OK, mmlog_errno);
+    mmlog_reader_close(reader);
+
+    // Clean up
+    mmlog_close(handle);
+
+    cleanup_test_files();
+}
+
+void test_mmlog_insert_batch(void) {
+    cleanup_test_files();
+
+    // Segments hold 8 of these, so the batch gets split in three
+    mmlog_segments_t segments = {2 * TEST_CHUNK_SIZE, 0, 0};
+    log_handle_t* handle =
+        mmlog_open_segmented(TEST_LOG_FILENAME, TEST_CHUNK_SIZE, TEST_CHUNK_COUNT, MMLOG_FLAG_FRAMED, &segments);
+    TEST_ASSERT_NOT_NULL(handle);
+
+    static char payloads[20][1000];
+    struct iovec records[20];
+    for (uint32_t i = 0; i < 20; i++) {
+        memset(payloads[i], 'a' + i, sizeof(payloads[i]));
+        records[i].iov_base = payloads[i];
+        records[i].iov_len = sizeof(payloads[i]) - i;  // Some records straddle chunks, some don't
+    }
+    TEST_ASSERT_FALSE(mmlog_insert_batch(handle, records, 0));
+    TEST_ASSERT_EQUAL_INT(MMLOG_ERR_MMLOG_INSERT_BATCH_EINVAL, mmlog_errno);
+    records[3].iov_len = 0;
+    TEST_ASSERT_FALSE(mmlog_insert_batch(handle, records, 20));
+    TEST_ASSERT_EQUAL_INT(MMLOG_ERR_MMLOG_INSERT_BATCH_EINVAL, mmlog_errno);
+    records[3].iov_len = sizeof(payloads[3]) - 3;
+
+    TEST_ASSERT_TRUE(mmlog_insert_batch(handle, records, 20));
+    TEST_ASSERT_EQUAL_UINT64(2, atomic_load(&handle->metadata->segment));
+    TEST_ASSERT_EQUAL_UINT64(20, atomic_load(&handle->metadata->sequence));
+
+    // Everything comes back in order, with consecutive sequence numbers
+    mmlog_reader_t* reader = mmlog_reader_open(TEST_LOG_FILENAME);
+    TEST_ASSERT_NOT_NULL(reader);
+    const void* data;
+    size_t size;
+    for (uint32_t i = 0; i < 20; i++) {
+        TEST_ASSERT_TRUE(mmlog_reader_next(reader, &data, &size));
+        TEST_ASSERT_EQUAL_UINT64(records[i].iov_len, size);
+        TEST_ASSERT_EQUAL_MEMORY(payloads[i], data, size);
+        TEST_ASSERT_EQUAL_UINT64(i, ((const mmlog_frame_t*)data - 1)->sequence);
+    }
+    TEST_ASSERT_FALSE(mmlog_reader_next(reader, &data, &size));
+    TEST_ASSERT_EQUAL_INT(MMLOG_ERR_OK, mmlog_errno);
+    mmlog_reader_close(reader);
+
+    // Clean up
+    mmlog_close(handle);
+
+    cleanup_test_files();
+}
+
+void test_mmlog_reader_watermark(void) {
+    cleanup_test_files();
+
+    log_handle_t* handle = mmlog_open(TEST_LOG_FILENAME, TEST_CHUNK_SIZE, TEST_CHUNK_COUNT);
+    TEST_ASSERT_NOT_NULL(handle);
+    mmlog_reader_t* reader = mmlog_reader_open(TEST_LOG_FILENAME);
+    TEST_ASSERT_NOT_NULL(reader);
+
+    const void* data;
+    size_t size;
+    mmlog_reservation_t first, second;
+    TEST_ASSERT_NOT_NULL(mmlog_reserve(handle, 10, &first));
+    TEST_ASSERT_NOT_NULL(mmlog_reserve(handle, 20, &second));
+    memset(first.data, 'a', 10);
+    memset(second.data, 'b', 20);
+
+    // The second record is done, but it's stuck behind the first one
+    TEST_ASSERT_TRUE(mmlog_commit(&second));
+    TEST_ASSERT_FALSE(mmlog_reader_next(reader, &data, &size));
+    TEST_ASSERT_EQUAL_INT(MMLOG_ERR_OK, mmlog_errno);
+
+    // Once the first one is committed, the watermark picks up the second one too
+    TEST_ASSERT_TRUE(mmlog_commit(&first));
+    TEST_ASSERT_EQUAL_UINT64(30, atomic_load(&handle->metadata->committed));
+    TEST_ASSERT_TRUE(mmlog_reader_next(reader, &data, &size));
+    TEST_ASSERT_EQUAL_UINT64(30, size);
+    TEST_ASSERT_EQUAL_UINT8('a', ((const char*)data)[9]);
+    TEST_ASSERT_EQUAL_UINT8('b', ((const char*)data)[10]);
+    TEST_ASSERT_FALSE(mmlog_reader_next(reader, &data, &size));
+
+    // Clean up
+    mmlog_reader_close(reader);
+    mmlog_close(handle);
+
+    cleanup_test_files();
+}
+
+#define READER_WRITERS 4
+#define READER_RECORDS 2000
+
+typedef struct {
+    log_handle_t* handle;
+    uint32_t id;
+} reader_writer_args_t;
+
+static void* reader_writer_routine(void* arg) {
+    reader_writer_args_t* args = (reader_writer_args_t*)arg;
+    for (uint32_t i = 0; i < READER_RECORDS; i++) {
+        uint32_t record[2 + i % 16];
+        record[0] = args->id;
+        record[1] = i;
+        if (!mmlog_insert(args->handle, record, sizeof(record))) {
+            return NULL;
+        }
+    }
+    mmlog_slab_flush(args->handle);
+    return args;
+}
+
+static void reader_follow(size_t slab_size) {
+    cleanup_test_files();
+
+    log_handle_t* handle = mmlog_open_ex(TEST_LOG_FILENAME, TEST_CHUNK_SIZE, TEST_CHUNK_COUNT, MMLOG_FLAG_FRAMED);
+    TEST_ASSERT_NOT_NULL(handle);
+    if (slab_size) {
+        TEST_ASSERT_TRUE(mmlog_set_slab_size(handle, slab_size));
+    }
+    mmlog_reader_t* reader = mmlog_reader_open(TEST_LOG_FILENAME);
+    TEST_ASSERT_NOT_NULL(reader);
+
+    pthread_t threads[READER_WRITERS];
+    reader_writer_args_t args[READER_WRITERS];
+    for (uint32_t i = 0; i < READER_WRITERS; i++) {
+        args[i] = (reader_writer_args_t){handle, i};
+        pthread_create(&threads[i], NULL, reader_writer_routine, &args[i]);
+    }
+
+    // Follow along while the writers are going; each writer's records have to show up in order
+    uint32_t next[READER_WRITERS] = {0};
+    uint32_t total = 0;
+    while (total < READER_WRITERS * READER_RECORDS) {
+        const void* data;
+        size_t size;
+        if (!mmlog_reader_next(reader, &data, &size)) {
+            TEST_ASSERT_EQUAL_INT(MMLOG_ERR_OK, mmlog_errno);
+            sched_yield();
+            continue;
+        }
+        const uint32_t* record = (const uint32_t*)data;
+        TEST_ASSERT_TRUE(record[0] < READER_WRITERS);
+        TEST_ASSERT_EQUAL_UINT32(next[record[0]], record[1]);
+        TEST_ASSERT_EQUAL_UINT64(sizeof(uint32_t) * (2 + record[1] % 16), size);
+        next[record[0]]++;
+        total++;
+    }
+
+    for (int i = 0; i < READER_WRITERS; i++) {
+        void* ret = NULL;
+        pthread_join(threads[i], &ret);
+        TEST_ASSERT_NOT_NULL(ret);
+    }
+
+    // Clean up
+    mmlog_reader_close(reader);
+    mmlog_close(handle);
+
+    cleanup_test_files();
+}
+
+void test_mmlog_reader_follow(void) {
+    // Records committed one at a time (out of order, so some get parked), and then a slab at a time
+    reader_follow(0);
+    reader_follow(1024);
+}
+
+void test_mmlog_write_failure(void) {
+    cleanup_test_files();
+
+    log_handle_t* handle = mmlog_open(TEST_LOG_FILENAME, TEST_CHUNK_SIZE, TEST_CHUNK_COUNT);
+    TEST_ASSERT_NOT_NULL(handle);
+    mmlog_reader_t* reader = mmlog_reader_open(TEST_LOG_FILENAME);
+    TEST_ASSERT_NOT_NULL(reader);
+
+    // Records spanning several chunks are written with pwrite(), which fails outright if the source can't be read
+    const size_t bad_size = 3 * TEST_CHUNK_SIZE;
+    void* bad = mmap(NULL, bad_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    TEST_ASSERT_NOT_EQUAL(MAP_FAILED, bad);
+    struct iovec iov = {bad, bad_size};
+
+    // Each way in leaves a hole in the log, which has to be padded out and committed all the same
+    TEST_ASSERT_TRUE(mmlog_insert(handle, "before", 6));
+    TEST_ASSERT_FALSE(mmlog_insert(handle, bad, bad_size));
+    TEST_ASSERT_EQUAL_INT(MMLOG_ERR_WRITE_RANGE_PWRITE, mmlog_errno);
+    TEST_ASSERT_FALSE(mmlog_insertv(handle, &iov, 1));
+    TEST_ASSERT_EQUAL_INT(MMLOG_ERR_WRITE_RANGE_PWRITE, mmlog_errno);
+    TEST_ASSERT_FALSE(mmlog_insert_batch(handle, &iov, 1));
+    TEST_ASSERT_EQUAL_INT(MMLOG_ERR_WRITE_RANGE_PWRITE, mmlog_errno);
+    TEST_ASSERT_TRUE(mmlog_insert(handle, "after", 5));
+
+    // So the reader gets all the way to the end, stepping over the padding where the failed writes would have gone
+    TEST_ASSERT_EQUAL_UINT64(6 + 3 * bad_size + 5, atomic_load(&handle->metadata->committed));
+    TEST_ASSERT_EQUAL_UINT64(3, atomic_load(&handle->metadata->holes));
+    const void* data;
+    size_t size;
+    TEST_ASSERT_TRUE(mmlog_reader_next(reader, &data, &size));
+    TEST_ASSERT_EQUAL_UINT64(6, size);
+    TEST_ASSERT_EQUAL_MEMORY("before", data, 6);
+    TEST_ASSERT_TRUE(mmlog_reader_next(reader, &data, &size));
+    TEST_ASSERT_EQUAL_UINT64(5, size);
+    TEST_ASSERT_EQUAL_MEMORY("after", data, 5);
+    TEST_ASSERT_FALSE(mmlog_reader_next(reader, &data, &size));
+    TEST_ASSERT_EQUAL_INT(MMLOG_ERR_OK, mmlog_errno);
+
+    // Clean up
+    munmap(bad, bad_size);
+    mmlog_reader_close(reader);
+    mmlog_close(handle);
+
+    cleanup_test_files();
+}
+
+void test_mmlog_prefetch(void) {
+    cleanup_test_files();
+
+    log_handle_t* handle = mmlog_open(TEST_LOG_FILENAME, TEST_CHUNK_SIZE, TEST_CHUNK_COUNT);
+    TEST_ASSERT_NOT_NULL(handle);
+    TEST_ASSERT_FALSE(mmlog_set_prefetch(handle, MMLOG_PREFETCH_MAX + 1));
+    TEST_ASSERT_EQUAL_INT(MMLOG_ERR_MMLOG_SET_PREFETCH_EINVAL, mmlog_errno);
+    TEST_ASSERT_TRUE(mmlog_set_prefetch(handle, 4));
+
+    // The helper gets the file grown before anybody has written a thing
+    for (int i = 0; i < 1000 && atomic_load(&handle->metadata->file_size) < 5 * TEST_CHUNK_SIZE; i++) {
+        usleep(1000);
+    }
+    TEST_ASSERT_EQUAL_UINT64(5 * TEST_CHUNK_SIZE, atomic_load(&handle->metadata->file_size));
+
+    // Records land in prefetched chunks just the same
+    uint32_t record[16];
+    const uint32_t count = 16 * TEST_CHUNK_SIZE / sizeof(record);
+    for (uint32_t i = 0; i < count; i++) {
+        for (uint32_t j = 0; j < 16; j++) {
+            record[j] = i;
+        }
+        TEST_ASSERT_TRUE(mmlog_insert(handle, record, sizeof(record)));
+    }
+
+    // Stopping the helper hands back whatever it had left over
+    TEST_ASSERT_TRUE(mmlog_set_prefetch(handle, 0));
+    for (uint32_t i = 0; i < MMLOG_PREFETCH_MAX; i++) {
+        TEST_ASSERT_NULL(atomic_load(&handle->prefetch->spare[i]));
+    }
+
+    mmlog_reader_t* reader = mmlog_reader_open(TEST_LOG_FILENAME);
+    TEST_ASSERT_NOT_NULL(reader);
+    const void* data;
+    size_t size;
+    TEST_ASSERT_TRUE(mmlog_reader_next(reader, &data, &size));
+    TEST_ASSERT_EQUAL_UINT64(count * sizeof(record), size);
+    for (uint32_t i = 0; i < count; i++) {
+        TEST_ASSERT_EQUAL_UINT32(i, ((const uint32_t*)data)[i * 16 + 15]);
+    }
+
+    // Clean up
+    mmlog_reader_close(reader);
+    mmlog_close(handle);
+
+    cleanup_test_files();
+}
+
+static uint32_t free_descriptor_count(log_handle_t* handle) {
+    uint32_t count = 0;
+    uint32_t index = (uint32_t)atomic_load(&handle->chunks.free_list);
+    while (index) {
+        count++;
+        index = atomic_load(&handle->chunks.pool[index - 1].next_free);
+    }
+    return count;
+}
+
+void test_mmlog_descriptor_pool(void) {
+    cleanup_test_files();
+
+    log_handle_t* handle = mmlog_open(TEST_LOG_FILENAME, TEST_CHUNK_SIZE, TEST_CHUNK_COUNT);
+    TEST_ASSERT_NOT_NULL(handle);
+    const uint32_t spares = MMLOG_POOL_SIZE(TEST_CHUNK_COUNT) - TEST_CHUNK_COUNT;
+    TEST_ASSERT_EQUAL_UINT32(spares, free_descriptor_count(handle));
+
+    // Pin the first chunk, so that the ring fills up and writers have to fall back to untracked chunks
+    char record[256] = {0};
+    TEST_ASSERT_TRUE(mmlog_insert(handle, record, sizeof(record)));
+    chunk_info_t* pinned = mmlog_rb_checkout(handle, 0);
+    TEST_ASSERT_NOT_NULL(pinned);
+    for (uint32_t i = 0; i < 4 * TEST_CHUNK_COUNT * TEST_CHUNK_SIZE / sizeof(record); i++) {
+        TEST_ASSERT_TRUE(mmlog_insert(handle, record, sizeof(record)));
+    }
+
+    // Every descriptor, tracked or not, came from the pool and went back to it
+    TEST_ASSERT_EQUAL_UINT32(spares, free_descriptor_count(handle));
+    chunk_info_t* pool_end = handle->chunks.pool + handle->chunks.pool_size;
+    for (uint32_t i = 0; i < TEST_CHUNK_COUNT; i++) {
+        chunk_info_t* chunk = handle->chunks.buffer[i];
+        TEST_ASSERT_TRUE(chunk >= handle->chunks.pool && chunk < pool_end);
+    }
+    mmlog_rb_release(handle, pinned);
+
+    // Clean up
+    mmlog_close(handle);
+
+    cleanup_test_files();
+}
+
+void test_mmlog_hugepages(void) {
+    cleanup_test_files();
+
+    // Chunks have to be made of whole huge pages
+    TEST_ASSERT_NULL(mmlog_open_ex(TEST_LOG_FILENAME, TEST_CHUNK_SIZE, TEST_CHUNK_COUNT, MMLOG_FLAG_HUGEPAGES));
+    TEST_ASSERT_EQUAL_INT(MMLOG_ERR_MMLOG_OPEN_EINVAL, mmlog_errno);
+
+    log_handle_t* handle = mmlog_open_ex(TEST_LOG_FILENAME, MMLOG_HUGE_PAGE_SIZE, 2, MMLOG_FLAG_HUGEPAGES);
+    TEST_ASSERT_NOT_NULL(handle);
+    TEST_ASSERT_EQUAL_UINT32(MMLOG_HUGE_PAGE_SIZE, handle->metadata->page_size);
+
+    // Fill a few chunks; every mapping has to start on a huge page boundary, or the kernel can't use huge pages for it
+    static char record[100000];
+    for (uint32_t i = 0; i < 3 * MMLOG_HUGE_PAGE_SIZE / sizeof(record); i++) {
+        memset(record, 'a' + i % 26, sizeof(record));
+        TEST_ASSERT_TRUE(mmlog_insert(handle, record, sizeof(record)));
+        chunk_info_t* chunk = mmlog_rb_checkout(handle, (uint64_t)i * sizeof(record));
+        TEST_ASSERT_NOT_NULL(chunk);
+        TEST_ASSERT_EQUAL_UINT64(0, (uintptr_t)chunk->mapping % MMLOG_HUGE_PAGE_SIZE);
+        mmlog_rb_release(handle, chunk);
+    }
+
+    // Prefetched mappings too
+    int fd = open(TEST_LOG_FILENAME, O_RDWR);
+    TEST_ASSERT_NOT_EQUAL(-1, fd);
+    void* mapping = data_mmap(handle, MMLOG_HUGE_PAGE_SIZE, fd, 0, MAP_POPULATE);
+    close(fd);
+    TEST_ASSERT_NOT_EQUAL(MAP_FAILED, mapping);
+    TEST_ASSERT_EQUAL_UINT64(0, (uintptr_t)mapping % MMLOG_HUGE_PAGE_SIZE);
+    TEST_ASSERT_EQUAL_INT('a', *(const char*)mapping);
+    munmap(mapping, MMLOG_HUGE_PAGE_SIZE);
+
+    // Clean up
+    mmlog_close(handle);
+
+    cleanup_test_files();
+}
+
+void test_mmlog_durability(void) {
+    cleanup_test_files();
+
+    log_handle_t* handle = mmlog_open(TEST_LOG_FILENAME, TEST_CHUNK_SIZE, TEST_CHUNK_COUNT);
+    TEST_ASSERT_NOT_NULL(handle);
+    TEST_ASSERT_FALSE(mmlog_set_durability(handle, MMLOG_DURABILITY_GROUP, 0));
+    TEST_ASSERT_EQUAL_INT(MMLOG_ERR_MMLOG_SET_DURABILITY_EINVAL, mmlog_errno);
+
+    // Without a sync thread, the caller does the work
+    char record[100] = {0};
+    TEST_ASSERT_TRUE(mmlog_insert(handle, record, sizeof(record)));
+    TEST_ASSERT_TRUE(mmlog_sync(handle, MMLOG_SYNC_ALL));
+    TEST_ASSERT_EQUAL_UINT64(100, atomic_load(&handle->metadata->durable));
+
+    // Nothing can be synced before it's been committed
+    mmlog_reservation_t reservation;
+    TEST_ASSERT_NOT_NULL(mmlog_reserve(handle, 100, &reservation));
+    TEST_ASSERT_FALSE(mmlog_sync(handle, 200));
+    TEST_ASSERT_EQUAL_INT(MMLOG_ERR_MMLOG_SYNC_EINVAL, mmlog_errno);
+    TEST_ASSERT_TRUE(mmlog_commit(&reservation));
+
+    // With group commit, the sync thread gets there either way
+    TEST_ASSERT_TRUE(mmlog_set_durability(handle, MMLOG_DURABILITY_GROUP, 1000));
+    TEST_ASSERT_TRUE(mmlog_sync(handle, 200));
+    TEST_ASSERT_EQUAL_UINT64(200, atomic_load(&handle->metadata->durable));
+    TEST_ASSERT_TRUE(mmlog_set_durability(handle, MMLOG_DURABILITY_GROUP, 1));
+    TEST_ASSERT_TRUE(mmlog_insert(handle, record, sizeof(record)));
+    for (int i = 0; i < 1000 && atomic_load(&handle->metadata->durable) < 300; i++) {
+        usleep(1000);
+    }
+    TEST_ASSERT_EQUAL_UINT64(300, atomic_load(&handle->metadata->durable));
+
+    // Async writeback only changes what happens when chunks are retired
+    TEST_ASSERT_TRUE(mmlog_set_durability(handle, MMLOG_DURABILITY_ASYNC, 0));
+    for (uint32_t i = 0; i < 2 * TEST_CHUNK_COUNT * TEST_CHUNK_SIZE / sizeof(record); i++) {
+        TEST_ASSERT_TRUE(mmlog_insert(handle, record, sizeof(record)));
+    }
+    TEST_ASSERT_EQUAL_UINT64(300, atomic_load(&handle->metadata->durable));
+    TEST_ASSERT_TRUE(mmlog_sync(handle, MMLOG_SYNC_ALL));
+    TEST_ASSERT_EQUAL_UINT64(atomic_load(&handle->metadata->cursor), atomic_load(&handle->metadata->durable));
+
+    // Clean up
+    mmlog_close(handle);
+
+    cleanup_test_files();
+}
+
+void test_mmlog_segment_retention(void) {
+    cleanup_test_files();
+
+    // Segments have to hold whole chunks
+    mmlog_segments_t segments = {TEST_CHUNK_SIZE + 1, 0, 2};
+    TEST_ASSERT_NULL(mmlog_open_segmented(TEST_LOG_FILENAME, TEST_CHUNK_SIZE, TEST_CHUNK_COUNT, MMLOG_FLAG_FRAMED,
+                                          &segments));
+    TEST_ASSERT_EQUAL_INT(MMLOG_ERR_MMLOG_OPEN_EINVAL, mmlog_errno);
+
+    segments.size = 2 * TEST_CHUNK_SIZE;
+    log_handle_t* handle =
+        mmlog_open_segmented(TEST_LOG_FILENAME, TEST_CHUNK_SIZE, TEST_CHUNK_COUNT, MMLOG_FLAG_FRAMED, &segments);
+    TEST_ASSERT_NOT_NULL(handle);
+    TEST_ASSERT_EQUAL_INT(-1, handle->data_fd);
+    TEST_ASSERT_TRUE(segment_exists(0));
+
+    // Records never straddle segments, so nothing bigger than one fits
+    static char big[3 * 4096];
+    TEST_ASSERT_FALSE(mmlog_insert(handle, big, sizeof(big)));
+    TEST_ASSERT_EQUAL_INT(MMLOG_ERR_MMLOG_CHECKOUT_EINVAL, mmlog_errno);
+
+    // 1000-byte payloads make 1024-byte frames, 8 to a segment
+    char record[1000] = {0};
+    for (uint32_t i = 0; i < 30; i++) {
+        memcpy(record, &i, sizeof(i));
+        TEST_ASSERT_TRUE(mmlog_insert(handle, record, sizeof(record)));
+    }
+    TEST_ASSERT_EQUAL_UINT64(3, atomic_load(&handle->metadata->segment));
+    TEST_ASSERT_EQUAL_UINT64(2, atomic_load(&handle->metadata->first_segment));
+    TEST_ASSERT_FALSE(segment_exists(0));
+    TEST_ASSERT_FALSE(segment_exists(1));
+    TEST_ASSERT_TRUE(segment_exists(2));
+    TEST_ASSERT_TRUE(segment_exists(3));
+
+    // Readers start at the oldest segment which is still around
+    mmlog_reader_t* reader = mmlog_reader_open(TEST_LOG_FILENAME);
+    TEST_ASSERT_NOT_NULL(reader);
+    const void* data;
+    size_t size;
+    uint32_t expected = 16;
+    while (mmlog_reader_next(reader, &data, &size)) {
+        TEST_ASSERT_EQUAL_UINT64(sizeof(record), size);
+        TEST_ASSERT_EQUAL_UINT32(expected++, *(const uint32_t*)data);
+    }
+    TEST_ASSERT_EQUAL_INT(MMLOG_ERR_OK, mmlog_errno);
+    TEST_ASSERT_EQUAL_UINT32(30, expected);
+    mmlog_reader_close(reader);
+
+    // Clean up
+    mmlog_close(handle);
+
+    cleanup_test_files();
+}
+
+void test_mmlog_segment_age(void) {
+    cleanup_test_files();
+
+    mmlog_segments_t segments = {2 * TEST_CHUNK_SIZE, 1, 0};
+    log_handle_t* handle = mmlog_open_segmented(TEST_LOG_FILENAME, TEST_CHUNK_SIZE, TEST_CHUNK_COUNT, 0, &segments);
+    TEST_ASSERT_NOT_NULL(handle);
+
+    // Once the segment is old enough, the next record starts a new one and the rest is skipped
+    char record[100];
+    char other[100];
+    memset(record, 'a', sizeof(record));
+    memset(other, 'b', sizeof(other));
+    TEST_ASSERT_TRUE(mmlog_insert(handle, record, sizeof(record)));
+    usleep(5000);
+    TEST_ASSERT_TRUE(mmlog_insert(handle, other, sizeof(other)));
+    TEST_ASSERT_EQUAL_UINT64(segments.size + sizeof(record), atomic_load(&handle->metadata->cursor));
+    TEST_ASSERT_EQUAL_UINT64(segments.size + sizeof(record), atomic_load(&handle->metadata->committed));
+    TEST_ASSERT_EQUAL_UINT64(1, atomic_load(&handle->metadata->segment));
+
+    // Raw readers get one segment at a time, without the rest of it
+    mmlog_reader_t* reader = mmlog_reader_open(TEST_LOG_FILENAME);
+    TEST_ASSERT_NOT_NULL(reader);
+    const char* data;
+    size_t size;
+    TEST_ASSERT_TRUE(mmlog_reader_next(reader, (const void**)&data, &size));
+    TEST_ASSERT_EQUAL_UINT64(sizeof(record), size);
+    TEST_ASSERT_EQUAL_MEMORY(record, data, sizeof(record));
+    TEST_ASSERT_TRUE(mmlog_reader_next(reader, (const void**)&data, &size));
+    TEST_ASSERT_EQUAL_UINT64(sizeof(record), size);
+    TEST_ASSERT_EQUAL_MEMORY(other, data, sizeof(other));
+    TEST_ASSERT_FALSE(mmlog_reader_next(reader, (const void**)&data, &size));
+    mmlog_reader_close(reader);
+
+    // Clean up
+    mmlog_close(handle);
+
+    cleanup_test_files();
+}
+
+void test_mmlog_segment_trailer(void) {
+    cleanup_test_files();
+
+    // Raw segments keep their last few bytes to say where their data ends
+    mmlog_segments_t segments = {2 * TEST_CHUNK_SIZE, 0, 0};
+    log_handle_t* handle = mmlog_open_segmented(TEST_LOG_FILENAME, TEST_CHUNK_SIZE, TEST_CHUNK_COUNT, 0, &segments);
+    TEST_ASSERT_NOT_NULL(handle);
+    char record[3000];
+    TEST_ASSERT_EQUAL_UINT64(LOG_CURSOR_INVALID, mmlog_checkout(handle, segments.size));
+    TEST_ASSERT_EQUAL_INT(MMLOG_ERR_MMLOG_CHECKOUT_EINVAL, mmlog_errno);
+
+    // A reader which has caught up with the first segment before it's sealed goes on to the next one
+    memset(record, 'a', sizeof(record));
+    TEST_ASSERT_TRUE(mmlog_insert(handle, record, sizeof(record)));
+    TEST_ASSERT_TRUE(mmlog_insert(handle, record, sizeof(record)));
+    mmlog_reader_t* reader = mmlog_reader_open(TEST_LOG_FILENAME);
+    TEST_ASSERT_NOT_NULL(reader);
+    const char* data;
+    size_t size;
+    TEST_ASSERT_TRUE(mmlog_reader_next(reader, (const void**)&data, &size));
+    TEST_ASSERT_EQUAL_UINT64(2 * sizeof(record), size);
+    TEST_ASSERT_FALSE(mmlog_reader_next(reader, (const void**)&data, &size));
+
+    memset(record, 'b', sizeof(record));
+    TEST_ASSERT_TRUE(mmlog_insert(handle, record, sizeof(record)));
+    TEST_ASSERT_EQUAL_UINT64(segments.size + sizeof(record), atomic_load(&handle->metadata->committed));
+    TEST_ASSERT_TRUE(mmlog_reader_next(reader, (const void**)&data, &size));
+    TEST_ASSERT_EQUAL_UINT64(sizeof(record), size);
+    TEST_ASSERT_EQUAL_MEMORY(record, data, sizeof(record));
+    TEST_ASSERT_FALSE(mmlog_reader_next(reader, (const void**)&data, &size));
+    mmlog_reader_close(reader);
+
+    // A record which fills a segment right up to its trailer, then one which has to go in the next
+    uint64_t fill = segment_capacity(handle->metadata) - sizeof(record);
+    char* big = (char*)malloc(fill);
+    TEST_ASSERT_NOT_NULL(big);
+    memset(big, 'c', fill);
+    TEST_ASSERT_TRUE(mmlog_insert(handle, big, fill));
+    memset(record, 'd', sizeof(record));
+    TEST_ASSERT_TRUE(mmlog_insert(handle, record, sizeof(record)));
+    TEST_ASSERT_EQUAL_UINT64(2 * segments.size + sizeof(record), atomic_load(&handle->metadata->committed));
+
+    // Nothing but data comes back, all the way through
+    reader = mmlog_reader_open(TEST_LOG_FILENAME);
+    TEST_ASSERT_NOT_NULL(reader);
+    const char expected[] = "aabcd";
+    uint64_t lengths[] = {sizeof(record), sizeof(record), sizeof(record), fill, sizeof(record)};
+    size_t index = 0;
+    uint64_t done = 0;
+    while (mmlog_reader_next(reader, (const void**)&data, &size)) {
+        for (size_t i = 0; i < size; i++) {
+            TEST_ASSERT_TRUE(index < 5);
+            TEST_ASSERT_EQUAL_UINT8(expected[index], data[i]);
+            if (++done == lengths[index]) {
+                index++;
+                done = 0;
+            }
+        }
+    }
+    TEST_ASSERT_EQUAL_INT(MMLOG_ERR_OK, mmlog_errno);
+    TEST_ASSERT_EQUAL_UINT64(5, index);
+    mmlog_reader_close(reader);
+    free(big);
+
+    // Clean up
+    mmlog_close(handle);
+
+    cleanup_test_files();
+}
+
+void test_mmlog_lz4_block(void) {
+    // Reference values for the frame header checksum
+    TEST_ASSERT_EQUAL_UINT32(0x02CC5D05, lz4_xxh32_short((const uint8_t*)"", 0));
+    TEST_ASSERT_EQUAL_UINT32(0x550D7456, lz4_xxh32_short((const uint8_t*)"a", 1));
+    TEST_ASSERT_EQUAL_UINT32(0x32D153FF, lz4_xxh32_short((const uint8_t*)"abc", 3));
+
+    // Repetitive data should shrink a lot, random data not at all, and both have to come back intact
+    static uint8_t src[3 * 4096 + 17];
+    static uint8_t packed[sizeof(src)];
+    static uint8_t unpacked[sizeof(src)];
+    for (size_t i = 0; i < sizeof(src); i++) {
+        src[i] = "mmlog record "[i % 13] + (i / 1000);
+    }
+    size_t size = lz4_compress_block(src, sizeof(src), packed, sizeof(packed));
+    TEST_ASSERT_TRUE(size > 0 && size < sizeof(src) / 4);
+    size_t unpacked_size = 0;
+    TEST_ASSERT_TRUE(lz4_decompress_block(packed, size, unpacked, sizeof(unpacked), &unpacked_size));
+    TEST_ASSERT_EQUAL_UINT64(sizeof(src), unpacked_size);
+    TEST_ASSERT_EQUAL_MEMORY(src, unpacked, sizeof(src));
+
+    // Not enough room for the output, or for the decompressed data
+    TEST_ASSERT_EQUAL_UINT64(0, lz4_compress_block(src, sizeof(src), packed, size - 1));
+    TEST_ASSERT_FALSE(lz4_decompress_block(packed, size, unpacked, sizeof(src) - 1, &unpacked_size));
+
+    uint32_t state = 12345;
+    for (size_t i = 0; i < sizeof(src); i++) {
+        state = state * 1103515245 + 12345;
+        src[i] = state >> 24;
+    }
+    TEST_ASSERT_EQUAL_UINT64(0, lz4_compress_block(src, sizeof(src), packed, sizeof(src) - 1));
+    size = lz4_compress_block(src, 100, packed, sizeof(packed));
+    TEST_ASSERT_TRUE(lz4_decompress_block(packed, size, unpacked, sizeof(unpacked), &unpacked_size));
+    TEST_ASSERT_EQUAL_UINT64(100, unpacked_size);
+    TEST_ASSERT_EQUAL_MEMORY(src, unpacked, 100);
+}
+
+static bool compressed_segment_exists(uint64_t segment) {
+    char path[PATH_MAX];
+    struct stat st;
+    return segment_path(path, TEST_LOG_FILENAME, segment, ".lz4") && 0 == stat(path, &st);
+}
+
+void test_mmlog_compression(void) {
+    cleanup_test_files();
+
+    // Only segmented logs can be compressed
+    log_handle_t* handle = mmlog_open(TEST_LOG_FILENAME, TEST_CHUNK_SIZE, TEST_CHUNK_COUNT);
+    TEST_ASSERT_NOT_NULL(handle);
+    TEST_ASSERT_FALSE(mmlog_set_compression(handle, true));
+    TEST_ASSERT_EQUAL_INT(MMLOG_ERR_MMLOG_SET_COMPRESSION_EINVAL, mmlog_errno);
+    mmlog_close(handle);
+    cleanup_test_files();
+
+    mmlog_segments_t segments = {2 * TEST_CHUNK_SIZE, 0, 0};
+    handle = mmlog_open_segmented(TEST_LOG_FILENAME, TEST_CHUNK_SIZE, TEST_CHUNK_COUNT, MMLOG_FLAG_FRAMED, &segments);
+    TEST_ASSERT_NOT_NULL(handle);
+    TEST_ASSERT_TRUE(mmlog_set_compression(handle, true));
+
+    // 8 records to a segment, so the first three get sealed
+    char record[1000] = {0};
+    for (uint32_t i = 0; i < 30; i++) {
+        memcpy(record, &i, sizeof(i));
+        TEST_ASSERT_TRUE(mmlog_insert(handle, record, sizeof(record)));
+    }
+    for (int i = 0; i < 200 && segment_exists(2); i++) {
+        usleep(10000);
+    }
+    for (uint64_t segment = 0; segment < 3; segment++) {
+        TEST_ASSERT_FALSE(segment_exists(segment));
+        TEST_ASSERT_TRUE(compressed_segment_exists(segment));
+    }
+    TEST_ASSERT_TRUE(segment_exists(3));
+    TEST_ASSERT_FALSE(compressed_segment_exists(3));
+    TEST_ASSERT_TRUE(mmlog_set_compression(handle, false));
+
+    // Each compressed segment is a plain LZ4 frame, followed by the index of its blocks (one per chunk)
+    char path[PATH_MAX];
+    TEST_ASSERT_TRUE(segment_path(path, TEST_LOG_FILENAME, 0, ".lz4"));
+    int fd = open(path, O_RDONLY);
+    TEST_ASSERT_NOT_EQUAL(-1, fd);
+    struct stat st;
+    TEST_ASSERT_EQUAL_INT(0, fstat(fd, &st));
+    uint32_t magic;
+    TEST_ASSERT_EQUAL_INT((int)sizeof(magic), pread(fd, &magic, sizeof(magic), 0));
+    TEST_ASSERT_EQUAL_UINT32(MMLOG_LZ4_MAGIC, magic);
+    uint32_t index[2];
+    TEST_ASSERT_EQUAL_INT((int)sizeof(index), pread(fd, index, sizeof(index), st.st_size - 8 - 8 * 3));
+    close(fd);
+    TEST_ASSERT_EQUAL_UINT32(MMLOG_LZ4_INDEX_MAGIC, index[0]);
+    TEST_ASSERT_EQUAL_UINT32(8 * 3, index[1]);
+
+    // Readers can't tell the difference, but only ever have the block they're reading decompressed
+    mmlog_reader_t* reader = mmlog_reader_open(TEST_LOG_FILENAME);
+    TEST_ASSERT_NOT_NULL(reader);
+    const void* data;
+    size_t size;
+    uint32_t expected = 0;
+    uint32_t inflated = 0;
+    while (mmlog_reader_next(reader, &data, &size)) {
+        TEST_ASSERT_EQUAL_UINT64(sizeof(record), size);
+        TEST_ASSERT_EQUAL_UINT32(expected++, *(const uint32_t*)data);
+        if (-1 != reader->lz4_fd) {
+            TEST_ASSERT_EQUAL_UINT64(TEST_CHUNK_SIZE, reader->inflated_end - reader->inflated_start);
+            inflated++;
+        }
+    }
+    TEST_ASSERT_EQUAL_INT(MMLOG_ERR_OK, mmlog_errno);
+    TEST_ASSERT_EQUAL_UINT32(30, expected);
+    TEST_ASSERT_EQUAL_UINT32(24, inflated);
+    mmlog_reader_close(reader);
+    mmlog_close(handle);
+    cleanup_test_files();
+
+    // Raw readers get compressed segments back a block at a time
+    handle = mmlog_open_segmented(TEST_LOG_FILENAME, TEST_CHUNK_SIZE, TEST_CHUNK_COUNT, 0, &segments);
+    TEST_ASSERT_NOT_NULL(handle);
+    TEST_ASSERT_TRUE(mmlog_set_compression(handle, true));
+    for (uint32_t i = 0; i < 3 * TEST_CHUNK_SIZE / 512; i++) {
+        memset(record, 'a' + i % 26, 512);
+        TEST_ASSERT_TRUE(mmlog_insert(handle, record, 512));
+    }
+    for (int i = 0; i < 200 && segment_exists(0); i++) {
+        usleep(10000);
+    }
+    TEST_ASSERT_TRUE(compressed_segment_exists(0));
+    TEST_ASSERT_TRUE(mmlog_set_compression(handle, false));
+
+    reader = mmlog_reader_open(TEST_LOG_FILENAME);
+    TEST_ASSERT_NOT_NULL(reader);
+    uint64_t pos = 0;
+    while (mmlog_reader_next(reader, &data, &size)) {
+        TEST_ASSERT_TRUE(-1 == reader->lz4_fd || size <= TEST_CHUNK_SIZE);
+        for (uint64_t j = 0; j < size; j++, pos++) {
+            TEST_ASSERT_EQUAL_UINT8('a' + pos / 512 % 26, ((const char*)data)[j]);
+        }
+    }
+    TEST_ASSERT_EQUAL_UINT64(3 * TEST_CHUNK_SIZE, pos);
+    mmlog_reader_close(reader);
+
+    // Clean up
+    mmlog_close(handle);
+
+    cleanup_test_files();
+}
+
+void test_mmlog_compression_analysis(void) {
+#ifndef MMLOG_LZ4_ANALYZE
+    TEST_IGNORE_MESSAGE("Needs a Python with the lz4 module when configuring");
+#else
+    cleanup_test_files();
+
+    mmlog_segments_t segments = {2 * TEST_CHUNK_SIZE, 0, 0};
+    log_handle_t* handle =
+        mmlog_open_segmented(TEST_LOG_FILENAME, TEST_CHUNK_SIZE, TEST_CHUNK_COUNT, MMLOG_FLAG_FRAMED, &segments);
+    TEST_ASSERT_NOT_NULL(handle);
+    TEST_ASSERT_TRUE(mmlog_set_compression(handle, true));
+    char record[1000] = {0};
+    for (uint32_t i = 0; i < 10; i++) {
+        memcpy(record, &i, sizeof(i));
+        TEST_ASSERT_TRUE(mmlog_insert(handle, record, sizeof(record)));
+    }
+    for (int i = 0; i < 200 && segment_exists(0); i++) {
+        usleep(10000);
+    }
+    TEST_ASSERT_TRUE(compressed_segment_exists(0));
+    TEST_ASSERT_TRUE(mmlog_set_compression(handle, false));
+
+    // lz4_analyze/analysis.py makes sense of a real segment, block by block, and lz4.frame decompresses all of it
+    char path[PATH_MAX];
+    TEST_ASSERT_TRUE(segment_path(path, TEST_LOG_FILENAME, 0, ".lz4"));
+    char command[2 * PATH_MAX];
+    snprintf(command, sizeof(command), "%s %s", MMLOG_LZ4_ANALYZE, path);
+    FILE* pipe = popen(command, "r");
+    TEST_ASSERT_NOT_NULL(pipe);
+    static char output[1 << 16];
+    size_t size = fread(output, 1, sizeof(output) - 1, pipe);
+    output[size] = '\0';
+    TEST_ASSERT_EQUAL_INT(0, pclose(pipe));
+    TEST_ASSERT_NOT_NULL(strstr(output, "Valid LZ4 frame detected"));
+    TEST_ASSERT_NOT_NULL(strstr(output, "Block Mode: Independent"));
+    TEST_ASSERT_NOT_NULL(strstr(output, "Total chunks: 2"));
+    TEST_ASSERT_NOT_NULL(strstr(output, "Actual uncompressed size: 8192 bytes"));
+    TEST_ASSERT_NULL(strstr(output, "Non-standard"));
+
+    // Clean up
+    mmlog_close(handle);
+
+    cleanup_test_files();
+#endif
+}
+
+// Drops a handle the way a crash would, without committing or cleaning up anything
+static void abandon_handle(log_handle_t* handle) {
+    munmap(handle->metadata, sizeof(log_metadata_t));
+    close(handle->metadata_fd);
+    if (-1 != handle->data_fd) {
+        close(handle->data_fd);
+    }
+    free(handle->chunks.pool);
     free(handle->chunks.buffer);
+    free(handle->filename);
     free(handle);
+}
+
+static uint32_t count_records(void) {
+    mmlog_reader_t* reader = mmlog_reader_open(TEST_LOG_FILENAME);
+    TEST_ASSERT_NOT_NULL(reader);
+    const void* data;
+    size_t size;
+    uint32_t count = 0;
+    while (mmlog_reader_next(reader, &data, &size)) {
+        count++;
+    }
+    TEST_ASSERT_EQUAL_INT(MMLOG_ERR_OK, mmlog_errno);
+    mmlog_reader_close(reader);
+    return count;
+}
+
+void test_mmlog_recovery(void) {
+    cleanup_test_files();
+
+    log_handle_t* handle = mmlog_open_ex(TEST_LOG_FILENAME, TEST_CHUNK_SIZE, TEST_CHUNK_COUNT, MMLOG_FLAG_FRAMED);
+    TEST_ASSERT_NOT_NULL(handle);
+    char record[100] = {0};
+    for (int i = 0; i < 10; i++) {
+        TEST_ASSERT_TRUE(mmlog_insert(handle, record, sizeof(record)));
+    }
+
+    // A second handle just joins in
+    log_handle_t* other = mmlog_open_ex(TEST_LOG_FILENAME, TEST_CHUNK_SIZE, TEST_CHUNK_COUNT, MMLOG_FLAG_FRAMED);
+    TEST_ASSERT_NOT_NULL(other);
+    TEST_ASSERT_EQUAL_UINT64(atomic_load(&handle->metadata->cursor), atomic_load(&other->metadata->cursor));
+    abandon_handle(other);
+
+    // A writer dies holding a reservation, so everything after it is stuck behind the watermark
+    mmlog_reservation_t reservation;
+    TEST_ASSERT_NOT_NULL(mmlog_reserve(handle, sizeof(record), &reservation));
+    uint64_t stuck = atomic_load(&handle->metadata->committed);
+    for (int i = 0; i < 2; i++) {
+        TEST_ASSERT_TRUE(mmlog_insert(handle, record, sizeof(record)));
+    }
+    uint64_t cursor = atomic_load(&handle->metadata->cursor);
+    uint64_t sequence = atomic_load(&handle->metadata->sequence);
+    TEST_ASSERT_EQUAL_UINT64(stuck, atomic_load(&handle->metadata->committed));
+    abandon_handle(handle);
+
+    // Reopening picks up where it left off, with the abandoned record turned into a skip
+    handle = mmlog_open_ex(TEST_LOG_FILENAME, TEST_CHUNK_SIZE, TEST_CHUNK_COUNT, MMLOG_FLAG_FRAMED);
+    TEST_ASSERT_NOT_NULL(handle);
+    TEST_ASSERT_EQUAL_UINT64(cursor, atomic_load(&handle->metadata->cursor));
+    TEST_ASSERT_EQUAL_UINT64(cursor, atomic_load(&handle->metadata->committed));
+    TEST_ASSERT_EQUAL_UINT64(sequence, atomic_load(&handle->metadata->sequence));
+    TEST_ASSERT_TRUE(mmlog_insert(handle, record, sizeof(record)));
+    TEST_ASSERT_EQUAL_UINT32(13, count_records());
+    abandon_handle(handle);
+
+    // Even without the metadata, framed logs can be followed from the start
+    char meta_filename[256];
+    snprintf(meta_filename, sizeof(meta_filename), "%s.mmlog", TEST_LOG_FILENAME);
+    unlink(meta_filename);
+    handle = mmlog_open_ex(TEST_LOG_FILENAME, TEST_CHUNK_SIZE, TEST_CHUNK_COUNT, MMLOG_FLAG_FRAMED);
+    TEST_ASSERT_NOT_NULL(handle);
+    TEST_ASSERT_EQUAL_UINT64(cursor + mmlog_frame_size(sizeof(record)), atomic_load(&handle->metadata->cursor));
+    TEST_ASSERT_EQUAL_UINT32(13, count_records());
+    abandon_handle(handle);
+
+    // Half-created metadata is thrown away
+    int fd = open(meta_filename, O_RDWR | O_TRUNC);
+    TEST_ASSERT_NOT_EQUAL(-1, fd);
+    TEST_ASSERT_EQUAL_INT(0, ftruncate(fd, sizeof(log_metadata_t)));
+    close(fd);
+    handle = mmlog_open(TEST_LOG_FILENAME, TEST_CHUNK_SIZE, TEST_CHUNK_COUNT);
+    TEST_ASSERT_NOT_NULL(handle);
+    TEST_ASSERT_EQUAL_UINT64(0, atomic_load(&handle->metadata->cursor));
+    abandon_handle(handle);
 
     cleanup_test_files();
 }
 
+void test_mmlog_recovery_scan(void) {
+    cleanup_test_files();
+
+    log_handle_t* handle = mmlog_open_ex(TEST_LOG_FILENAME, TEST_CHUNK_SIZE, TEST_CHUNK_COUNT, MMLOG_FLAG_FRAMED);
+    TEST_ASSERT_NOT_NULL(handle);
+    char record[100] = {0};
+    const uint64_t frame_size = mmlog_frame_size(sizeof(record));
+    for (int i = 0; i < 3; i++) {
+        TEST_ASSERT_TRUE(mmlog_insert(handle, record, sizeof(record)));
+    }
+
+    // One writer dies before it gets anything down, and another leaves a header which makes no sense; the records
+    // after them were written in full, and have to survive
+    uint64_t blank = mmlog_checkout(handle, frame_size);
+    TEST_ASSERT_TRUE(mmlog_insert(handle, record, sizeof(record)));
+    uint64_t garbage = mmlog_checkout(handle, frame_size);
+    mmlog_skip_t junk = {0x12345678, 5};
+    TEST_ASSERT_EQUAL_INT(sizeof(junk), pwrite(handle->data_fd, &junk, sizeof(junk), garbage));
+    TEST_ASSERT_TRUE(mmlog_insert(handle, record, sizeof(record)));
+    uint64_t cursor = atomic_load(&handle->metadata->cursor);
+    TEST_ASSERT_EQUAL_UINT64(blank, atomic_load(&handle->metadata->committed));
+    abandon_handle(handle);
+
+    handle = mmlog_open_ex(TEST_LOG_FILENAME, TEST_CHUNK_SIZE, TEST_CHUNK_COUNT, MMLOG_FLAG_FRAMED);
+    TEST_ASSERT_NOT_NULL(handle);
+    TEST_ASSERT_EQUAL_UINT64(cursor, atomic_load(&handle->metadata->committed));
+    TEST_ASSERT_EQUAL_UINT32(5, count_records());
+    const uint64_t holes[] = {blank, garbage};
+    for (int i = 0; i < 2; i++) {
+        mmlog_skip_t skip;
+        TEST_ASSERT_EQUAL_INT(sizeof(skip), pread(handle->data_fd, &skip, sizeof(skip), holes[i]));
+        TEST_ASSERT_EQUAL_UINT32(MMLOG_SKIP_MAGIC, skip.magic);
+        TEST_ASSERT_EQUAL_UINT32(frame_size, skip.length);
+    }
+
+    // With nothing intact after it, a blank header is where the log ends
+    TEST_ASSERT_EQUAL_UINT64(cursor, mmlog_checkout(handle, frame_size));
+    abandon_handle(handle);
+    handle = mmlog_open_ex(TEST_LOG_FILENAME, TEST_CHUNK_SIZE, TEST_CHUNK_COUNT, MMLOG_FLAG_FRAMED);
+    TEST_ASSERT_NOT_NULL(handle);
+    TEST_ASSERT_EQUAL_UINT64(cursor, atomic_load(&handle->metadata->cursor));
+    TEST_ASSERT_EQUAL_UINT32(5, count_records());
+    abandon_handle(handle);
+
+    cleanup_test_files();
+}
+
+static uint64_t latency_samples(const mmlog_stats_t* stats) {
+    uint64_t samples = 0;
+    for (uint32_t i = 0; i < MMLOG_STATS_BUCKETS; i++) {
+        samples += stats->latency[i];
+    }
+    return samples;
+}
+
+void test_mmlog_stalls(void) {
+    cleanup_test_files();
+
+    // Whoever held the expansion lock died with it, so nobody can grow the file
+    log_handle_t* handle = mmlog_open(TEST_LOG_FILENAME, TEST_CHUNK_SIZE, TEST_CHUNK_COUNT);
+    TEST_ASSERT_NOT_NULL(handle);
+    atomic_store(&handle->metadata->is_locked, 1);
+    uint64_t file_size = atomic_load(&handle->metadata->file_size);
+    TEST_ASSERT_EQUAL_UINT64(LOG_CURSOR_INVALID, mmlog_checkout(handle, file_size + 1));
+    TEST_ASSERT_EQUAL_INT(MMLOG_ERR_MMLOG_CHECKOUT_STALE_LOCK, mmlog_errno);
+    TEST_ASSERT_TRUE(atomic_load(&handle->metadata->is_panicked));
+    abandon_handle(handle);
+
+    // Recovery clears the lock and the panic
+    handle = mmlog_open(TEST_LOG_FILENAME, TEST_CHUNK_SIZE, TEST_CHUNK_COUNT);
+    TEST_ASSERT_NOT_NULL(handle);
+    TEST_ASSERT_FALSE(atomic_load(&handle->metadata->is_panicked));
+    char record[8] = {0};
+    TEST_ASSERT_TRUE(mmlog_insert(handle, record, sizeof(record)));
+
+    // Writers die holding every other reservation, so each record committed in between takes a pending slot of its own
+    // and keeps it.  Once they're all taken, the next commit has nowhere to go.
+    mmlog_reservation_t reservations[2 * MMLOG_PENDING_COMMITS + 3];
+    size_t count = sizeof(reservations) / sizeof(reservations[0]);
+    for (size_t i = 0; i < count; i++) {
+        TEST_ASSERT_NOT_NULL(mmlog_reserve(handle, sizeof(record), &reservations[i]));
+    }
+    for (size_t i = 2; i < count - 1; i += 2) {
+        TEST_ASSERT_TRUE(mmlog_commit(&reservations[i]));
+    }
+    TEST_ASSERT_FALSE(mmlog_commit(&reservations[count - 1]));
+    TEST_ASSERT_EQUAL_INT(MMLOG_ERR_COMMIT_RANGE_STALLED, mmlog_errno);
+    TEST_ASSERT_TRUE(atomic_load(&handle->metadata->is_panicked));
+    abandon_handle(handle);
+
+    cleanup_test_files();
+}
+
+void test_mmlog_stats(void) {
+    cleanup_test_files();
+
+    log_handle_t* handle = mmlog_open(TEST_LOG_FILENAME, TEST_CHUNK_SIZE, TEST_CHUNK_COUNT);
+    TEST_ASSERT_NOT_NULL(handle);
+    mmlog_stats_t stats;
+    TEST_ASSERT_TRUE(mmlog_stats(handle, &stats));
+    TEST_ASSERT_EQUAL_UINT64(0, stats.inserts);
+
+    // Every insert path counts records and bytes; only the single-record ones are timed
+    char record[100] = {0};
+    for (int i = 0; i < 10; i++) {
+        TEST_ASSERT_TRUE(mmlog_insert(handle, record, sizeof(record)));
+    }
+    struct iovec iov[] = {{record, 10}, {record, 20}};
+    TEST_ASSERT_TRUE(mmlog_insertv(handle, iov, 2));
+    TEST_ASSERT_TRUE(mmlog_insert_batch(handle, iov, 2));
+    mmlog_reservation_t reservation;
+    TEST_ASSERT_NOT_NULL(mmlog_reserve(handle, 40, &reservation));
+    TEST_ASSERT_TRUE(mmlog_commit(&reservation));
+    TEST_ASSERT_TRUE(mmlog_stats(handle, &stats));
+    TEST_ASSERT_EQUAL_UINT64(14, stats.inserts);
+    TEST_ASSERT_EQUAL_UINT64(10 * sizeof(record) + 30 + 30 + 40, stats.bytes);
+    TEST_ASSERT_EQUAL_UINT64(11, latency_samples(&stats));
+    TEST_ASSERT_EQUAL_UINT64(0, stats.pwrite_fallbacks);
+    TEST_ASSERT_EQUAL_UINT64(0, stats.ring_full);
+
+    // Records spanning more than two chunks bypass the ring
+    char* large = (char*)calloc(1, 3 * TEST_CHUNK_SIZE);
+    TEST_ASSERT_NOT_NULL(large);
+    TEST_ASSERT_TRUE(mmlog_insert(handle, large, 3 * TEST_CHUNK_SIZE));
+    free(large);
+    TEST_ASSERT_TRUE(mmlog_stats(handle, &stats));
+    TEST_ASSERT_EQUAL_UINT64(1, stats.pwrite_fallbacks);
+
+    // A reservation held open pins its chunk, so the ring fills up behind it
+    TEST_ASSERT_NOT_NULL(mmlog_reserve(handle, 40, &reservation));
+    for (uint32_t i = 0; i < 2 * TEST_CHUNK_COUNT * TEST_CHUNK_SIZE / sizeof(record); i++) {
+        TEST_ASSERT_TRUE(mmlog_insert(handle, record, sizeof(record)));
+    }
+    TEST_ASSERT_TRUE(mmlog_commit(&reservation));
+    TEST_ASSERT_TRUE(mmlog_stats(handle, &stats));
+    TEST_ASSERT_TRUE(stats.ring_full > 0);
+
+    // The counters live in the log, so anybody can watch them
+    mmlog_reader_t* reader = mmlog_reader_open(TEST_LOG_FILENAME);
+    TEST_ASSERT_NOT_NULL(reader);
+    mmlog_stats_t reader_stats;
+    TEST_ASSERT_TRUE(mmlog_reader_stats(reader, &reader_stats));
+    TEST_ASSERT_EQUAL_MEMORY(&stats, &reader_stats, sizeof(stats));
+    mmlog_reader_close(reader);
+
+    TEST_ASSERT_FALSE(mmlog_stats(NULL, &stats));
+    TEST_ASSERT_EQUAL_INT(MMLOG_ERR_MMLOG_STATS_EINVAL, mmlog_errno);
+
+    mmlog_close(handle);
+    cleanup_test_files();
+}
+
+// Counts the mappings of files whose path contains `name`
+static uint32_t count_mappings(const char* name) {
+    FILE* maps = fopen("/proc/self/maps", "r");
+    TEST_ASSERT_NOT_NULL(maps);
+    uint32_t mappings = 0;
+    char line[4096];
+    while (fgets(line, sizeof(line), maps)) {
+        mappings += NULL != strstr(line, name);
+    }
+    fclose(maps);
+    return mappings;
+}
+
+static uint32_t count_fds(void) {
+    DIR* dir = opendir("/proc/self/fd");
+    TEST_ASSERT_NOT_NULL(dir);
+    uint32_t fds = 0;
+    while (readdir(dir)) {
+        fds++;
+    }
+    closedir(dir);
+    return fds;
+}
+
+#define FLAT_LOG_FILENAME "test_mmlog_flat.log"
+
+// Opens a log with every helper turned on, writes through all of them, then closes it
+static void close_cycle(void) {
+    cleanup_test_files();
+    mmlog_segments_t segments = {2 * TEST_CHUNK_SIZE, 0, 2};
+    log_handle_t* handle =
+        mmlog_open_segmented(TEST_LOG_FILENAME, TEST_CHUNK_SIZE, TEST_CHUNK_COUNT, MMLOG_FLAG_FRAMED, &segments);
+    TEST_ASSERT_NOT_NULL(handle);
+    TEST_ASSERT_TRUE(mmlog_set_slab_size(handle, 1024));
+    TEST_ASSERT_TRUE(mmlog_set_prefetch(handle, 2));
+    TEST_ASSERT_TRUE(mmlog_set_durability(handle, MMLOG_DURABILITY_GROUP, 1));
+    TEST_ASSERT_TRUE(mmlog_set_compression(handle, true));
+    char record[300] = {0};
+    for (int i = 0; i < 100; i++) {
+        TEST_ASSERT_TRUE(mmlog_insert(handle, record, sizeof(record)));
+    }
+    TEST_ASSERT_TRUE(mmlog_close(handle));
+
+    handle = mmlog_open(FLAT_LOG_FILENAME, TEST_CHUNK_SIZE, TEST_CHUNK_COUNT);
+    TEST_ASSERT_NOT_NULL(handle);
+    for (int i = 0; i < 100; i++) {
+        TEST_ASSERT_TRUE(mmlog_insert(handle, record, sizeof(record)));
+    }
+    TEST_ASSERT_TRUE(mmlog_close(handle));
+}
+
+void test_mmlog_close_leaks(void) {
+    cleanup_test_files();
+    TEST_ASSERT_FALSE(mmlog_close(NULL));
+    TEST_ASSERT_EQUAL_INT(MMLOG_ERR_MMLOG_CLOSE_EINVAL, mmlog_errno);
+
+    // Nothing of the log stays mapped or open, no matter how many times it's reopened.  Crashed handles in earlier
+    // tests may have left some of their chunks behind.
+    uint32_t mappings = count_mappings(TEST_LOG_FILENAME);
+    uint32_t fds = count_fds();
+    for (int i = 0; i < 20; i++) {
+        close_cycle();
+    }
+    TEST_ASSERT_EQUAL_UINT32(mappings, count_mappings(TEST_LOG_FILENAME));
+    TEST_ASSERT_EQUAL_UINT32(0, count_mappings(FLAT_LOG_FILENAME));
+    TEST_ASSERT_EQUAL_UINT32(fds, count_fds());
+
+    // Nothing is left holding the lock either, so the log can be reopened and read back
+    log_handle_t* handle = mmlog_open(FLAT_LOG_FILENAME, TEST_CHUNK_SIZE, TEST_CHUNK_COUNT);
+    TEST_ASSERT_NOT_NULL(handle);
+    TEST_ASSERT_TRUE(mmlog_close(handle));
+
+    unlink(FLAT_LOG_FILENAME);
+    unlink(FLAT_LOG_FILENAME ".mmlog");
+    cleanup_test_files();
+}
+
 int main(void) {
     UNITY_BEGIN();
 
@@ -881,9 +2498,11 @@ int main(void) {
     RUN_TEST(test_mmlog_insert_and_checkout);
     RUN_TEST(test_mmlog_multiple_inserts);
     RUN_TEST(test_mmlog_large_insert);
+    RUN_TEST(test_mmlog_large_insert_signals);
 
     // Threading tests
     RUN_TEST(test_mmlog_concurrent_inserts);
+    RUN_TEST(test_mmlog_concurrent_rollover);
 
     // Forking tests
     RUN_TEST(test_mmlog_fork_basic);
@@ -900,5 +2519,61 @@ int main(void) {
     RUN_TEST(test_mmlog_random_data);
     RUN_TEST(test_mmlog_trim_validation);
 
+    // Slab reservation tests
+    RUN_TEST(test_mmlog_slab_reservation);
+    RUN_TEST(test_mmlog_slab_fork);
+    RUN_TEST(test_mmlog_slab_commit);
+
+    // Framed record tests
+    RUN_TEST(test_mmlog_crc32c);
+    RUN_TEST(test_mmlog_framed_records);
+    RUN_TEST(test_mmlog_framed_slab_skip);
+
+    // Reserve/commit tests
+    RUN_TEST(test_mmlog_reserve_commit);
+    RUN_TEST(test_mmlog_framed_reserve_commit);
+    RUN_TEST(test_mmlog_abandon);
+    RUN_TEST(test_mmlog_raw_padding);
+    RUN_TEST(test_mmlog_insertv);
+    RUN_TEST(test_mmlog_insert_batch);
+
+    // Reader tests
+    RUN_TEST(test_mmlog_reader_watermark);
+    RUN_TEST(test_mmlog_reader_follow);
+    RUN_TEST(test_mmlog_write_failure);
+
+    // Prefetch tests
+    RUN_TEST(test_mmlog_prefetch);
+
+    // Descriptor pool tests
+    RUN_TEST(test_mmlog_descriptor_pool);
+
+    // Huge page tests
+    RUN_TEST(test_mmlog_hugepages);
+
+    // Durability tests
+    RUN_TEST(test_mmlog_durability);
+
+    // Segment tests
+    RUN_TEST(test_mmlog_segment_retention);
+    RUN_TEST(test_mmlog_segment_age);
+    RUN_TEST(test_mmlog_segment_trailer);
+
+    // Compression tests
+    RUN_TEST(test_mmlog_lz4_block);
+    RUN_TEST(test_mmlog_compression);
+    RUN_TEST(test_mmlog_compression_analysis);
+
+    // Recovery tests
+    RUN_TEST(test_mmlog_recovery);
+    RUN_TEST(test_mmlog_recovery_scan);
+    RUN_TEST(test_mmlog_stalls);
+
+    // Stats tests
+    RUN_TEST(test_mmlog_stats);
+
+    // Close tests
+    RUN_TEST(test_mmlog_close_leaks);
+
     return UNITY_END();
 }
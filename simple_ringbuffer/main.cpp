@@ -1,43 +1,86 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <iostream>
+#include <string>
+#include <vector>
 
 #include "ring_buffer.hpp"
 
-void my_iterator(std::string_view filename, std::string_view name, int64_t line) {
-  std::cout << filename << ":" << name << ":" << line << std::endl;
+constexpr int num_producers = 4;
+constexpr int64_t entries_per_producer = 100000;
+
+// Each producer's lines have to show up in order, and all of them have to show up
+std::vector<int64_t> next_line(num_producers, 0);
+bool in_order = true;
+
+void check_iterator(std::string_view filename, std::string_view name, int64_t line) {
+  int producer = std::stoi(std::string(filename.substr(filename.find('_') + 1)));
+  if (name != "Checkers" || line != next_line[producer]) {
+    in_order = false;
+  }
+  next_line[producer] = line + 1;
 }
 
-void null_iterator(std::string_view filename, std::string_view name, int64_t line) {}
+void null_iterator(std::string_view, std::string_view, int64_t) {}
 
-int main() {
-  RingBuffer *_rb = new RingBuffer(1024);
+// Runs the producers against a fresh ring and checks what comes out
+bool run(uint32_t intern_strings) {
+  RingBuffer *_rb = new RingBuffer(64 * 1024, false, intern_strings);
   RingBuffer &rb = *_rb;
+  std::fill(next_line.begin(), next_line.end(), 0);
+  in_order = true;
 
-  // Now we're going to fork.  The parent will write to the ring buffer and the child will read from it
-  pid_t pid = fork();
-  if (pid == 0) {
-    sleep(1);
-    while (rb.read(my_iterator)) {
-      std::cout << "Read" << std::endl;
-    }
-    std::cout << "Ring buffer empty" << std::endl;
-    exit(0);
-  } else {
-    RBIn in;
-    for (int i = 0; i < 10; i++) {
-      in.push("Hello" + std::to_string(i), "Checkers" + std::to_string(i), i);
-    }
-    while (rb.write(in)) {
+  // Now we're going to fork.  The children all write to the ring buffer at once and the parent reads from it
+  std::vector<pid_t> pids;
+  for (int i = 0; i < num_producers; i++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      // Half the producers batch through an RBIn, the other half write straight into the ring
+      std::string filename = "Producer_" + std::to_string(i);
+      RBIn in{rb.strings()};
+      for (int64_t line = 0; line < entries_per_producer; line++) {
+        if (i % 2) {
+          while (!rb.write(filename, "Checkers", line)) {
+            std::this_thread::yield();  // Full
+          }
+          continue;
+        }
+        in.clear();
+        in.push(filename, "Checkers", line);
+        while (!rb.write(in)) {
+          std::this_thread::yield();  // Full
+        }
+      }
+      exit(0);
     }
+    pids.push_back(pid);
+  }
+
+  // The reader sleeps whenever it catches up, instead of spinning
+  int64_t entries = 0;
+  while (entries < num_producers * entries_per_producer && rb.read_wait(check_iterator, std::chrono::seconds(5))) {
+    entries++;
+  }
+  for (pid_t pid : pids) {
     waitpid(pid, nullptr, 0);
   }
+  std::cout << "Read " << entries << " entries from " << num_producers << " producers"
+            << (intern_strings ? ", interning up to " + std::to_string(intern_strings) + " strings" : "")
+            << (in_order ? "" : ", but some were out of order") << std::endl;
 
   if (rb.read(null_iterator)) {
     std::cout << "Ring buffer not empty after read" << std::endl;
-    return 1;
+    return false;
   }
+  delete _rb;
+  return in_order && entries == num_producers * entries_per_producer;
+}
 
-  // Bla bla bla cleanup, TBD
+int main() {
+  // There are more distinct strings than the table has room for, so some get interned and the rest are stored inline
+  bool ok = run(0);
+  ok = run(num_producers / 2) && ok;
+  return ok ? 0 : 1;
 }
@@ -1,17 +1,24 @@
 #pragma once
 
 #include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <array>
 #include <atomic>
+#include <chrono>
+#include <climits>
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
 #include <functional>
 #include <iostream>
+#include <new>
 #include <stdexcept>
 #include <string>
 #include <string_view>
@@ -26,51 +33,240 @@
 template<typename T>
 class Buffer {
  public:
-  void add(const T& value);
-  size_t stored_size() const;
-  size_t size() const;
-  const T* data() const;
-  void clear();
+  void add(const T& value) { buffer.push_back(value); }
+  size_t serializedSize() const { return buffer.size() * sizeof(T); }
+  size_t size() const { return buffer.size(); }
+  const T* data() const { return buffer.data(); }
+  void clear() { buffer.clear(); }
 
  private:
   std::vector<T> buffer;
 };
 
-// Specialization for std::string and std::string_view
+// Specialization for std::string and std::string_view.  Only the views are kept: each string is copied once, by
+// serialize(), straight into wherever the entry is going.  So the strings have to outlive the buffer's contents.
 template<>
 class Buffer<std::string_view> {
  public:
-  void add(std::string_view val);
-  size_t serializedSize() const;
-  const char* data() const;
-  void clear();
-  size_t size() const;
+  void add(std::string_view val) {
+    views.push_back(val);
+    bytes += val.size() + 1;
+  }
+  size_t serializedSize() const { return bytes; }
+  void clear() {
+    views.clear();
+    bytes = 0;
+  }
+  size_t size() const { return views.size(); }
+
+  // Strings are stored back to back, each with its terminator
+  void serialize(unsigned char*& write_ptr) const {
+    for (std::string_view val : views) {
+      char* dest = reinterpret_cast<char*>(write_ptr);
+      dest[val.copy(dest, val.size())] = '\0';
+      write_ptr += val.size() + 1;
+    }
+  }
 
  private:
-  std::vector<char> buffer;
-  size_t n_elem = 0;
+  std::vector<std::string_view> views;
+  size_t bytes = 0;
+};
+
+// Interns strings into shared memory, so that entries can refer to them by a 32-bit id instead of carrying a copy.
+// The table is mapped MAP_SHARED, so like the ring it has to be set up before forking.  Strings are never removed:
+// once max_strings of them (or arena_size bytes' worth) are in, intern() returns 0 for anything new, and callers fall
+// back to storing the string inline.
+class StringTable {
+ public:
+  StringTable() = default;  // Disabled, as is a table with no room for strings; intern() always returns 0
+  StringTable(uint32_t _max_strings, size_t _arena_size) : max_strings{_max_strings}, arena_size{_arena_size} {
+    if (!max_strings) {
+      return;
+    }
+    capacity = 1;
+    while (capacity < 2 * max_strings) {
+      capacity *= 2;  // Never more than half full, so probes stay short
+    }
+    size_t slots_offset = ALIGN(sizeof(Shared), 64);
+    size_t entries_offset = slots_offset + capacity * sizeof(Slot);
+    size_t arena_offset = entries_offset + (max_strings + 1) * sizeof(Entry);
+    mapping_size = PAGE_ALIGN(arena_offset + arena_size);
+
+    mapping = static_cast<unsigned char *>(
+      mmap(NULL, mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+    if (mapping == MAP_FAILED) {
+      mapping = nullptr;
+      throw std::runtime_error("Failed to create string table");
+    }
+
+    // Anonymous memory is zeroed, which is what everything starts out as
+    shared = new (mapping) Shared{};
+    slots = reinterpret_cast<Slot *>(mapping + slots_offset);
+    entries = reinterpret_cast<Entry *>(mapping + entries_offset);
+    arena = reinterpret_cast<char *>(mapping + arena_offset);
+  }
+  ~StringTable() {
+    if (mapping) {
+      munmap(mapping, mapping_size);
+    }
+  }
+  StringTable(const StringTable &) = delete;
+  StringTable &operator=(const StringTable &) = delete;
 
-  void add_string(std::string_view val);
+  bool enabled() const { return mapping != nullptr; }
+
+  // Returns the string's id, adding it if it isn't in yet, or 0 if it isn't and there's no room for it
+  uint32_t intern(std::string_view str) {
+    if (!enabled() || str.size() > arena_size) {
+      return 0;
+    }
+    uint32_t hash = fnv1a(str);
+    for (uint32_t probe = 0; probe < capacity; probe++) {
+      Slot &slot = slots[(hash + probe) & (capacity - 1)];
+      uint32_t id = slot.id.load(std::memory_order_acquire);
+      if (id == empty) {
+        if (slot.id.compare_exchange_strong(id, busy, std::memory_order_acquire)) {
+          id = insert(str);
+          slot.hash = hash;
+          slot.id.store(id, std::memory_order_release);  // Back to empty if there was no room
+          return id;
+        }
+      }
+
+      // Someone else is adding a string to this slot; it takes a memcpy, so it's worth waiting for
+      while (id == busy) {
+        std::this_thread::yield();
+        id = slot.id.load(std::memory_order_acquire);
+      }
+      if (id != empty && slot.hash == hash && resolve(id) == str) {
+        return id;
+      }
+    }
+    return 0;
+  }
+
+  // O(1); only valid for ids that intern() returned
+  std::string_view resolve(uint32_t id) const { return {arena + entries[id].offset, entries[id].length}; }
+
+ private:
+  static constexpr uint32_t empty = 0;
+  static constexpr uint32_t busy = UINT32_MAX;
+
+  struct Shared {
+    std::atomic<uint32_t> last_id;
+    std::atomic<uint64_t> arena_used;
+  };
+  struct Slot {
+    std::atomic<uint32_t> id;  // empty, busy, or the id of the string hashed here
+    uint32_t hash;
+  };
+  struct Entry {
+    uint64_t offset;  // Into the arena
+    uint64_t length;
+  };
+
+  uint32_t max_strings = 0;
+  uint32_t capacity = 0;  // Slots; a power of two
+  size_t arena_size = 0;
+  unsigned char *mapping = nullptr;
+  size_t mapping_size = 0;
+  Shared *shared = nullptr;
+  Slot *slots = nullptr;
+  Entry *entries = nullptr;  // Indexed by id; 0 is never handed out
+  char *arena = nullptr;
+
+  static uint32_t fnv1a(std::string_view str) {
+    uint32_t hash = 2166136261u;
+    for (char c : str) {
+      hash = (hash ^ static_cast<unsigned char>(c)) * 16777619u;
+    }
+    return hash;
+  }
+
+  // Ids and arena space that were claimed without enough of the other to go with them are just lost, but by then the
+  // table is full anyway
+  uint32_t insert(std::string_view str) {
+    if (shared->last_id.load(std::memory_order_relaxed) >= max_strings ||
+        shared->arena_used.load(std::memory_order_relaxed) + str.size() > arena_size) {
+      return empty;
+    }
+    uint64_t offset = shared->arena_used.fetch_add(str.size(), std::memory_order_relaxed);
+    if (offset + str.size() > arena_size) {
+      return empty;
+    }
+    uint32_t id = shared->last_id.fetch_add(1, std::memory_order_relaxed) + 1;
+    if (id > max_strings) {
+      return empty;
+    }
+    str.copy(arena + offset, str.size());
+    entries[id] = Entry{offset, str.size()};
+    return id;
+  }
+};
+
+// An entry is a header of eight size_t's (total size, entry count, value count, flags, then the offsets of the four
+// columns), followed by the lines, filenames, names and values columns.  Strings are stored with their terminators.
+// With the interned flag, the filenames and names columns each start with one StringTable id per record, and only the
+// strings with an id of 0 follow, in order.  The names and values columns are padded out to 8-byte alignment.
+struct RBLayout {
+  static constexpr size_t header_size = 8 * sizeof(size_t);
+  static constexpr size_t interned = 1 << 0;
+
+  size_t num_entries;
+  size_t num_values;
+  size_t flags;
+  size_t lines_offset;
+  size_t filenames_offset;
+  size_t names_offset;
+  size_t values_offset;
+  size_t size;
+
+  RBLayout(size_t _num_entries, size_t filenames_size, size_t names_size, size_t _num_values, size_t _flags = 0)
+    : num_entries{_num_entries}, num_values{_num_values}, flags{_flags} {
+    lines_offset = header_size;
+    filenames_offset = lines_offset + num_entries * sizeof(int64_t);
+    names_offset = ALIGN_8(filenames_offset + filenames_size);
+    values_offset = ALIGN_8(names_offset + names_size);
+    size = values_offset + num_values * sizeof(int64_t);
+  }
+
+  // Returns where the lines column starts
+  unsigned char *write_header(unsigned char *write_ptr) const {
+    for (size_t val :
+         {size, num_entries, num_values, flags, lines_offset, filenames_offset, names_offset, values_offset}) {
+      memcpy(write_ptr, &val, sizeof(val));
+      write_ptr += sizeof(val);
+    }
+    return write_ptr;
+  }
 };
 
 struct RBIn {
+  // With a string table (RingBuffer::strings()), filenames and names are stored as ids, and only the ones the table had
+  // no room for are copied.  It has to be the table of the ring the entry is written to.
+  // Strings aren't copied when they're pushed, only when the entry is written, so they have to stay alive until then.
+  explicit RBIn(StringTable *_strings = nullptr) : strings{_strings && _strings->enabled() ? _strings : nullptr} {}
+
   Buffer<int64_t> lines;
   Buffer<std::string_view> filenames;
   Buffer<std::string_view> names;
+  Buffer<uint32_t> filename_ids;
+  Buffer<uint32_t> name_ids;
   std::vector<int64_t> values;
+  StringTable *strings;
 
-  size_t serializedSize() const {
-    size_t total_size = sizeof(size_t) * 7;  // FIXME make this computed
-    total_size += lines.serializedSize();
-    total_size += filenames.serializedSize();
-    total_size += names.serializedSize();
-    total_size += values.size() * sizeof(int64_t);
-    return total_size;
+  RBLayout layout() const {
+    return RBLayout{lines.size(), filename_ids.serializedSize() + filenames.serializedSize(),
+                    name_ids.serializedSize() + names.serializedSize(), values.size(),
+                    strings ? RBLayout::interned : 0};
   }
 
+  size_t serializedSize() const { return layout().size; }
+
   void push(std::string_view filename, std::string_view name, int64_t line) {
-    filenames.add(filename);
-    names.add(name);
+    push_string(filename, filename_ids, filenames);
+    push_string(name, name_ids, names);
     lines.add(line);
   }
 
@@ -80,51 +276,54 @@ struct RBIn {
     lines.clear();
     filenames.clear();
     names.clear();
+    filename_ids.clear();
+    name_ids.clear();
     values.clear();
   }
 
-  void serialize(const size_t val, unsigned char *&write_ptr) {
-    memcpy(write_ptr, &val, sizeof(val));
-    write_ptr += sizeof(val);
+  void push_string(std::string_view str, Buffer<uint32_t> &ids, Buffer<std::string_view> &inline_strings) {
+    uint32_t id = 0;
+    if (strings) {
+      id = strings->intern(str);
+      ids.add(id);
+    }
+    if (!id) {
+      inline_strings.add(str);
+    }
   }
 
   template<typename T>
   void serialize_buffer(const Buffer<T> &buffer, unsigned char *&write_ptr) {
     size_t sz = buffer.serializedSize();
-    memcpy(write_ptr, buffer.data(), sz);
+    if (sz) {
+      memcpy(write_ptr, buffer.data(), sz);  // data() may be null when empty
+    }
     write_ptr += sz;
   }
 
+  void serialize_buffer(const Buffer<std::string_view> &buffer, unsigned char *&write_ptr) {
+    buffer.serialize(write_ptr);
+  }
+
   template<typename T>
   void serialize_vector(const std::vector<T> &buffer, unsigned char *&write_ptr) {
     size_t sz = buffer.size() * sizeof(T);
-    memcpy(write_ptr, buffer.data(), sz);
+    if (sz) {
+      memcpy(write_ptr, buffer.data(), sz);  // data() may be null when empty
+    }
     write_ptr += sz;
   }
 
-  void serialize(unsigned char *write_ptr) {
-    size_t serialized_sz = serializedSize();
-    size_t sz = sizeof(size_t);
-    serialize(serialized_sz, write_ptr);
-    serialize(get_size(), write_ptr);
-    serialize(values.size(), write_ptr);
-
-    // Store the offsets
-    size_t lines_offset = 7 * sizeof(size_t);  // FIXME make this computed
-    size_t filenames_offset = lines_offset + lines.serializedSize();
-    size_t names_offset = filenames_offset + filenames.serializedSize();
-    size_t values_offset = names_offset + names.serializedSize();
-
-    // Write down the offsets
-    serialize(lines_offset, write_ptr);
-    serialize(filenames_offset, write_ptr);
-    serialize(names_offset, write_ptr);
-    serialize(values_offset, write_ptr);
-
-    // Next, write the lines
+  void serialize(unsigned char *start) {
+    RBLayout layout = this->layout();
+    unsigned char *write_ptr = layout.write_header(start);
     serialize_buffer<int64_t>(lines, write_ptr);
-    serialize_buffer<std::string>(filenames, write_ptr);
-    serialize_buffer<std::string>(names, write_ptr);
+    serialize_buffer(filename_ids, write_ptr);
+    serialize_buffer(filenames, write_ptr);
+    write_ptr = start + layout.names_offset;
+    serialize_buffer(name_ids, write_ptr);
+    serialize_buffer(names, write_ptr);
+    write_ptr = start + layout.values_offset;
     serialize_vector<int64_t>(values, write_ptr);
   }
 };
@@ -132,7 +331,10 @@ struct RBIn {
 using IteratorFunction = std::function<void(std::string_view, std::string_view, int64_t)>;
 class RBOut {
  public:
-  RBOut(unsigned char *_buffer, IteratorFunction _iterate) : buffer_start{_buffer}, iterate{_iterate} { deserialize(); }
+  RBOut(unsigned char *_buffer, IteratorFunction _iterate, const StringTable *_strings = nullptr)
+    : buffer_start{_buffer}, iterate{_iterate}, strings{_strings} {
+    deserialize();
+  }
 
   size_t get_size() const { return buffer_size; }
 
@@ -140,6 +342,7 @@ class RBOut {
   const unsigned char *buffer_start;
   size_t buffer_size;
   IteratorFunction iterate;
+  const StringTable *strings;
 
   template<typename T>
   T read(unsigned char *&buffer) {
@@ -157,6 +360,7 @@ class RBOut {
     buffer_size = read(buffer);
     size_t num_entries = read(buffer);
     size_t num_values = read(buffer);
+    size_t flags = read(buffer);
 
     // Read the offsets
     size_t lines_offset = read(buffer);
@@ -168,13 +372,17 @@ class RBOut {
     const int64_t *lines = reinterpret_cast<const int64_t *>(buffer_start + lines_offset);
     buffer += lines_offset;
 
-    // Read the filenames
-    const char *filenames = reinterpret_cast<const char *>(buffer_start + filenames_offset);
-    buffer += filenames_offset;
-
-    // Read the names
-    const char *names = reinterpret_cast<const char *>(buffer_start + names_offset);
-    buffer += names_offset;
+    // Read the filenames and names, which start with their ids if they're interned
+    const uint32_t *filename_ids = nullptr;
+    const uint32_t *name_ids = nullptr;
+    size_t ids_size = 0;
+    if (flags & RBLayout::interned) {
+      filename_ids = reinterpret_cast<const uint32_t *>(buffer_start + filenames_offset);
+      name_ids = reinterpret_cast<const uint32_t *>(buffer_start + names_offset);
+      ids_size = num_entries * sizeof(uint32_t);
+    }
+    const char *filenames = reinterpret_cast<const char *>(buffer_start + filenames_offset + ids_size);
+    const char *names = reinterpret_cast<const char *>(buffer_start + names_offset + ids_size);
 
     // Read the values
     std::vector<int64_t> values;
@@ -184,25 +392,45 @@ class RBOut {
 
     // Iterate over the entries
     for (size_t i = 0; i < num_entries; i++) {
-      iterate(filenames, names, lines[i]);
-      filenames += strlen(filenames) + 1;
-      names += strlen(names) + 1;
+      iterate(string_at(filename_ids, i, filenames), string_at(name_ids, i, names), lines[i]);
     }
   }
+
+  // Interned strings are looked up by id, the others are taken from the inline strings in order
+  std::string_view string_at(const uint32_t *ids, size_t i, const char *&inline_strings) {
+    if (ids && ids[i]) {
+      return strings->resolve(ids[i]);
+    }
+    std::string_view str{inline_strings};
+    inline_strings += str.size() + 1;
+    return str;
+  }
 };
 
 // A simple shared-memory ringbuffer
 class RingBuffer {
  public:
-  RingBuffer(size_t size) {
+  // With use_eventfd, producers also signal an eventfd when the reader is waiting, so that it can wait in epoll.
+  // With intern_strings, filenames and names are interned (see StringTable), up to that many distinct strings.
+  RingBuffer(size_t size, bool use_eventfd = false, uint32_t intern_strings = 0)
+    : string_table{intern_strings, intern_strings * interned_string_size} {
     this->size = PAGE_ALIGN(size);
 
     // We want a file-descriptor backed region, we try a few ways to get one.
     if (!buffer_from_memfd() && !buffer_from_tmpfile()) {
       throw std::runtime_error("Failed to create ring buffer");
     }
+    if (use_eventfd && (event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+      munmap(buffer, this->size * 2);
+      throw std::runtime_error("Failed to create eventfd");
+    }
+  }
+  ~RingBuffer() {
+    munmap(buffer, size * 2);
+    if (event_fd != -1) {
+      close(event_fd);
+    }
   }
-  ~RingBuffer() { munmap(buffer, size * 2); }
 
   void *operator new(size_t sz) {
     void *ptr = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
@@ -214,66 +442,230 @@ class RingBuffer {
 
   void operator delete(void *ptr) { munmap(ptr, sizeof(RingBuffer)); }
 
-  bool write(RBIn &entry) {
-    size_t serialized_sz = entry.serializedSize();
-    bool pending = true;
-    size_t saved_write = 0;
-    int tries = 3;
-
-    while (pending) {
-      saved_write = write_pos.load(std::memory_order_relaxed);
-      size_t saved_read = read_pos.load(std::memory_order_acquire);
-      size_t next_write = saved_write + serialized_sz;  // don't wraparound yet
-
-      // Since the buffer is mirrors, we just add the size to the read position and
-      // compare that to the new write position.
-      if (next_write < saved_read + size) {
-        // We have enough room.  Do a compare and swap.
-        if (write_pos.compare_exchange_strong(saved_write, next_write % size)) {
-          pending = false;
-        } else {
-          // CAS failed, try again
-          if (--tries > 0) {
-            std::this_thread::yield();
-            continue;
-          } else {
-            // We've tried too many times, fail
-            return false;
-          }
+  // Room in the ring for one entry, handed out by reserve().  Like a span: data() is size() contiguous bytes (the
+  // mirror mapping takes care of wrapping), which the caller fills in place before passing it to commit().
+  class Reservation {
+   public:
+    unsigned char *data() const { return entry_ptr ? entry_ptr + sizeof(RBHeader) : nullptr; }
+    size_t size() const { return entry_size; }
+    explicit operator bool() const { return entry_ptr != nullptr; }
+
+   private:
+    friend class RingBuffer;
+    unsigned char *entry_ptr = nullptr;
+    size_t entry_size = 0;
+  };
+
+  // Any number of producers (threads, or processes sharing this object) can reserve at once.  Each one gets room for
+  // its entry by moving write_pos forward.  Returns an empty reservation if the buffer is full.
+  // Every reservation has to be committed, and promptly: the consumer can't get past one that hasn't been.
+  Reservation reserve(size_t entry_size) {
+    Reservation reservation;
+    size_t length = ALIGN_8(sizeof(RBHeader) + entry_size);
+    if (length > size) {
+      return reservation;
+    }
+
+    // read_pos only moves forward, so if there's room now there's still room when the CAS lands.  Producers check
+    // against their cached copy of it, and only go to the consumer's cache line when the buffer looks full.
+    uint64_t saved_write = write_pos.load(std::memory_order_relaxed);
+    uint64_t saved_read = cached_read_pos.load(std::memory_order_acquire);
+    do {
+      if (saved_write + length - saved_read > size) {
+        saved_read = read_pos.load(std::memory_order_acquire);
+        if (saved_write + length - saved_read > size) {
+          return reservation;
         }
-      } else {
-        // There's not enough room, fail
-        return false;
+        // Racing producers may store an older value, which only costs an extra refresh
+        cached_read_pos.store(saved_read, std::memory_order_release);
       }
+    } while (!write_pos.compare_exchange_weak(saved_write, saved_write + length, std::memory_order_relaxed));
+
+    // Since the buffer is mirrored, the entry is contiguous even if it wraps around
+    reservation.entry_ptr = buffer + saved_write % size;
+    reservation.entry_size = entry_size;
+    return reservation;
+  }
+
+  // Publishes the entry by storing its length in its header
+  void commit(Reservation &reservation) {
+    header(reservation.entry_ptr)->length.store(ALIGN_8(sizeof(RBHeader) + reservation.entry_size),
+                                                std::memory_order_release);
+    reservation = Reservation{};
+
+    // Pairs with the fence in prepare_wait(): either the reader sees the entry, or we see that it's asleep
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (reader_waiting.load(std::memory_order_relaxed)) {
+      wake();
+    }
+  }
+
+  // Fails if the buffer is full
+  bool write(RBIn &entry) {
+    Reservation reservation = reserve(entry.serializedSize());
+    if (!reservation) {
+      return false;
     }
+    entry.serialize(reservation.data());
+    commit(reservation);
+    return true;
+  }
 
-    // If we're here, then we've successfully reserved space in the buffer.
-    // Write down the serialized size
-    entry.serialize(buffer + saved_write);
+  // A single-record entry, written straight into the ring without going through an RBIn
+  bool write(std::string_view filename, std::string_view name, int64_t line) {
+    bool interned = string_table.enabled();
+    uint32_t filename_id = string_table.intern(filename);
+    uint32_t name_id = string_table.intern(name);
+    RBLayout layout{1, string_size(filename, filename_id, interned), string_size(name, name_id, interned), 0,
+                    interned ? RBLayout::interned : 0};
+    Reservation reservation = reserve(layout.size);
+    if (!reservation) {
+      return false;
+    }
+    memcpy(layout.write_header(reservation.data()), &line, sizeof(line));
+    write_string(reservation.data() + layout.filenames_offset, filename, filename_id, interned);
+    write_string(reservation.data() + layout.names_offset, name, name_id, interned);
+    commit(reservation);
     return true;
   }
 
+  // Single consumer.  Returns false if the buffer is empty, or if the next entry hasn't been published yet (even if
+  // later ones have).
   bool read(IteratorFunction fun) {
-    // If there's no data to read, then return false
-    if (read_pos.load(std::memory_order_relaxed) == write_pos.load(std::memory_order_acquire)) {
+    uint64_t saved_read = read_pos.load(std::memory_order_relaxed);
+    unsigned char *entry_ptr = buffer + saved_read % size;
+    uint64_t length = header(entry_ptr)->length.load(std::memory_order_acquire);
+    if (!length) {
       return false;
     }
-    RBOut out{read_pos.load(std::memory_order_relaxed) + buffer, fun};
+    RBOut out{entry_ptr + sizeof(RBHeader), fun, &string_table};
 
-    // Add the size of the entry to the read position and wraparound
-    size_t serialized_sz = out.get_size();
-    size_t saved_read = read_pos.load(std::memory_order_relaxed);
-    size_t next_read = saved_read + serialized_sz;
-    read_pos.store(next_read % size, std::memory_order_release);
+    // Unpublished headers have to read as zero, wherever the next entries happen to start, so the space is cleared
+    // before it's handed back to the producers
+    header(entry_ptr)->length.store(0, std::memory_order_relaxed);
+    memset(entry_ptr + sizeof(RBHeader), 0, length - sizeof(RBHeader));
+    read_pos.store(saved_read + length, std::memory_order_release);
     return true;
   }
 
+  // Like read(), but if there's nothing to read, sleeps until a producer publishes an entry or the timeout runs out.
+  // An idle reader costs nothing, and producers only pay for a wakeup while it's asleep.
+  bool read_wait(IteratorFunction fun, std::chrono::milliseconds timeout) {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (!read(fun)) {
+      uint32_t seq = wake_seq.load(std::memory_order_acquire);
+      if (prepare_wait()) {
+        auto remaining = deadline - std::chrono::steady_clock::now();
+        if (remaining <= std::chrono::nanoseconds::zero()) {
+          finish_wait();
+          return false;
+        }
+        futex_wait(&wake_seq, seq, std::chrono::duration_cast<std::chrono::nanoseconds>(remaining));
+      }
+      finish_wait();
+    }
+    return true;
+  }
+
+  // For waiting on the eventfd in epoll (or poll, or select), instead of in read_wait():
+  //   if (rb.prepare_wait()) epoll_wait(...);
+  //   rb.finish_wait();
+  //   while (rb.read(fun)) ...
+  // prepare_wait() tells producers that the reader is about to sleep, and returns false if there's already something to
+  // read.  finish_wait() has to be called either way.
+  bool prepare_wait() {
+    reader_waiting.store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return !readable();
+  }
+
+  void finish_wait() {
+    reader_waiting.store(0, std::memory_order_relaxed);
+    if (event_fd != -1) {
+      uint64_t count;
+      while (::read(event_fd, &count, sizeof(count)) > 0) {
+      }
+    }
+  }
+
+  // -1 unless the buffer was created with use_eventfd
+  int get_eventfd() const { return event_fd; }
+
+  // For building RBIn's that intern their strings; null unless the buffer was created with intern_strings
+  StringTable *strings() { return string_table.enabled() ? &string_table : nullptr; }
+
  private:
+  // Precedes every entry
+  struct RBHeader {
+    std::atomic<uint64_t> length;  // Whole entry, header and padding included; 0 until the entry is published
+  };
+
+  // Fields that are written by one side and polled by the other each get their own cache line, so that a producer's
+  // CAS doesn't keep invalidating the line the consumer is reading from (and the other way around)
+  static constexpr size_t cache_line = 64;
+
+  // Read-only after construction
   size_t size;
-  std::atomic<size_t> read_pos{0};
-  std::atomic<size_t> write_pos{0};
   unsigned char *buffer;
   unsigned char *buffer_mirror;
+  int event_fd = -1;
+  StringTable string_table;
+  static constexpr size_t interned_string_size = 64;  // Arena space per string, on average
+
+  // Producers.  The consumer never looks at write_pos, it goes by the entry headers instead.
+  // Positions never wrap, offsets are pos % size.
+  alignas(cache_line) std::atomic<uint64_t> write_pos{0};  // End of the newest reservation
+  std::atomic<uint64_t> cached_read_pos{0};                // Some past value of read_pos, never ahead of it
+
+  // Consumer
+  alignas(cache_line) std::atomic<uint64_t> read_pos{0};  // Start of the oldest entry; only the consumer moves it
+
+  // Sleeping.  Producers read reader_waiting on every write, but it only changes when the reader runs dry.
+  alignas(cache_line) std::atomic<uint32_t> wake_seq{0};  // Futex word; producers bump it to wake the reader
+  std::atomic<uint32_t> reader_waiting{0};                // Nonzero while the reader is (about to be) asleep
+
+  static RBHeader *header(unsigned char *entry_ptr) { return reinterpret_cast<RBHeader *>(entry_ptr); }
+
+  // A single record's filename or name: its id if the entry is interned, and the string itself if it has no id
+  static size_t string_size(std::string_view str, uint32_t id, bool interned) {
+    return (interned ? sizeof(id) : 0) + (id ? 0 : str.size() + 1);
+  }
+
+  static void write_string(unsigned char *write_ptr, std::string_view str, uint32_t id, bool interned) {
+    if (interned) {
+      memcpy(write_ptr, &id, sizeof(id));
+      write_ptr += sizeof(id);
+    }
+    if (!id) {
+      char *dest = reinterpret_cast<char *>(write_ptr);
+      dest[str.copy(dest, str.size())] = '\0';
+    }
+  }
+
+  bool readable() {
+    unsigned char *entry_ptr = buffer + read_pos.load(std::memory_order_relaxed) % size;
+    return header(entry_ptr)->length.load(std::memory_order_acquire) != 0;
+  }
+
+  void wake() {
+    wake_seq.fetch_add(1, std::memory_order_release);
+    futex_wake(&wake_seq);
+    if (event_fd != -1) {
+      uint64_t one = 1;
+      if (::write(event_fd, &one, sizeof(one)) < 0) {
+        // Only fails if the counter is saturated, in which case the reader has plenty to wake up for
+      }
+    }
+  }
+
+  // This object lives in MAP_SHARED memory (see operator new), so the futex can't be process-private
+  static void futex_wait(std::atomic<uint32_t> *word, uint32_t expected, std::chrono::nanoseconds timeout) {
+    auto seconds = std::chrono::duration_cast<std::chrono::seconds>(timeout);
+    struct timespec ts = {static_cast<time_t>(seconds.count()), static_cast<long>((timeout - seconds).count())};
+    syscall(SYS_futex, word, FUTEX_WAIT, expected, &ts, NULL, 0);
+  }
+
+  static void futex_wake(std::atomic<uint32_t> *word) { syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0); }
 
   bool try_map(int fd) {
     // Map the memfd into memory.  Map 2x what we need so we can mirror the buffer
@@ -317,8 +709,8 @@ class RingBuffer {
   }
   bool buffer_from_tmpfile() {
     // Directories to try
-    constexpr std::array<std::string_view, 4> dirs = {
-      "/tmp"
+    constexpr std::array<std::string_view, 5> dirs = {
+      "/tmp",
       "/dev/shm",
       "/run/shm",
       "/var/tmp",
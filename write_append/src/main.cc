@@ -1,4 +1,4 @@
-#include "libmmlog.h"
+#include "mmlog.hpp"
 #include <algorithm>
 #include <chrono>
 #include <cstring>
@@ -15,12 +15,16 @@
 #include <unistd.h>
 #include <vector>
 enum class AppendMethod {
-    WRITE_APPEND,   // O_APPEND with write()
-    WRITEV_APPEND,  // writev() with O_APPEND
-    FWRITE_APPEND,  // FILE streams with "a" mode
-    DIRECT_APPEND,  // O_DIRECT + O_APPEND
-    AIO_APPEND,     // Linux AIO with O_APPEND
-    MMLOG_APPEND,   // Memory-mapped log
+    WRITE_APPEND,        // O_APPEND with write()
+    WRITEV_APPEND,       // writev() with O_APPEND
+    FWRITE_APPEND,       // FILE streams with "a" mode
+    DIRECT_APPEND,       // O_DIRECT + O_APPEND
+    AIO_APPEND,          // Linux AIO with O_APPEND
+    MMLOG_APPEND,        // Memory-mapped log
+    MMLOG_ASYNC_APPEND,  // Memory-mapped log, with writeback started as chunks are retired
+    MMLOG_GROUP_APPEND,  // Memory-mapped log, with a sync thread doing group fdatasync()
+    MMLOG_SYNC_APPEND,   // Memory-mapped log, waiting for group fdatasync() after every append
+    MMLOG_BATCH_APPEND,  // Memory-mapped log, with mmlog_insert_batch() a batch of appends at a time
 };
 
 class FileAppender {
@@ -31,10 +35,12 @@ class FileAppender {
     io_context_t aio_ctx_ = 0;
     void* aligned_buffer_ = nullptr;
     size_t aligned_buffer_size_ = 0;
-    log_handle_t* mmlog_handle_ = nullptr;
+    mmlog::Log mmlog_;
+    size_t batch_size_;
+    std::vector<struct iovec> batch_;
 
   public:
-    FileAppender(AppendMethod method) : method_(method)
+    FileAppender(AppendMethod method, size_t batch_size = 1) : method_(method), batch_size_(batch_size)
     {
     }
 
@@ -71,10 +77,14 @@ class FileAppender {
                 io_setup(128, &aio_ctx_);
                 return fd_ != -1;
             case AppendMethod::MMLOG_APPEND:
-                mmlog_handle_ = mmlog_open(filename.c_str(), 8 * 4096, 4);
-                bool ret = mmlog_handle_ != nullptr;
+            case AppendMethod::MMLOG_ASYNC_APPEND:
+            case AppendMethod::MMLOG_GROUP_APPEND:
+            case AppendMethod::MMLOG_SYNC_APPEND:
+            case AppendMethod::MMLOG_BATCH_APPEND:
+                mmlog_ = mmlog::Log(filename.c_str(), 8 * 4096, 4);
+                bool ret = mmlog_ && mmlog_set_durability(mmlog_.handle(), GetDurability(), 10);
                 if (!ret) {
-                    std::cout << "Could not open mmlog: " << mmlog_strerror_cur() << std::endl;
+                    std::cout << "Could not open mmlog: " << mmlog::Log::error() << std::endl;
                 }
                 return ret;
         }
@@ -118,11 +128,31 @@ class FileAppender {
                 return io_getevents(aio_ctx_, 1, 1, events, NULL) == 1;
             }
             case AppendMethod::MMLOG_APPEND:
-                return mmlog_insert(mmlog_handle_, data, size);
+            case AppendMethod::MMLOG_ASYNC_APPEND:
+            case AppendMethod::MMLOG_GROUP_APPEND:
+            case AppendMethod::MMLOG_BATCH_APPEND:
+                return mmlog_.insert(data, size);
+            case AppendMethod::MMLOG_SYNC_APPEND:
+                return mmlog_.insert(data, size) && mmlog_sync(mmlog_.handle(), MMLOG_SYNC_ALL);
         }
         return false;
     }
 
+    // Appends the same buffer `count` times; only the batch method does it in one call
+    bool AppendBatch(const void* data, size_t size, size_t count)
+    {
+        if (method_ != AppendMethod::MMLOG_BATCH_APPEND || count == 1) {
+            for (size_t i = 0; i < count; i++) {
+                if (!Append(data, size)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+        batch_.assign(count, {const_cast<void*>(data), size});
+        return mmlog_insert_batch(mmlog_.handle(), batch_.data(), batch_.size());
+    }
+
     void Close()
     {
         if (fd_ != -1) {
@@ -145,9 +175,19 @@ class FileAppender {
             aligned_buffer_ = nullptr;
         }
 
-        if (mmlog_handle_) {
-            mmlog_trim(mmlog_handle_);
-            mmlog_handle_ = nullptr;
+        mmlog_.close();
+    }
+
+    uint32_t GetDurability() const
+    {
+        switch (method_) {
+            case AppendMethod::MMLOG_ASYNC_APPEND:
+                return MMLOG_DURABILITY_ASYNC;
+            case AppendMethod::MMLOG_GROUP_APPEND:
+            case AppendMethod::MMLOG_SYNC_APPEND:
+                return MMLOG_DURABILITY_GROUP;
+            default:
+                return MMLOG_DURABILITY_NONE;
         }
     }
 
@@ -166,6 +206,14 @@ class FileAppender {
                 return "Linux AIO";
             case AppendMethod::MMLOG_APPEND:
                 return "mmlog";
+            case AppendMethod::MMLOG_ASYNC_APPEND:
+                return "mmlog (async writeback)";
+            case AppendMethod::MMLOG_GROUP_APPEND:
+                return "mmlog (group fdatasync)";
+            case AppendMethod::MMLOG_SYNC_APPEND:
+                return "mmlog (group fdatasync, wait)";
+            case AppendMethod::MMLOG_BATCH_APPEND:
+                return "mmlog (batches of " + std::to_string(batch_size_) + ")";
         }
         return "Unknown";
     }
@@ -179,7 +227,8 @@ struct BenchmarkResult {
     double throughput_gbps;
 };
 
-BenchmarkResult RunBenchmark(AppendMethod method, int num_processes, int ops_per_process, size_t data_size)
+BenchmarkResult RunBenchmark(AppendMethod method, int num_processes, int ops_per_process, size_t data_size,
+                             size_t batch_size = 1)
 {
     std::string filename = "/tmp/benchmark_" + std::to_string(static_cast<int>(method));
 
@@ -197,13 +246,14 @@ BenchmarkResult RunBenchmark(AppendMethod method, int num_processes, int ops_per
     for (int i = 0; i < num_processes; i++) {
         pid_t pid = fork();
         if (pid == 0) {  // Child process
-            FileAppender appender(method);
+            FileAppender appender(method, batch_size);
             if (!appender.Open(filename)) {
                 exit(1);
             }
 
-            for (int j = 0; j < ops_per_process; j++) {
-                appender.Append(data.data(), data.size());
+            for (int j = 0; j < ops_per_process; j += static_cast<int>(batch_size)) {
+                size_t count = std::min(batch_size, static_cast<size_t>(ops_per_process - j));
+                appender.AppendBatch(data.data(), data.size(), count);
             }
 
             exit(0);
@@ -227,7 +277,7 @@ BenchmarkResult RunBenchmark(AppendMethod method, int num_processes, int ops_per
     auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
 
     // Calculate metrics
-    FileAppender appender(method);
+    FileAppender appender(method, batch_size);
     BenchmarkResult result;
     result.method_name = appender.GetMethodName();
     result.duration_ms = duration.count();
@@ -238,7 +288,6 @@ BenchmarkResult RunBenchmark(AppendMethod method, int num_processes, int ops_per
     double seconds = duration.count() / 1000.0;
     result.throughput_gbps = (total_bytes / seconds) / (1024 * 1024 * 1024) * 8;
     return result;
-    return result;
 }
 
 int main(int argc, char* argv[])
@@ -247,6 +296,7 @@ int main(int argc, char* argv[])
     const int NUM_PROCESSES = 4;
     const int OPS_PER_PROCESS = 10000;
     const size_t DATA_SIZE = 4095;
+    const size_t BATCH_SIZES[] = {1, 4, 16, 64, 256};
 
     // Process command-line arguments
     bool run_all = argc == 1;  // Run all if no args provided
@@ -259,6 +309,10 @@ int main(int argc, char* argv[])
             std::cout << "Usage: " << argv[0] << " [benchmark_names...]\n"
                       << "Available benchmarks:\n"
                       << "  mmlog   - Memory-mapped log\n"
+                      << "  mmlog_async - Memory-mapped log, async writeback of retired chunks\n"
+                      << "  mmlog_group - Memory-mapped log, group fdatasync() every 10ms\n"
+                      << "  mmlog_sync  - Memory-mapped log, waiting on group fdatasync() after every append\n"
+                      << "  mmlog_batch - Memory-mapped log, mmlog_insert_batch() with a sweep of batch sizes\n"
                       << "  write   - O_APPEND with write()\n"
                       << "  writev  - writev() with O_APPEND\n"
                       << "  fwrite  - FILE streams (fwrite)\n"
@@ -289,6 +343,29 @@ int main(int argc, char* argv[])
         results.push_back(RunBenchmark(AppendMethod::MMLOG_APPEND, NUM_PROCESSES, OPS_PER_PROCESS, DATA_SIZE));
     }
 
+    if (run_all ||
+        std::find(benchmarks_to_run.begin(), benchmarks_to_run.end(), "mmlog_async") != benchmarks_to_run.end()) {
+        results.push_back(RunBenchmark(AppendMethod::MMLOG_ASYNC_APPEND, NUM_PROCESSES, OPS_PER_PROCESS, DATA_SIZE));
+    }
+
+    if (run_all ||
+        std::find(benchmarks_to_run.begin(), benchmarks_to_run.end(), "mmlog_group") != benchmarks_to_run.end()) {
+        results.push_back(RunBenchmark(AppendMethod::MMLOG_GROUP_APPEND, NUM_PROCESSES, OPS_PER_PROCESS, DATA_SIZE));
+    }
+
+    if (run_all ||
+        std::find(benchmarks_to_run.begin(), benchmarks_to_run.end(), "mmlog_sync") != benchmarks_to_run.end()) {
+        results.push_back(RunBenchmark(AppendMethod::MMLOG_SYNC_APPEND, NUM_PROCESSES, OPS_PER_PROCESS, DATA_SIZE));
+    }
+
+    if (run_all ||
+        std::find(benchmarks_to_run.begin(), benchmarks_to_run.end(), "mmlog_batch") != benchmarks_to_run.end()) {
+        for (size_t batch_size : BATCH_SIZES) {
+            results.push_back(
+                RunBenchmark(AppendMethod::MMLOG_BATCH_APPEND, NUM_PROCESSES, OPS_PER_PROCESS, DATA_SIZE, batch_size));
+        }
+    }
+
     if (run_all || std::find(benchmarks_to_run.begin(), benchmarks_to_run.end(), "write") != benchmarks_to_run.end()) {
         results.push_back(RunBenchmark(AppendMethod::WRITE_APPEND, NUM_PROCESSES, OPS_PER_PROCESS, DATA_SIZE));
     }